@@ -23,6 +23,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
 
 #include "mmc_cmds.h"
 
@@ -61,6 +64,28 @@ static struct Command commands[] = {
 		  "Write <value> at offset <offset> to <device>'s extcsd.",
 	  NULL
 	},
+	{ do_dump_extcsd, 2,
+	  "extcsd dump", "<device> <file|->\n"
+		"Append the raw 512 byte EXT_CSD of <device> to <file>, or write\n"
+		"it to stdout if <file> is -.",
+	  NULL
+	},
+	{ do_decode_extcsd, 1,
+	  "extcsd decode", "<file|->\n"
+		"Decode raw EXT_CSD records, as written by 'extcsd dump', from\n"
+		"<file> or stdin if <file> is -. Several records may be\n"
+		"concatenated in one stream.",
+	  NULL
+	},
+	{ do_diff_extcsd, -1,
+	  "extcsd diff", "[-H] <file|device|->...\n"
+		"Compare raw EXT_CSD records, from 'extcsd dump' files, stdin or\n"
+		"live devices, against the first one and print the differing\n"
+		"fields. Exits with 1 if any record differs.\n"
+		"-H  instead print a value histogram of every varying byte across\n"
+		"    all records.",
+	  NULL
+	},
 	{ do_writeprotect_boot_get, -1,
 	  "writeprotect boot get", "<device>\n"
 		"Print the boot partitions write protect status for <device>.",
@@ -92,8 +117,12 @@ static struct Command commands[] = {
 	  NULL
 	},
 	{ do_writeprotect_user_get, -1,
-	  "writeprotect user get", "<device>\n"
-		"Print the user areas write protect configuration for <device>.",
+	  "writeprotect user get", "[-c] <device>\n"
+		"Print the user areas write protect configuration for <device>.\n"
+		"-c  Use the map cached by an earlier run, re-reading only the\n"
+		"    groups at its run boundaries and a random sample. Falls\n"
+		"    back to a full scan, which refreshes the cache, if the\n"
+		"    device, its USER_WP or any re-read group differs.",
 	  NULL
 	},
 	{ do_disable_512B_emulation, -1,
@@ -116,6 +145,22 @@ static struct Command commands[] = {
 		"Enable write reliability per partition for the <device>.\nDry-run only unless -y or -c is passed.\nUse -c if more partitioning settings are still to come.\nNOTE!  This is a one-time programmable (unreversible) change.",
 	  NULL
 	},
+	{ do_layout_plan, -3,
+	  "layout plan", "<-y|-n> " "<area spec>... " "<device>\n"
+		"Plan the whole partition layout of <device> in one go, rounding\n"
+		"sizes up to write protect groups and checking MAX_ENH_SIZE_MULT.\n"
+		"Each <area spec> is one of:\n"
+		"  gp<1-4>=<size>|max[:enh|:ext1|:ext2][:rel]\n"
+		"  user[=<size>|max[@<start>]:enh][:rel]\n"
+		"<size> and <start> are in KiB unless suffixed with K, M or G.\n"
+		"\"max\" shares the enhanced capacity left among those areas.\n"
+		"ext1/ext2 set the system code/non-persistent extended attribute\n"
+		"and rel enables write reliability.\n"
+		"Dry-run only unless -y is passed, in which case the layout and\n"
+		"PARTITION_SETTING_COMPLETED are written in a single sequence.\n"
+		"NOTE!  This is a one-time programmable (unreversible) change.",
+	  NULL
+	},
 	{ do_status_get, -1,
 	  "status get", "<device>\n"
 	  "Print the response to STATUS_SEND (CMD13).",
@@ -134,6 +179,18 @@ static struct Command commands[] = {
 	  "<boot_bus_width> must be \"x1|x4|x8\"",
 	  NULL
 	},
+	{ do_bkops_run, -1,
+	  "bkops run", "<device> [poll_ms] [duration_s]\n"
+		"Run manual background operations on <device> while it is idle.\n"
+		"Every [poll_ms] (default 100) the block layer statistics of\n"
+		"<device> are sampled; when no I/O was seen and BKOPS_STATUS\n"
+		"reports pending work, BKOPS_START is issued. If I/O resumes\n"
+		"while the device is busy, the operation is interrupted with HPI.\n"
+		"Runs for [duration_s] seconds, or until interrupted if omitted,\n"
+		"then prints how much background work was absorbed.\n"
+		"NOTE! Requires manual BKOPS to be enabled, see 'bkops_en'.",
+	  NULL
+	},
 	{ do_write_bkops_en, -2,
 	  "bkops_en", "<auto|manual> <device>\n"
 		"Enable the eMMC BKOPS feature on <device>.\n"
@@ -152,9 +209,23 @@ static struct Command commands[] = {
 		"Permanently disable the eMMC H/W Reset feature on <device>.\nNOTE!  This is a one-time programmable (unreversible) change.",
 	  NULL
 	},
+	{ do_sanitize_run, -1,
+	  "sanitize run", "[-p discard|trim] [-d deadline_s] <device>\n"
+		"Sanitize <device>, polling for completion and reporting the\n"
+		"elapsed time. The expected worst case is derived from EXT_CSD.\n"
+		"  -p  Trim or discard the whole user area first, in erase group\n"
+		"      slices, to shrink the sanitize working set.\n"
+		"      NOTE! This deletes all user data of the device.\n"
+		"  -d  Interrupt the sanitize with HPI if still running after\n"
+		"      deadline_s seconds.",
+	  NULL
+	},
 	{ do_sanitize, -1,
 	  "sanitize", "<device> [timeout_ms]\n"
-		"Send Sanitize command to the <device>.\nThis will delete the unmapped memory region of the device.",
+		"Send Sanitize command to the <device>.\nThis will delete the unmapped memory region of the device.\n"
+		"With [timeout_ms], and HPI supported, completion is polled for and\n"
+		"the sanitize is interrupted with HPI once [timeout_ms] passes or\n"
+		"on Ctrl-C.",
 	  NULL
 	},
 	{ do_rpmb_write_key, 2,
@@ -197,6 +268,69 @@ static struct Command commands[] = {
 		  "    mmc rpmb write-block /dev/mmcblk0rpmb 0x02 - -",
 	  NULL
 	},
+	{ do_rpmb_kv_format, -3,
+	  "rpmb kv format", "[-s start] <rpmb device> <key file> <blocks>\n"
+		  "Create a key/value store in <blocks> RPMB blocks from block\n"
+		  "<start> (default 0) of <rpmb device>.",
+	  NULL
+	},
+	{ do_rpmb_kv_put, -3,
+	  "rpmb kv put", "[-s start] <rpmb device> <key file> <name>=<value>|<name>=@<file>...\n"
+		  "Store values in the RPMB key/value store. All values given are\n"
+		  "committed together, in as few authenticated writes as possible.\n"
+		  "@<file> reads the value from <file>, or stdin for @-.",
+	  NULL
+	},
+	{ do_rpmb_kv_get, -3,
+	  "rpmb kv get", "[-s start] <rpmb device> <key file> <name>\n"
+		  "Write the value of <name> in the RPMB key/value store to stdout.",
+	  NULL
+	},
+	{ do_rpmb_kv_del, -3,
+	  "rpmb kv del", "[-s start] <rpmb device> <key file> <name>...\n"
+		  "Delete keys from the RPMB key/value store.",
+	  NULL
+	},
+	{ do_rpmb_kv_list, -2,
+	  "rpmb kv list", "[-s start] <rpmb device> <key file>\n"
+		  "List the keys in the RPMB key/value store and their sizes.",
+	  NULL
+	},
+	{ do_rpmb_kv_compact, -2,
+	  "rpmb kv compact", "[-s start] <rpmb device> <key file>\n"
+		  "Rewrite the live records of the RPMB key/value store, dropping\n"
+		  "overwritten and deleted ones. This happens on its own when the\n"
+		  "log fills up.",
+	  NULL
+	},
+	{ do_rpmb_counter, -1,
+	  "rpmb counter", "[-j journal] <rpmb device>\n"
+		  "Read the write counter of <rpmb device>, record it in a journal\n"
+		  "and forecast when the counter runs out from the history. The\n"
+		  "journal defaults to a file named by the CID in /var/lib/mmc-utils.",
+	  NULL
+	},
+	{ do_rpmb_write_batch, -2,
+	  "rpmb write-batch", "[-w window_ms] [-j journal] <rpmb device> <key file>\n"
+		  "Write \"<address> <hex data>\" lines from stdin to <rpmb device>.\n"
+		  "Updates are buffered for <window_ms> (default 1000); later updates\n"
+		  "of a block replace earlier ones, and contiguous blocks are\n"
+		  "committed in shared authenticated writes. Data longer than 256\n"
+		  "bytes continues at the following blocks.",
+	  NULL
+	},
+	{ do_rpmb_provision, -2,
+	  "rpmb provision", "-k <key dir>|-m <master key file> [-j jobs] <rpmb device>...\n"
+		  "Program the authentication key of all <rpmb device>s in parallel,\n"
+		  "verify each with an authenticated counter read and print a\n"
+		  "report per device. Devices already holding their key are left\n"
+		  "alone.\n"
+		  "  -k  Read the key of each device from <key dir>/<CID>.key.\n"
+		  "  -m  Derive the keys as HMAC-SHA256(master key, CID).\n"
+		  "  -j  Program at most <jobs> devices at once (default all).\n"
+		  "NOTE!  This is a one-time programmable (unreversible) change.",
+	  NULL
+	},
 	{ do_rpmb_sec_wp_enable, 3,
 	  "rpmb secure-wp-mode-on", "<dev> <rpmb device> <key file>\n"
 		  "Enable Secure Write Protection mode.\n"
@@ -263,6 +397,30 @@ static struct Command commands[] = {
 		"NOTE! The cache is an optional feature on devices >= eMMC4.5.",
 	  NULL
 	},
+	{ do_cache_flush, -1,
+	  "cache flush", "[-i] <device>\n"
+		"Flush the eMMC cache [FLUSH_CACHE] of <device> and print how long\n"
+		"it took. With -i, Ctrl-C or the flush timeout interrupts it with HPI.",
+	  NULL
+	},
+	{ do_cache_barrier, -1,
+	  "cache barrier", "<device>\n"
+		"Issue a cache barrier on <device>, so that data cached before it\n"
+		"is committed before data cached after it. Enables BARRIER_CTRL\n"
+		"if needed. Only supported on devices >= eMMC5.1.",
+	  NULL
+	},
+	{ do_cache_bench, -2,
+	  "cache bench", "<device> <scratch file> [max KiB] [iterations]\n"
+		"Measure the cache flush latency of <device> versus the amount of\n"
+		"dirty data. O_DIRECT writes from 4 KiB up to [max KiB] (default\n"
+		"the cache size, capped at 64 MiB, rounded down to 4 KiB) are\n"
+		"issued to <scratch file>, which must reside on <device>, each\n"
+		"followed by a flush.\n"
+		"If BARRIER_CTRL is set, barrier latency is measured as well.\n"
+		"Every size is repeated [iterations] (default 16) times.",
+	  NULL
+	},
 	{ do_read_csd, -1,
 	  "csd read", "<device path>\n"
 		  "Print CSD data from <device path>.\n"
@@ -308,17 +466,64 @@ static struct Command commands[] = {
 	 "Optional FFU mode 4, uses CMD24 Single-block write for repeated downloads, remaining in FFU mode until completion.\n",
 	 NULL
 	},
+	{ do_erase_plan, -5,
+	"erase plan", "<-y|-n> " "<policy> " "<start address> " "<end address> " "<device>\n"
+		"Pick the fastest erase type allowed by <policy> for the range and\n"
+		"print its worst case duration, computed from TRIM_MULT,\n"
+		"ERASE_TIMEOUT_MULT, SEC_TRIM_MULT and SEC_ERASE_MULT.\n"
+		"<policy> must be: discard | erase | secure\n"
+		"    \"discard\" - the data only has to be gone for the host.\n"
+		"    \"erase\"   - the range must read back as erased.\n"
+		"    \"secure\"  - the data must be purged from the flash.\n"
+		"Dry-run only unless -y is passed, in which case the selected\n"
+		"type is executed with its computed timeout.\n"
+		"NOTE!: -y will delete all user data in the specified region of the device\n",
+	NULL
+	},
+	{ do_erase_verify, -4,
+	"erase verify", "[-V percent] [-j threads] <type> " "<start address> " "<end address> " "<device>\n"
+		"Read back the range erased with <type> with large O_DIRECT reads on\n"
+		"[threads] threads (default 4) and list the sectors that don't hold\n"
+		"ERASED_MEM_CONT. [percent] samples that share of the 1MiB chunks of\n"
+		"the range, default 100. After discard or secure-trim1 the content is\n"
+		"indeterminate and only reported.\n",
+	NULL
+	},
 	{ do_erase, -4,
-	"erase", "<type> " "<start address> " "<end address> " "<device>\n"
+	"erase", "[-i] [-V percent] [-j threads] <type> " "<start address> " "<end address> " "<device>\n"
 		"Send Erase CMD38 with specific argument to the <device>\n\n"
 		"NOTE!: This will delete all user data in the specified region of the device\n"
 		"<type> must be: legacy | discard | secure-erase | "
-		"secure-trim1 | secure-trim2 | trim \n",
+		"secure-trim1 | secure-trim2 | trim \n"
+		"With -i, Ctrl-C or exceeding the timeout from EXT_CSD interrupts the erase\n"
+		"with HPI.\n"
+		"-V verifies [percent] of the range afterwards, as \"erase verify\" does.\n",
+	NULL
+	},
+	{ do_discard_ranges, -1,
+	"discard-ranges", "[-t discard|trim|legacy] [-f list|-b bitmap [-u sectors]] [-n] <device>\n"
+		"Discard many ranges of <device>, e.g. the free space of a filesystem\n"
+		"on a raw, boot or GP partition the kernel won't discard.\n"
+		"The ranges are sorted, merged, clipped to <device>, shrunk to the\n"
+		"granularity of the erase type and sent in batches of CMD35/36/38.\n"
+		"  -t  Erase type, default discard. Legacy erase keeps whole erase groups.\n"
+		"  -f  File of \"<start> <count>\" lines in 512 byte sectors, default stdin.\n"
+		"  -b  Block bitmap, LSB first, set bits in use: clear bits are discarded.\n"
+		"  -u  Sectors per bitmap bit, default 8 (4KiB blocks).\n"
+		"  -n  Only print the ranges that would be discarded.\n"
+		"NOTE!: This will delete all user data in the listed ranges of the device\n",
 	NULL
 	},
 	{ do_general_cmd_read, -1,
-	"gen_cmd read", "<device> [arg]\n"
-		"Send GEN_CMD (CMD56) to read vendor-specific format/meaning data from <device>\n\n"
+	"gen_cmd read", "[-o text|json|raw] [-l layouts] <device> [arg...]\n"
+		"Send GEN_CMD (CMD56) to read vendor-specific format/meaning data from <device>\n"
+		"Several [arg]s are read in one MULTI_CMD ioctl. Pages with a layout for\n"
+		"the manufacturer ID of <device> in <layouts> (default\n"
+		"/etc/mmc-utils/gen_cmd.layouts) are decoded into named fields.\n"
+		"  -o  Print text (default), a JSON object, or raw records of a\n"
+		"      24 byte header and the 512 bytes of data per page.\n"
+		"  -l  Read page layouts from <layouts>, one\n"
+		"      \"<mid> <arg> <field> <offset> <size> [le|be|str]\" per line.\n\n"
 		"NOTE!: [arg] is optional and defaults to 0x1. If [arg] is specified, then [arg]\n"
 		"must be a 32-bit hexadecimal number, prefixed with 0x/0X. And bit0 in [arg] must\n"
 		"be 1.",
@@ -334,6 +539,38 @@ static struct Command commands[] = {
 	  "Issues a CMD0 GO_PRE_IDLE",
 	  NULL
 	},
+	{ do_boot_image_write, -3,
+	  "boot image write", "[-e] <image> <device> <0|1>\n"
+		"Stream <image> to boot partition 0 or 1 of <device> with large\n"
+		"O_DIRECT writes, lifting force_ro meanwhile, and verify it with\n"
+		"SHA-256.\n"
+		"  -e  Once verified, make it the partition to boot from.",
+	  NULL
+	},
+	{ do_boot_image_read, -3,
+	  "boot image read", "[-n bytes] <image> <device> <0|1>\n"
+		"Save boot partition 0 or 1 of <device> to <image> and print its\n"
+		"SHA-256.\n"
+		"  -n  Only save the first <bytes> (default the whole partition).",
+	  NULL
+	},
+	{ do_boot_image_verify, 3,
+	  "boot image verify", "<image> <device> <0|1>\n"
+		"Check with SHA-256 that boot partition 0 or 1 of <device> starts\n"
+		"with <image>.",
+	  NULL
+	},
+	{ do_boot_bench, -1,
+	  "boot bench", "[-n iterations] [-s bytes] [-w x1,x4,x8] <device>\n"
+		"Time alternative boot reads of the enabled boot partition under\n"
+		"every BOOT_BUS_CONDITIONS mode BOOT_INFO allows, reporting the\n"
+		"time to first byte and MB/s per mode. The original settings are\n"
+		"restored afterwards.\n"
+		"  -n  Reads per mode (default 10).\n"
+		"  -s  Bytes per read (default and at most 512K).\n"
+		"  -w  Boot bus widths to try (default x1,x4,x8).",
+	  NULL
+	},
 	{ do_alt_boot_op, -1,
 	  "boot_operation", "<boot_data_file> <device>\n"
 	  "Does the alternative boot operation and writes the specified starting blocks of boot data into the requested file.\n\n"
@@ -346,6 +583,87 @@ static struct Command commands[] = {
 	  "4. The MMC will perform a soft reset, if your system cannot handle that do not use the boot operation from mmc-utils.\n",
 	  NULL
 	},
+	{ do_align_check, -1,
+	  "align check", "<device>\n"
+		"Check the partitions of <device>, the enhanced user area and the\n"
+		"GP partitions against the super page, optimal write and trim\n"
+		"sizes, erase group and large unit from EXT_CSD, and suggest\n"
+		"filesystem stride/stripe parameters.",
+	  NULL
+	},
+	{ do_bench, -1,
+	  "bench", "[-w] [-q depth,...] [-t seconds] [-e <device>] <target>\n"
+		"Run sequential and random O_DIRECT read sweeps from 4K to 512K\n"
+		"against <target>, a hardware partition block device or a file\n"
+		"standing in for one, and report MB/s, IOPS and latency\n"
+		"percentiles next to the EXT_CSD minimum performance classes.\n"
+		"  -w  Also run write sweeps.\n"
+		"      NOTE! This overwrites the data on <target>.\n"
+		"  -q  Queue depths to run each point at (default 1,4).\n"
+		"  -t  Seconds per point (default 1).\n"
+		"  -e  Read EXT_CSD from <device> rather than from <target>.",
+	  NULL
+	},
+	{ do_cmdq_bench, -1,
+	  "cmdq bench", "[-w] [-t seconds] [-o <report>] [-c <report>] <device>\n"
+		"Detect whether command queuing is in use on <device> and run a\n"
+		"random 4K workload at queue depths from 1 to CMDQ_DEPTH,\n"
+		"reporting IOPS, MB/s and latency percentiles per depth.\n"
+		"  -w  Mix in 30% writes. NOTE! This overwrites data on <device>.\n"
+		"  -t  Seconds per depth (default 5).\n"
+		"  -o  Save the results to <report>.\n"
+		"  -c  Compare with a <report> saved earlier, e.g. with CMDQ\n"
+		"      turned off by host policy.",
+	  NULL
+	},
+	{ do_wear, -1,
+	  "wear", "[-f <history>] [-c cycles] [-n] [-l] <device>\n"
+		"Sample the life time estimates and PRE_EOL_INFO of <device>\n"
+		"together with the host written sectors, append them to a history\n"
+		"file and estimate write amplification and time to EOL from it.\n"
+		"  -f  History file (default /var/lib/mmc-utils/wear-<CID>).\n"
+		"  -c  Rated P/E cycles of the flash, to estimate write amplification.\n"
+		"  -n  Don't record this sample.\n"
+		"  -l  List the recorded history.",
+	  NULL
+	},
+	{ do_exporter, -1,
+	  "exporter", "[-i seconds] [-t <textfile>] [-p port] <device>...\n"
+		"Keep the devices open and sample their EXT_CSD and status every\n"
+		"interval, exporting health, cache and ioctl latency metrics in\n"
+		"the Prometheus text format until interrupted.\n"
+		"  -i  Seconds between samples (default 60).\n"
+		"  -t  Atomically rewrite <textfile> after every sample, e.g. for\n"
+		"      the node exporter textfile collector.\n"
+		"  -p  Serve the metrics over HTTP on 127.0.0.1:<port>.",
+	  NULL
+	},
+	{ do_power_notify, 2,
+	  "power notify", "<on|short|long|sleep> <device>\n"
+		"Set POWER_OFF_NOTIFICATION of <device> and report how long the\n"
+		"device really took, against the timeout it specifies.\n"
+		"on     POWERED_ON, e.g. to undo a notification.\n"
+		"short  POWER_OFF_SHORT, within GENERIC_CMD6_TIME.\n"
+		"long   POWER_OFF_LONG, within POWER_OFF_LONG_TIME.\n"
+		"sleep  SLEEP_NOTIFICATION, then put the device to sleep (CMD5).\n"
+		"NOTE! The kernel isn't told about any of this, so <device> must\n"
+		"not be used until it is power cycled, set back 'on' or woken up.",
+	  NULL
+	},
+	{ do_power_awake, 1,
+	  "power awake", "<device>\n"
+		"Wake <device> up from sleep (CMD5) and select it again.",
+	  NULL
+	},
+	{ do_replay, -1,
+	  "replay", "[-y] [-g] <trace> [device]\n"
+		"Print the ioctls recorded with --record in <trace>, or with -y\n"
+		"issue them again on <device> and compare outcome, responses, read\n"
+		"data and timing per command sequence against the recording.\n"
+		"  -g  Keep the idle time between ioctls that the trace had.\n"
+		"NOTE! -y repeats every write, erase and FFU step in <trace>.",
+	  NULL
+	},
 	{ NULL, 0, NULL, NULL }
 };
 
@@ -391,6 +709,8 @@ static void help(char *np)
 	for( cp = commands; cp->verb; cp++ )
 		print_help(np, cp, BASIC_HELP);
 
+	printf("\n\t%s --record <trace> <cmd>...\n\t\tRecord the ioctls <cmd> issues in <trace>, see 'replay'.\n",np);
+	printf("\n\t%s --all|--devices <device>,... [--jobs <n>] <cmd>...\n\t\tRun a read-only <cmd> on every MMC device, or the given ones, in\n\t\tparallel, leaving out its device argument.\n",np);
 	printf("\n\t%s help|--help|-h\n\t\tShow the help.\n",np);
 	printf("\n\t%s <cmd> --help\n\t\tShow detailed help for a command or subset of commands.\n",np);
 	printf("\n%s\n", VERSION);
@@ -427,6 +747,11 @@ static int check_ambiguity(struct Command *cmd, char **argv){
 	/* check for ambiguity */
 	for( i = 0 ; i < cmd->ncmds ; i++ ){
 		int match;
+
+		/* a fully spelled out word is never ambiguous */
+		if( !strcmp(cmd->cmds[i], argv[i+1]) )
+			continue;
+
 		for( match = 0, cp = commands; cp->verb; cp++ ){
 			int	j, skip;
 			char	*s1, *s2;
@@ -607,18 +932,258 @@ static int parse_args(int argc, char **argv,
 
 	return 1;
 }
+/*
+ * Read-only commands that --all/--devices can run on many devices. The
+ * device is their last argument; the register reads take the sysfs
+ * directory of the device instead.
+ */
+static const struct {
+	const char *verb;
+	int sysfs;
+} fanout_cmds[] = {
+	{ "extcsd read", 0 },
+	{ "writeprotect boot get", 0 },
+	{ "writeprotect user get", 0 },
+	{ "status get", 0 },
+	{ "csd read", 1 },
+	{ "cid read", 1 },
+	{ "scr read", 1 },
+	{ "align check", 0 },
+};
+
+static int cmp_mmcblk(const void *a, const void *b)
+{
+	return strverscmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Every /dev/mmcblkN, leaving out partitions and hardware partitions */
+static int discover_devices(char ***devs)
+{
+	struct dirent *de;
+	unsigned int idx;
+	int n = 0, len;
+	DIR *dir;
+
+	*devs = NULL;
+	dir = opendir("/sys/class/block");
+	if (!dir) {
+		perror("/sys/class/block");
+		return -1;
+	}
+	while ((de = readdir(dir))) {
+		if (sscanf(de->d_name, "mmcblk%u%n", &idx, &len) != 1 ||
+		    de->d_name[len])
+			continue;
+		*devs = realloc(*devs, (n + 1) * sizeof(**devs));
+		if (!*devs || asprintf(&(*devs)[n], "/dev/%s", de->d_name) < 0) {
+			perror("realloc");
+			exit(1);
+		}
+		n++;
+	}
+	closedir(dir);
+	qsort(*devs, n, sizeof(**devs), cmp_mmcblk);
+
+	return n;
+}
+
+static int split_devices(char *list, char ***devs)
+{
+	char *dev;
+	int n = 0;
+
+	*devs = NULL;
+	for (dev = strtok(list, ","); dev; dev = strtok(NULL, ",")) {
+		*devs = realloc(*devs, (n + 1) * sizeof(**devs));
+		if (!*devs) {
+			perror("realloc");
+			exit(1);
+		}
+		(*devs)[n++] = dev;
+	}
+
+	return n;
+}
+
+struct fanout_worker {
+	pid_t pid;
+	FILE *out;
+	int status;
+	int done;
+};
+
+static void fanout_start(struct fanout_worker *w, CommandFunction func,
+			 int nargs, char **args, const char *dev, int sysfs)
+{
+	char *path;
+
+	w->out = tmpfile();
+	if (!w->out) {
+		perror("tmpfile");
+		exit(1);
+	}
+
+	fflush(NULL);
+	w->pid = fork();
+	if (w->pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (w->pid)
+		return;
+
+	dup2(fileno(w->out), STDOUT_FILENO);
+	dup2(fileno(w->out), STDERR_FILENO);
+	/* keep stdout and stderr in order, as on a terminal */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if (sysfs) {
+		if (asprintf(&path, "/sys/class/block/%s/device",
+			     strrchr(dev, '/') ? strrchr(dev, '/') + 1 : dev) < 0)
+			exit(1);
+		args[nargs - 1] = path;
+	} else {
+		args[nargs - 1] = (char *)dev;
+	}
+	exit(func(nargs, args));
+}
+
+/*
+ * Runs the command on every device, at most @jobs at a time, each in its
+ * own process with its output captured. Outputs are printed whole and in
+ * the order of @devs, as soon as all the ones before are done.
+ */
+static int fanout(CommandFunction func, int nargs, char **args, char **devs,
+		  int ndevs, int jobs, int sysfs)
+{
+	struct fanout_worker *w;
+	int next = 0, running = 0, printed = 0, failed = 0, status, i, c;
+	pid_t pid;
+
+	w = calloc(ndevs, sizeof(*w));
+	if (!w) {
+		perror("calloc");
+		exit(1);
+	}
+
+	while (printed < ndevs) {
+		if (next < ndevs && running < jobs) {
+			fanout_start(&w[next], func, nargs, args, devs[next],
+				     sysfs);
+			next++;
+			running++;
+			continue;
+		}
+
+		pid = wait(&status);
+		if (pid < 0) {
+			perror("wait");
+			exit(1);
+		}
+		for (i = 0; i < next; i++) {
+			if (w[i].pid == pid) {
+				w[i].status = status;
+				w[i].done = 1;
+				running--;
+			}
+		}
+
+		for (; printed < ndevs && w[printed].done; printed++) {
+			status = w[printed].status;
+			printf("%s==> %s <==\n", printed ? "\n" : "",
+			       devs[printed]);
+			rewind(w[printed].out);
+			while ((c = getc(w[printed].out)) != EOF)
+				putchar(c);
+			fclose(w[printed].out);
+			if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+				failed++;
+				if (WIFEXITED(status))
+					printf("(exit status %d)\n",
+					       WEXITSTATUS(status));
+				else
+					printf("(killed by signal %d)\n",
+					       WTERMSIG(status));
+			}
+			fflush(stdout);
+		}
+	}
+
+	free(w);
+	return failed ? 1 : 0;
+}
+
 int main(int ac, char **av )
 {
-	char *cmd = NULL, **args = NULL;
-	int nargs = 0, r;
+	char *cmd = NULL, **args = NULL, **devs = NULL, **nav;
+	int nargs = 0, r, all = 0, ndevs = 0, jobs = 0, shift;
+	unsigned int i;
+	char *dev_list = NULL;
 	CommandFunction func = NULL;
 
+	/* global options, in front of the command */
+	for (;;) {
+		if (ac > 2 && !strcmp(av[1], "--record")) {
+			if (mmc_trace_open(av[2]))
+				exit(1);
+			shift = 2;
+		} else if (ac > 1 && !strcmp(av[1], "--all")) {
+			all = 1;
+			shift = 1;
+		} else if (ac > 2 && !strcmp(av[1], "--devices")) {
+			dev_list = av[2];
+			shift = 2;
+		} else if (ac > 2 && !strcmp(av[1], "--jobs")) {
+			jobs = atoi(av[2]);
+			shift = 2;
+		} else {
+			break;
+		}
+		av[shift] = av[0];
+		av += shift;
+		ac -= shift;
+	}
+
+	if (all || dev_list) {
+		ndevs = dev_list ? split_devices(dev_list, &devs) :
+				   discover_devices(&devs);
+		if (ndevs <= 0) {
+			if (!ndevs)
+				fprintf(stderr, "No MMC devices found\n");
+			exit(1);
+		}
+		if (jobs <= 0)
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (jobs <= 0)
+			jobs = 1;
+
+		/* the device goes last; check the command with the first one */
+		nav = malloc((ac + 2) * sizeof(*nav));
+		if (!nav) {
+			perror("malloc");
+			exit(1);
+		}
+		memcpy(nav, av, ac * sizeof(*nav));
+		nav[ac++] = devs[0];
+		nav[ac] = NULL;
+		av = nav;
+	}
+
 	r = parse_args(ac, av, &func, &nargs, &cmd, &args);
 	if( r <= 0 ){
 		/* error or no command to parse*/
 		exit(-r);
 	}
 
+	if (ndevs) {
+		for (i = 0; i < sizeof(fanout_cmds) / sizeof(fanout_cmds[0]); i++)
+			if (!strcmp(cmd, fanout_cmds[i].verb))
+				exit(fanout(func, nargs, args, devs, ndevs,
+					    jobs, fanout_cmds[i].sysfs));
+		fprintf(stderr, "ERROR: '%s' can't be run with --all or --devices\n",
+			cmd);
+		exit(1);
+	}
+
 	exit(func(nargs, args));
 }
-
@@ -25,10 +25,14 @@
 #define MMC_GO_IDLE_STATE_ARG		0x0
 #define MMC_GO_PRE_IDLE_STATE_ARG	0xF0F0F0F0
 #define MMC_BOOT_INITIATION_ARG		0xFFFFFFFA
+#define MMC_SLEEP_AWAKE		5	/* ac	[31:16] RCA 15:flg	R1b */
 #define MMC_SWITCH		6	/* ac	[31:0] See below	R1b */
+#define MMC_SELECT_CARD		7	/* ac	[31:16] RCA		R1  */
 #define MMC_SEND_EXT_CSD	8	/* adtc				R1  */
 #define MMC_STOP_TRANSMISSION  12      /* ac                           R1b */
 #define MMC_SEND_STATUS		13	/* ac   [31:16] RCA        R1  */
+#define MMC_HPI_ARG		(1 << 0)	/* CMD12/CMD13 HPI bit */
+#define MMC_SLEEP_ARG		(1 << 15)	/* CMD5 sleep, awake when clear */
 #define R1_SWITCH_ERROR   (1 << 7)  /* sx, c */
 #define MMC_SWITCH_MODE_WRITE_BYTE	0x03	/* Set target to value */
 #define MMC_READ_MULTIPLE_BLOCK  18   /* adtc [31:0] data addr   R1  */
@@ -50,6 +54,18 @@
 #define MMC_GEN_CMD		56   /* adtc  [31:1] stuff bits.
 					      [0]: RD/WR1 R1 */
 
+/*
+ * MMC_ERASE arguments
+ */
+#define MMC_ERASE_ARG		0x00000000
+#define MMC_SECURE_ERASE_ARG	0x80000000
+#define MMC_TRIM_ARG		0x00000001
+#define MMC_DISCARD_ARG		0x00000003
+#define MMC_SECURE_TRIM1_ARG	0x80000001
+#define MMC_SECURE_TRIM2_ARG	0x80008000
+#define MMC_SECURE_ARGS		0x80000000
+#define MMC_TRIM_ARGS		0x00008001
+
 #define R1_OUT_OF_RANGE         (1 << 31)       /* er, c */
 #define R1_ADDRESS_ERROR        (1 << 30)       /* erx, c */
 #define R1_BLOCK_LEN_ERROR      (1 << 29)       /* er, c */
@@ -70,6 +86,9 @@
 #define R1_READY_FOR_DATA       (1 << 8)        /* sx, a */
 #define R1_EXCEPTION_EVENT      (1 << 6)        /* sr, a */
 #define R1_APP_CMD              (1 << 5)        /* sr, c */
+#define R1_CURRENT_STATE(x)	((x & 0x00001E00) >> 9) /* sx, b (4 bits) */
+#define R1_STATE_TRAN	4
+#define R1_STATE_PRG	7
 
 /*
  * EXT_CSD fields
@@ -77,12 +96,14 @@
 #define EXT_CSD_S_CMD_SET		504
 #define EXT_CSD_HPI_FEATURE		503
 #define EXT_CSD_BKOPS_SUPPORT		502	/* RO */
+#define EXT_CSD_LARGE_UNIT_SIZE_M1	495	/* RO */
 #define EXT_CSD_SUPPORTED_MODES		493	/* RO */
 #define EXT_CSD_FFU_FEATURES		492	/* RO */
 #define EXT_CSD_FFU_ARG_3		490	/* RO */
 #define EXT_CSD_FFU_ARG_2		489	/* RO */
 #define EXT_CSD_FFU_ARG_1		488	/* RO */
 #define EXT_CSD_FFU_ARG_0		487	/* RO */
+#define EXT_CSD_BARRIER_SUPPORT		486	/* RO */
 #define EXT_CSD_CMDQ_DEPTH		307	/* RO */
 #define EXT_CSD_CMDQ_SUPPORT		308	/* RO */
 #define EXT_CSD_NUM_OF_FW_SEC_PROG_3	305	/* RO */
@@ -92,23 +113,43 @@
 #define EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_B 	269	/* RO */
 #define EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_A 	268	/* RO */
 #define EXT_CSD_PRE_EOL_INFO		267	/* RO */
+#define EXT_CSD_OPTIMAL_READ_SIZE	266	/* RO */
+#define EXT_CSD_OPTIMAL_WRITE_SIZE	265	/* RO */
+#define EXT_CSD_OPTIMAL_TRIM_UNIT_SIZE	264	/* RO */
 #define EXT_CSD_FIRMWARE_VERSION	254	/* RO */
+#define EXT_CSD_BKOPS_STATUS		246	/* RO */
 #define EXT_CSD_CACHE_SIZE_3		252
 #define EXT_CSD_CACHE_SIZE_2		251
 #define EXT_CSD_CACHE_SIZE_1		250
 #define EXT_CSD_CACHE_SIZE_0		249
+#define EXT_CSD_GENERIC_CMD6_TIME	248	/* RO */
+#define EXT_CSD_POWER_OFF_LONG_TIME	247	/* RO */
+#define EXT_CSD_MIN_PERF_DDR_W_8_52	235	/* RO */
+#define EXT_CSD_MIN_PERF_DDR_R_8_52	234	/* RO */
+#define EXT_CSD_TRIM_MULT		232	/* RO */
 #define EXT_CSD_SEC_FEATURE_SUPPORT	231
+#define EXT_CSD_SEC_ERASE_MULT		230	/* RO */
+#define EXT_CSD_SEC_TRIM_MULT		229	/* RO */
 #define EXT_CSD_BOOT_INFO		228	/* R/W */
 #define EXT_CSD_BOOT_MULT		226	/* RO */
+#define EXT_CSD_ACC_SIZE		225	/* RO */
 #define EXT_CSD_HC_ERASE_GRP_SIZE	224
+#define EXT_CSD_ERASE_TIMEOUT_MULT	223	/* RO */
 #define EXT_CSD_HC_WP_GRP_SIZE		221
+#define EXT_CSD_S_A_TIMEOUT		217	/* RO */
+#define EXT_CSD_SLEEP_NOTIFICATION_TIME	216	/* RO */
 #define EXT_CSD_SEC_COUNT_3		215
 #define EXT_CSD_SEC_COUNT_2		214
 #define EXT_CSD_SEC_COUNT_1		213
 #define EXT_CSD_SEC_COUNT_0		212
 #define EXT_CSD_SECURE_WP_INFO		211
+#define EXT_CSD_MIN_PERF_W_8_52		210	/* RO */
+#define EXT_CSD_MIN_PERF_R_8_52		209	/* RO */
 #define EXT_CSD_PART_SWITCH_TIME	199
+#define EXT_CSD_OUT_OF_INTERRUPT_TIME	198	/* RO */
 #define EXT_CSD_REV			192
+#define EXT_CSD_HS_TIMING		185
+#define EXT_CSD_ERASED_MEM_CONT		181	/* RO */
 #define EXT_CSD_BOOT_CFG		179
 #define EXT_CSD_PART_CONFIG		179
 #define EXT_CSD_BOOT_BUS_CONDITIONS	177
@@ -117,11 +158,14 @@
 #define EXT_CSD_BOOT_WP			173
 #define EXT_CSD_USER_WP			171
 #define EXT_CSD_FW_CONFIG		169	/* R/W */
+#define EXT_CSD_RPMB_SIZE_MULT		168	/* RO */
 #define EXT_CSD_WR_REL_SET		167
 #define EXT_CSD_WR_REL_PARAM		166
 #define EXT_CSD_SANITIZE_START		165
+#define EXT_CSD_BKOPS_START		164	/* W */
 #define EXT_CSD_BKOPS_EN		163	/* R/W */
 #define EXT_CSD_RST_N_FUNCTION		162	/* R/W */
+#define EXT_CSD_HPI_MGMT		161	/* R/W */
 #define EXT_CSD_PARTITIONING_SUPPORT	160	/* RO */
 #define EXT_CSD_MAX_ENH_SIZE_MULT_2	159
 #define EXT_CSD_MAX_ENH_SIZE_MULT_1	158
@@ -150,9 +194,13 @@
 #define EXT_CSD_NATIVE_SECTOR_SIZE	63 /* R */
 #define EXT_CSD_USE_NATIVE_SECTOR	62 /* R/W */
 #define EXT_CSD_DATA_SECTOR_SIZE	61 /* R */
+#define EXT_CSD_EXCEPTION_EVENTS_STATUS	54	/* RO */
 #define EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_1	53
 #define EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_0	52
+#define EXT_CSD_POWER_OFF_NOTIFICATION	34	/* R/W */
 #define EXT_CSD_CACHE_CTRL		33
+#define EXT_CSD_FLUSH_CACHE		32	/* W */
+#define EXT_CSD_BARRIER_CTRL		31	/* R/W */
 #define EXT_CSD_MODE_CONFIG		30
 #define EXT_CSD_MODE_OPERATION_CODES	29	/* W */
 #define EXT_CSD_FFU_STATUS		26	/* R */
@@ -164,6 +212,7 @@
  */
 #define HS_CTRL_REL	(1<<0)
 #define EN_REL_WR	(1<<2)
+#define EN_RPMB_REL_WR	(1<<4)
 
 /*
  * BKOPS_EN field definitions
@@ -171,6 +220,30 @@
 #define BKOPS_MAN_ENABLE	(1<<0)
 #define BKOPS_AUTO_ENABLE	(1<<1)
 
+/*
+ * BKOPS_STATUS field definitions
+ */
+#define BKOPS_STATUS_MASK	(0x03)
+#define BKOPS_NOT_REQUIRED	(0x00)
+#define BKOPS_NON_CRITICAL	(0x01)
+#define BKOPS_PERF_IMPACTED	(0x02)
+#define BKOPS_CRITICAL		(0x03)
+
+/*
+ * POWER_OFF_NOTIFICATION field definitions
+ */
+#define EXT_CSD_NO_POWER_NOTIFICATION	(0x00)
+#define EXT_CSD_POWER_ON		(0x01)
+#define EXT_CSD_POWER_OFF_SHORT		(0x02)
+#define EXT_CSD_POWER_OFF_LONG		(0x03)
+#define EXT_CSD_SLEEP_NOTIFICATION	(0x04)
+
+/*
+ * FLUSH_CACHE field definitions
+ */
+#define EXT_CSD_FLUSH		(1<<0)
+#define EXT_CSD_BARRIER		(1<<1)
+
 /*
  * EXT_CSD field definitions
  */
@@ -183,6 +256,7 @@
 #define EXT_CSD_UPDATE_DISABLE		(1<<0)
 #define EXT_CSD_HPI_SUPP		(1<<0)
 #define EXT_CSD_HPI_IMPL		(1<<1)
+#define EXT_CSD_HPI_EN			(1<<0)	/* HPI_MGMT */
 #define EXT_CSD_CMD_SET_NORMAL		(1<<0)
 /* NOTE: The eMMC spec calls the partitions "Area 1" and "Area 2", but Linux
  * calls them mmcblk0boot0 and mmcblk0boot1. To avoid confustion between the two
@@ -215,6 +289,7 @@
 #define EXT_CSD_PART_CONFIG_ACC_ACK	  (0x40)
 #define EXT_CSD_PARTITIONING_EN		(1<<0)
 #define EXT_CSD_ENH_ATTRIBUTE_EN	(1<<1)
+#define EXT_CSD_EXT_ATTRIBUTE_EN	(1<<2)
 #define EXT_CSD_ENH_4			(1<<4)
 #define EXT_CSD_ENH_3			(1<<3)
 #define EXT_CSD_ENH_2			(1<<2)
@@ -228,6 +303,7 @@
 #define EXT_CSD_REV_V4_2		2
 #define EXT_CSD_REV_V4_1		1
 #define EXT_CSD_REV_V4_0		0
+#define EXT_CSD_SEC_SANITIZE		(1<<6)
 #define EXT_CSD_SEC_GB_CL_EN		(1<<4)
 #define EXT_CSD_SEC_ER_EN		(1<<0)
 
@@ -17,9 +17,11 @@
  * those modifications are Copyright (c) 2016 SanDisk Corp.
  */
 
+#define _GNU_SOURCE /* for O_DIRECT */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -28,8 +30,17 @@
 #include <errno.h>
 #include <stdint.h>
 #include <assert.h>
+#include <limits.h>
 #include <linux/fs.h> /* for BLKGETSIZE */
 #include <stdbool.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/wait.h>
 
 #include "mmc.h"
 #include "mmc_cmds.h"
@@ -43,6 +54,8 @@
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
 #endif
 
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
 #define WP_BLKS_PER_QUERY 32
 
 #define USER_WP_PERM_PSWD_DIS	0x80
@@ -74,6 +87,181 @@ static inline __u32 per_byte_htole32(__u8 *arr)
 	return arr[0] | arr[1] << 8 | arr[2] << 16 | arr[3] << 24;
 }
 
+static __u64 get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * ioctl trace (mmc --record <file>): every MMC_IOC_CMD and MMC_IOC_MULTI_CMD
+ * is appended to the trace as a header and an entry per command. The data
+ * of writes follows their entry so 'replay' can issue them again; of reads
+ * only a digest is kept. The key of RPMB key programming frames isn't kept.
+ */
+#define MMC_TRACE_MAGIC		"MMCTRC02"
+
+/* mmc_trace_cmd flags */
+#define MMC_TRACE_SCRUBBED	0x01	/* data left out, can't be replayed */
+
+/* RPMB frame: key at bytes 196-227, big-endian request in the last two */
+#define MMC_TRACE_RPMB_KEY_OFF	196
+#define MMC_TRACE_RPMB_KEY_LEN	32
+
+struct mmc_trace_hdr {
+	__le32 len;		/* of the whole record */
+	__le16 ncmds;
+	__u8 multi;
+	__u8 reserved;
+	__le32 err;		/* errno, if the ioctl failed */
+	__le64 start_us;
+	__le64 time_us;
+} __attribute__((packed));
+
+struct mmc_trace_cmd {
+	__le32 opcode;
+	__le32 arg;
+	__le32 flags;
+	__le32 blksz;
+	__le32 blocks;
+	__le32 response[4];
+	__le32 cmd_timeout_ms;
+	__le32 postsleep_min_us;
+	__le32 postsleep_max_us;
+	__le32 data_timeout_ns;
+	__le32 write_flag;	/* bit 31 asks for a reliable write */
+	__u8 is_acmd;
+	__u8 trace_flags;	/* MMC_TRACE_* */
+	__u8 reserved[2];
+	__u8 digest[8];		/* truncated SHA-256 of the data */
+} __attribute__((packed));
+
+static int mmc_trace_fd = -1;
+
+int mmc_trace_open(const char *path)
+{
+	/* may hold RPMB data frames */
+	mmc_trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+			    0600);
+	if (mmc_trace_fd < 0 ||
+	    write(mmc_trace_fd, MMC_TRACE_MAGIC, 8) != 8) {
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void mmc_trace_digest(const struct mmc_ioc_cmd *cmd, __u8 *digest)
+{
+	unsigned char sha[SHA256_DIGEST_SIZE];
+
+	sha256((unsigned char *)(uintptr_t)cmd->data_ptr,
+	       cmd->blksz * cmd->blocks, sha);
+	memcpy(digest, sha, 8);
+}
+
+/* RPMB frames go out as reliable writes, the key is only sent once */
+static bool mmc_trace_is_rpmb_key(const struct mmc_ioc_cmd *cmd)
+{
+	const __u8 *frame = (const __u8 *)(uintptr_t)cmd->data_ptr;
+
+	return cmd->write_flag & (1U << 31) && cmd->blksz == 512 &&
+	       cmd->blocks == 1 && frame[510] == 0 &&
+	       frame[511] == 0x01;	/* MMC_RPMB_WRITE_KEY */
+}
+
+static void mmc_trace_record(unsigned long req, void *arg, int err,
+			     __u64 start, __u64 end)
+{
+	struct mmc_ioc_cmd *cmds = arg;
+	struct mmc_trace_hdr *hdr;
+	struct mmc_trace_cmd *tc;
+	unsigned int i, n = 1;
+	size_t len, size;
+	__u8 *buf, *p;
+
+	if (req == MMC_IOC_MULTI_CMD) {
+		n = ((struct mmc_ioc_multi_cmd *)arg)->num_of_cmds;
+		cmds = ((struct mmc_ioc_multi_cmd *)arg)->cmds;
+	}
+
+	size = sizeof(*hdr) + n * sizeof(*tc);
+	for (i = 0; i < n; i++)
+		if (cmds[i].write_flag)
+			size += cmds[i].blksz * cmds[i].blocks;
+	buf = calloc(1, size);
+	if (!buf)
+		return;
+
+	hdr = (struct mmc_trace_hdr *)buf;
+	hdr->len = htole32(size);
+	hdr->ncmds = htole16(n);
+	hdr->multi = req == MMC_IOC_MULTI_CMD;
+	hdr->err = htole32(err);
+	hdr->start_us = htole64(start);
+	hdr->time_us = htole64(end - start);
+
+	p = buf + sizeof(*hdr);
+	for (i = 0; i < n; i++) {
+		tc = (struct mmc_trace_cmd *)p;
+		tc->opcode = htole32(cmds[i].opcode);
+		tc->arg = htole32(cmds[i].arg);
+		tc->flags = htole32(cmds[i].flags);
+		tc->blksz = htole32(cmds[i].blksz);
+		tc->blocks = htole32(cmds[i].blocks);
+		tc->response[0] = htole32(cmds[i].response[0]);
+		tc->response[1] = htole32(cmds[i].response[1]);
+		tc->response[2] = htole32(cmds[i].response[2]);
+		tc->response[3] = htole32(cmds[i].response[3]);
+		tc->cmd_timeout_ms = htole32(cmds[i].cmd_timeout_ms);
+		tc->postsleep_min_us = htole32(cmds[i].postsleep_min_us);
+		tc->postsleep_max_us = htole32(cmds[i].postsleep_max_us);
+		tc->data_timeout_ns = htole32(cmds[i].data_timeout_ns);
+		tc->write_flag = htole32(cmds[i].write_flag);
+		tc->is_acmd = cmds[i].is_acmd;
+		p += sizeof(*tc);
+
+		if (cmds[i].write_flag && mmc_trace_is_rpmb_key(&cmds[i])) {
+			/* the data is left zeroed, digest included */
+			tc->trace_flags |= MMC_TRACE_SCRUBBED;
+			p += cmds[i].blksz * cmds[i].blocks;
+			continue;
+		}
+		mmc_trace_digest(&cmds[i], tc->digest);
+		if (cmds[i].write_flag) {
+			len = cmds[i].blksz * cmds[i].blocks;
+			memcpy(p, (void *)(uintptr_t)cmds[i].data_ptr, len);
+			p += len;
+		}
+	}
+
+	/* one write per record, so forked workers don't interleave */
+	if (write(mmc_trace_fd, buf, size) != (ssize_t)size)
+		perror("trace");
+	free(buf);
+}
+
+/* All MMC_IOC_CMD/MMC_IOC_MULTI_CMD ioctls go through here */
+static int mmc_ioctl(int fd, unsigned long req, void *arg)
+{
+	__u64 start;
+	int ret, err;
+
+	if (mmc_trace_fd < 0)
+		return ioctl(fd, req, arg);
+
+	start = get_time_us();
+	ret = ioctl(fd, req, arg);
+	err = ret ? errno : 0;
+	mmc_trace_record(req, arg, err, start, get_time_us());
+	errno = err;
+
+	return ret;
+}
+
 static int read_extcsd(int fd, __u8 *ext_csd)
 {
 	int ret = 0;
@@ -88,7 +276,7 @@ static int read_extcsd(int fd, __u8 *ext_csd)
 	idata.blocks = 1;
 	mmc_ioc_cmd_set_data(idata, ext_csd);
 
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
+	ret = mmc_ioctl(fd, MMC_IOC_CMD, &idata);
 	if (ret)
 		perror("ioctl");
 
@@ -115,7 +303,7 @@ write_extcsd_value(int fd, __u8 index, __u8 value, unsigned int timeout_ms)
 	/* Kernel will set cmd_timeout_ms if 0 is set */
 	idata.cmd_timeout_ms = timeout_ms;
 
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
+	ret = mmc_ioctl(fd, MMC_IOC_CMD, &idata);
 	if (ret)
 		perror("ioctl");
 
@@ -132,7 +320,7 @@ static int send_status(int fd, __u32 *response)
 	idata.arg = (1 << 16);
 	idata.flags = MMC_RSP_R1 | MMC_CMD_AC;
 
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
+	ret = mmc_ioctl(fd, MMC_IOC_CMD, &idata);
 	if (ret)
 	perror("ioctl");
 
@@ -141,6 +329,322 @@ static int send_status(int fd, __u32 *response)
 	return ret;
 }
 
+static volatile sig_atomic_t mmc_interrupted;
+
+static void mmc_sigint_handler(int sig)
+{
+	mmc_interrupted = 1;
+}
+
+/*
+ * Long running commands catch SIGINT/SIGTERM so they can leave the device in
+ * TRAN state (and print what they did) instead of being killed mid-way.
+ */
+static void catch_interrupts(void)
+{
+	struct sigaction sa = {};
+
+	sa.sa_handler = mmc_sigint_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+/* block layer statistics, see Documentation/block/stat.rst */
+struct blk_stat {
+	unsigned long long rd_ios;
+	unsigned long long rd_sectors;
+	unsigned long long wr_ios;
+	unsigned long long wr_sectors;
+	unsigned long long in_flight;
+};
+
+static const char *blk_dev_name(const char *device)
+{
+	const char *name = strrchr(device, '/');
+
+	return name ? name + 1 : device;
+}
+
+static int read_blk_stat(const char *device, struct blk_stat *st)
+{
+	char path[PATH_MAX];
+	unsigned long long v[9];
+	FILE *f;
+	int n;
+
+	snprintf(path, sizeof(path), "/sys/class/block/%s/stat",
+		 blk_dev_name(device));
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	n = fscanf(f, "%llu %llu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7],
+		   &v[8]);
+	fclose(f);
+	if (n != 9) {
+		fprintf(stderr, "Unexpected format of %s\n", path);
+		return -1;
+	}
+
+	st->rd_ios = v[0];
+	st->rd_sectors = v[2];
+	st->wr_ios = v[4];
+	st->wr_sectors = v[6];
+	st->in_flight = v[8];
+
+	return 0;
+}
+
+/* Packagers may point this elsewhere with -DMMC_STATE_DIR=... */
+#ifndef MMC_STATE_DIR
+#define MMC_STATE_DIR	"/var/lib/mmc-utils"
+#endif
+
+/* The CID as the hex string in sysfs, or an empty string if there is none */
+static void get_cid_string(const char *device, char *cid, size_t len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	cid[0] = '\0';
+	snprintf(path, sizeof(path), "/sys/class/block/%s/device/cid",
+		 blk_dev_name(device));
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	if (!fgets(cid, len, f))
+		cid[0] = '\0';
+	cid[strcspn(cid, " \t\n")] = '\0';
+	fclose(f);
+}
+
+/*
+ * Files kept across runs (wear history, RPMB journal) are named by CID, so
+ * they follow a device across renames. The directory is only created by
+ * make_state_dir(), right before one of them is written.
+ */
+static void get_state_path(const char *device, const char *what, char *path,
+			   size_t len)
+{
+	char cid[64];
+
+	get_cid_string(device, cid, sizeof(cid));
+	snprintf(path, len, "%s/%s-%s", MMC_STATE_DIR, what,
+		 cid[0] ? cid : blk_dev_name(device));
+}
+
+/* Creates MMC_STATE_DIR if @path, about to be written, is in there */
+static void make_state_dir(const char *path)
+{
+	size_t n = strlen(MMC_STATE_DIR);
+
+	if (strncmp(path, MMC_STATE_DIR, n) || path[n] != '/')
+		return;
+	if (mkdir(MMC_STATE_DIR, 0755) && errno != EEXIST)
+		perror(MMC_STATE_DIR);
+}
+
+#define BOOT_TIME_SLACK_S	5
+
+static __u64 get_boot_time(void)
+{
+	unsigned long long btime = 0;
+	char line[256];
+	FILE *f;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "btime %llu", &btime) == 1)
+			break;
+	fclose(f);
+
+	return btime;
+}
+
+/*
+ * Whether the system rebooted since boot time @btime. The boot time is
+ * derived from the wall clock, so it shifts a little when NTP steps the
+ * clock without a reboot.
+ */
+static bool rebooted_since(__u64 btime)
+{
+	__u64 now = get_boot_time();
+
+	return now > btime + BOOT_TIME_SLACK_S ||
+	       now + BOOT_TIME_SLACK_S < btime;
+}
+
+/*
+ * The device only honours HPI once HPI_MGMT enables it. The kernel does that
+ * at init, but make sure before starting something we may need to interrupt.
+ *
+ * Return: true if HPI can be used.
+ */
+static bool hpi_prepare(int fd, __u8 *ext_csd)
+{
+	if (!(ext_csd[EXT_CSD_HPI_FEATURE] & EXT_CSD_HPI_SUPP))
+		return false;
+	if (ext_csd[EXT_CSD_HPI_MGMT] & EXT_CSD_HPI_EN)
+		return true;
+
+	if (write_extcsd_value(fd, EXT_CSD_HPI_MGMT, EXT_CSD_HPI_EN, 0))
+		return false;
+	ext_csd[EXT_CSD_HPI_MGMT] |= EXT_CSD_HPI_EN;
+
+	return true;
+}
+
+/* OUT_OF_INTERRUPT_TIME is in units of 10ms */
+static unsigned int get_out_of_interrupt_time_ms(__u8 *ext_csd)
+{
+	return ext_csd[EXT_CSD_OUT_OF_INTERRUPT_TIME] * 10;
+}
+
+/*
+ * Sends a High Priority Interrupt, CMD12 or CMD13 based as advertised in
+ * HPI_FEATURE, to bring a busy device back to TRAN state.
+ */
+static int send_hpi(int fd, __u8 *ext_csd)
+{
+	int ret;
+	struct mmc_ioc_cmd idata = {};
+
+	if (!(ext_csd[EXT_CSD_HPI_FEATURE] & EXT_CSD_HPI_SUPP) ||
+	    !(ext_csd[EXT_CSD_HPI_MGMT] & EXT_CSD_HPI_EN))
+		return -ENOTSUP;
+
+	if (ext_csd[EXT_CSD_HPI_FEATURE] & EXT_CSD_HPI_IMPL) {
+		idata.opcode = MMC_STOP_TRANSMISSION;
+		idata.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+		idata.cmd_timeout_ms = get_out_of_interrupt_time_ms(ext_csd);
+	} else {
+		idata.opcode = MMC_SEND_STATUS;
+		idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+	}
+	idata.arg = (1 << 16) | MMC_HPI_ARG;
+
+	ret = mmc_ioctl(fd, MMC_IOC_CMD, &idata);
+	if (ret)
+		perror("HPI ioctl");
+
+	return ret;
+}
+
+/*
+ * Polls CMD13 every @poll_us until the device leaves PRG state.
+ *
+ * @should_stop: optional callback, checked between polls.
+ * @status: optional, set to the last R1 status read, which is the first one
+ *          to report the errors of an R1 command the busy wait was for.
+ *
+ * Return: 0 once the device is done, 1 if @should_stop asked to give up
+ *         while the device is still busy, or a negative error.
+ */
+static int wait_while_prg(int fd, unsigned int poll_us,
+			  bool (*should_stop)(void *), void *priv,
+			  __u32 *status)
+{
+	__u32 response;
+
+	while (1) {
+		if (send_status(fd, &response))
+			return -EIO;
+		if (status)
+			*status = response;
+		if (R1_CURRENT_STATE(response) != R1_STATE_PRG)
+			return 0;
+		if (should_stop && should_stop(priv))
+			return 1;
+		usleep(poll_us);
+	}
+}
+
+static bool deadline_passed(void *priv)
+{
+	__u64 *deadline = priv;
+
+	return *deadline && get_time_us() >= *deadline;
+}
+
+static bool deadline_or_interrupted(void *priv)
+{
+	return mmc_interrupted || deadline_passed(priv);
+}
+
+/*
+ * Interrupts the ongoing operation with HPI and waits for the device to get
+ * back to TRAN state, which it must do within OUT_OF_INTERRUPT_TIME. Waits
+ * no more than ten times that, also if the HPI itself failed.
+ */
+static int hpi_interrupt(int fd, __u8 *ext_csd)
+{
+	unsigned int limit_ms = get_out_of_interrupt_time_ms(ext_csd);
+	__u64 start, deadline;
+	int ret;
+
+	start = get_time_us();
+	/* give a device that misses the limit the benefit of the doubt */
+	deadline = start + (limit_ms ? limit_ms : 100) * 1000ull * 10;
+	ret = send_hpi(fd, ext_csd);
+	if (ret) {
+		if (ret == -ENOTSUP)
+			fprintf(stderr, "HPI is not enabled, waiting for the device\n");
+		if (wait_while_prg(fd, 1000, deadline_passed, &deadline, NULL)) {
+			fprintf(stderr, "Device still busy after %llu ms, giving up\n",
+				(get_time_us() - start) / 1000);
+			return -EIO;
+		}
+		return ret;
+	}
+
+	ret = wait_while_prg(fd, 100, deadline_passed, &deadline, NULL);
+	if (ret)
+		return -EIO;
+
+	if (limit_ms && get_time_us() - start > limit_ms * 1000ull)
+		fprintf(stderr, "Device took %llu ms to leave the interrupted state, OUT_OF_INTERRUPT_TIME is %u ms\n",
+			(get_time_us() - start) / 1000, limit_ms);
+
+	return 0;
+}
+
+/*
+ * Waits for an operation sent without busy wait (R1 instead of R1B) to
+ * complete. Once @timeout_ms passes, or on SIGINT/SIGTERM, it is interrupted
+ * with HPI instead.
+ *
+ * Return: 0 once the operation completed, -ETIMEDOUT or -EINTR if it was
+ *         interrupted, or another negative error.
+ */
+static int wait_busy_or_hpi(int fd, __u8 *ext_csd, unsigned int poll_us,
+			    unsigned int timeout_ms)
+{
+	__u64 deadline = 0;
+	int ret;
+
+	catch_interrupts();
+	if (timeout_ms)
+		deadline = get_time_us() + timeout_ms * 1000ull;
+
+	ret = wait_while_prg(fd, poll_us, deadline_or_interrupted, &deadline,
+			     NULL);
+	if (ret != 1)
+		return ret;
+
+	fprintf(stderr, "%s, interrupting with HPI\n",
+		mmc_interrupted ? "Interrupted" : "Timed out");
+	ret = hpi_interrupt(fd, ext_csd);
+	if (ret)
+		return ret;
+
+	return mmc_interrupted ? -EINTR : -ETIMEDOUT;
+}
+
 static __u32 get_size_in_blks(int fd)
 {
 	int res;
@@ -170,39 +674,13 @@ static int set_write_protect(int fd, __u32 blk_addr, int on_off)
 	idata.arg = blk_addr;
 	idata.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
 
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
+	ret = mmc_ioctl(fd, MMC_IOC_CMD, &idata);
 	if (ret)
 		perror("ioctl");
 
 	return ret;
 }
 
-static int send_write_protect_type(int fd, __u32 blk_addr, __u64 *group_bits)
-{
-	int ret = 0;
-	struct mmc_ioc_cmd idata;
-	__u8 buf[8];
-	__u64 bits = 0;
-	int x;
-
-	memset(&idata, 0, sizeof(idata));
-	idata.write_flag = 0;
-	idata.opcode = MMC_SEND_WRITE_PROT_TYPE;
-	idata.blksz      = 8,
-	idata.blocks     = 1,
-	idata.arg = blk_addr;
-	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-	mmc_ioc_cmd_set_data(idata, buf);
-
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
-	if (ret)
-		perror("ioctl");
-	for (x = 0; x < sizeof(buf); x++)
-		bits |= (__u64)(buf[7 - x]) << (x * 8);
-	*group_bits = bits;
-	return ret;
-}
-
 static void print_writeprotect_boot_status(__u8 *ext_csd)
 {
 	__u8 reg;
@@ -395,102 +873,423 @@ static void print_wp_status(__u32 wp_sizeblks, __u32 start_group,
 }
 
 
-int do_writeprotect_user_get(int nargs, char **argv)
+/*
+ * Reads the protection of the write protect groups in the windows of
+ * WP_BLKS_PER_QUERY groups starting at @windows into @map, one byte per
+ * group. The CMD31s are batched into as few MULTI_CMD ioctls as allowed.
+ */
+static int read_wp_groups(int fd, __u32 wp_sizeblks, __u32 cnt,
+			  const __u32 *windows, unsigned int nwin, __u8 *map)
 {
-	__u8 ext_csd[512];
-	int fd, ret;
-	char *device;
-	int x;
-	int y = 0;
-	__u32 wp_sizeblks;
-	__u32 dev_sizeblks;
-	__u32 cnt;
+	struct mmc_ioc_multi_cmd *multi_cmd;
+	__u8 (*bufs)[8];
+	unsigned int i, n, y;
 	__u64 bits;
-	__u32 wpblk;
-	__u32 last_wpblk = 0;
-	__u32 prot;
-	__u32 last_prot = -1;
-	int remain;
+	int x, ret = 0;
 
-	if (nargs != 2) {
-		fprintf(stderr, "Usage: mmc writeprotect user get </path/to/mmcblkX>\n");
-		exit(1);
+	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+			   MMC_IOC_MAX_CMDS * sizeof(struct mmc_ioc_cmd));
+	bufs = calloc(MMC_IOC_MAX_CMDS, sizeof(*bufs));
+	if (!multi_cmd || !bufs) {
+		perror("Failed to allocate memory");
+		ret = -ENOMEM;
+		goto out;
 	}
 
-	device = argv[1];
-
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	while (nwin) {
+		n = nwin < MMC_IOC_MAX_CMDS ? nwin : MMC_IOC_MAX_CMDS;
+		memset(multi_cmd->cmds, 0, n * sizeof(struct mmc_ioc_cmd));
+		multi_cmd->num_of_cmds = n;
+		for (i = 0; i < n; i++) {
+			multi_cmd->cmds[i].opcode = MMC_SEND_WRITE_PROT_TYPE;
+			multi_cmd->cmds[i].blksz = 8;
+			multi_cmd->cmds[i].blocks = 1;
+			multi_cmd->cmds[i].arg = windows[i] * wp_sizeblks;
+			multi_cmd->cmds[i].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 |
+						   MMC_CMD_ADTC;
+			mmc_ioc_cmd_set_data(multi_cmd->cmds[i], bufs[i]);
+		}
 
-	ret = get_wp_group_size_in_blks(ext_csd, &wp_sizeblks);
-	if (ret)
-		exit(1);
-	printf("Write Protect Group size in blocks/bytes: %d/%d\n",
-		wp_sizeblks, wp_sizeblks * 512);
-	dev_sizeblks = get_size_in_blks(fd);
-	cnt = dev_sizeblks / wp_sizeblks;
-	for (x = 0; x < cnt; x += WP_BLKS_PER_QUERY) {
-		ret = send_write_protect_type(fd, x * wp_sizeblks, &bits);
-		if (ret)
+		ret = mmc_ioctl(fd, MMC_IOC_MULTI_CMD, multi_cmd);
+		if (ret) {
+			perror("ioctl");
 			break;
-		remain = cnt - x;
-		if (remain > WP_BLKS_PER_QUERY)
-			remain = WP_BLKS_PER_QUERY;
-		for (y = 0; y < remain; y++) {
-			prot = (bits >> (y * 2)) & 0x3;
-			if (prot != last_prot) {
-				/* not first time */
-				if (last_prot != -1) {
-					wpblk = x + y;
-					print_wp_status(wp_sizeblks,
-							last_wpblk,
-							wpblk - 1,
-							last_prot);
-					last_wpblk = wpblk;
-				}
-				last_prot = prot;
-			}
 		}
+
+		for (i = 0; i < n; i++) {
+			bits = 0;
+			for (x = 0; x < 8; x++)
+				bits |= (__u64)(bufs[i][7 - x]) << (x * 8);
+			for (y = 0; y < WP_BLKS_PER_QUERY &&
+				    windows[i] + y < cnt; y++)
+				map[windows[i] + y] = (bits >> (y * 2)) & 0x3;
+		}
+		windows += n;
+		nwin -= n;
 	}
-	if (last_wpblk != (x + y - 1))
-		print_wp_status(wp_sizeblks, last_wpblk, cnt - 1, last_prot);
 
-	close(fd);
+out:
+	free(bufs);
+	free(multi_cmd);
 	return ret;
 }
 
-int do_writeprotect_user_set(int nargs, char **argv)
+static int scan_wp_map(int fd, __u32 wp_sizeblks, __u32 cnt, __u8 *map)
 {
-	__u8 ext_csd[512];
-	int fd, ret;
-	char *device;
-	int blk_start;
-	int blk_cnt;
-	__u32 wp_blks;
-	__u8 user_wp;
-	int x;
-	int wptype;
+	unsigned int i, nwin = (cnt + WP_BLKS_PER_QUERY - 1) / WP_BLKS_PER_QUERY;
+	__u32 *windows;
+	int ret;
 
-	if (nargs != 5)
-		goto usage;
-	device = argv[4];
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
+	windows = calloc(nwin ? nwin : 1, sizeof(*windows));
+	if (!windows) {
+		perror("calloc");
+		return -ENOMEM;
 	}
-	if (!strcmp(argv[1], "none")) {
-		wptype = WPTYPE_NONE;
-	} else if (!strcmp(argv[1], "temp")) {
-		wptype = WPTYPE_TEMP;
+	for (i = 0; i < nwin; i++)
+		windows[i] = i * WP_BLKS_PER_QUERY;
+	ret = read_wp_groups(fd, wp_sizeblks, cnt, windows, nwin, map);
+	free(windows);
+
+	return ret;
+}
+
+static void print_wp_map(__u32 wp_sizeblks, __u32 cnt, const __u8 *map)
+{
+	__u32 x, start = 0;
+
+	for (x = 1; x <= cnt; x++) {
+		if (x < cnt && map[x] == map[start])
+			continue;
+		print_wp_status(wp_sizeblks, start, x - 1, map[start]);
+		start = x;
+	}
+}
+
+/*
+ * The user area WP map is cached run-length encoded in the state directory.
+ * It is only used while the CID, SEC_COUNT, USER_WP and WP group size are
+ * the same as when it was saved.
+ */
+#define WP_CACHE_MAGIC		"MMCWPMP1"
+#define WP_CACHE_SAMPLES	16	/* random windows re-validated per use */
+
+struct wp_cache_hdr {
+	char magic[8];
+	char cid[40];
+	__le64 sec_count;
+	__le64 btime;		/* boot the map was last validated in */
+	__le32 wp_sizeblks;
+	__le32 groups;
+	__le32 runs;
+	__u8 user_wp;
+	__u8 reserved[3];
+} __attribute__((packed));
+
+struct wp_cache_run {
+	__le32 groups;
+	__u8 prot;
+	__u8 reserved[3];
+} __attribute__((packed));
+
+static void wp_cache_key(const char *device, __u8 *ext_csd,
+			 __u32 wp_sizeblks, __u32 cnt,
+			 struct wp_cache_hdr *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, WP_CACHE_MAGIC, sizeof(hdr->magic));
+	get_cid_string(device, hdr->cid, sizeof(hdr->cid));
+	hdr->sec_count = htole64(per_byte_htole32(&ext_csd[EXT_CSD_SEC_COUNT_0]));
+	hdr->wp_sizeblks = htole32(wp_sizeblks);
+	hdr->groups = htole32(cnt);
+	hdr->user_wp = ext_csd[EXT_CSD_USER_WP];
+}
+
+/* Return: 0 with *btime set if @path holds the map for @key, else -1 */
+static int load_wp_cache(const char *path, const struct wp_cache_hdr *key,
+			 __u8 *map, __u64 *btime)
+{
+	struct wp_cache_hdr hdr;
+	struct wp_cache_run run;
+	__u32 i, x = 0, cnt = le32toh(key->groups);
+	int ret = -1;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, key->magic, sizeof(hdr.magic)) ||
+	    memcmp(hdr.cid, key->cid, sizeof(hdr.cid)) ||
+	    hdr.sec_count != key->sec_count ||
+	    hdr.wp_sizeblks != key->wp_sizeblks ||
+	    hdr.groups != key->groups || hdr.user_wp != key->user_wp)
+		goto out;
+
+	for (i = 0; i < le32toh(hdr.runs); i++) {
+		if (fread(&run, sizeof(run), 1, f) != 1 ||
+		    le32toh(run.groups) > cnt - x || run.prot > 3)
+			goto out;
+		memset(map + x, run.prot, le32toh(run.groups));
+		x += le32toh(run.groups);
+	}
+	if (x == cnt) {
+		*btime = le64toh(hdr.btime);
+		ret = 0;
+	}
+out:
+	fclose(f);
+	return ret;
+}
+
+static void save_wp_cache(const char *path, struct wp_cache_hdr *hdr,
+			  const __u8 *map, __u64 btime)
+{
+	__u32 x, start = 0, runs = 0, cnt = le32toh(hdr->groups);
+	struct wp_cache_run run = {};
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	make_state_dir(tmp);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return;
+	}
+
+	for (x = 1; x <= cnt; x++)
+		if (x == cnt || map[x] != map[x - 1])
+			runs++;
+	hdr->runs = htole32(runs);
+	hdr->btime = htole64(btime);
+	fwrite(hdr, sizeof(*hdr), 1, f);
+
+	for (x = 1; x <= cnt; x++) {
+		if (x < cnt && map[x] == map[start])
+			continue;
+		run.groups = htole32(x - start);
+		run.prot = map[start];
+		fwrite(&run, sizeof(run), 1, f);
+		start = x;
+	}
+
+	if (fclose(f) || rename(tmp, path)) {
+		perror(path);
+		unlink(tmp);
+	}
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	__u32 x = *(const __u32 *)a, y = *(const __u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Re-reads the windows most likely to have changed and compares them with
+ * the cached @map: the windows at run boundaries, a random sample, and
+ * after a reboot, which may have been a power cycle, every window holding
+ * temporary or power-on protection.
+ *
+ * Return: the number of windows read if they all match, -1 on mismatch.
+ */
+static int validate_wp_cache(int fd, __u32 wp_sizeblks, __u32 cnt,
+			     const __u8 *map, bool rebooted)
+{
+	unsigned int nwin = (cnt + WP_BLKS_PER_QUERY - 1) / WP_BLKS_PER_QUERY;
+	unsigned int i, n = 0, w;
+	__u32 *windows;
+	__u8 *check;
+	__u32 x;
+	int ret = -1;
+
+	windows = calloc(nwin + WP_CACHE_SAMPLES + 1, sizeof(*windows));
+	check = malloc(cnt ? cnt : 1);
+	if (!windows || !check) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(check, map, cnt);
+
+	for (x = 0; x < cnt; x++)
+		if ((x && map[x] != map[x - 1]) || x == cnt - 1 ||
+		    (rebooted && (map[x] == WPTYPE_TEMP ||
+				  map[x] == WPTYPE_PWRON)))
+			windows[n++] = x / WP_BLKS_PER_QUERY;
+	srandom(time(NULL) ^ getpid());
+	for (i = 0; i < WP_CACHE_SAMPLES && nwin; i++)
+		windows[n++] = random() % nwin;
+
+	/* windows were added in order, except for the sample */
+	qsort(windows, n, sizeof(*windows), cmp_u32);
+	for (i = 0, w = 0; i < n; i++)
+		if (!w || windows[i] != windows[w - 1])
+			windows[w++] = windows[i];
+	for (i = 0; i < w; i++)
+		windows[i] *= WP_BLKS_PER_QUERY;
+
+	if (!read_wp_groups(fd, wp_sizeblks, cnt, windows, w, check) &&
+	    !memcmp(check, map, cnt))
+		ret = w;
+
+	free(check);
+	free(windows);
+	return ret;
+}
+
+int do_writeprotect_user_get(int nargs, char **argv)
+{
+	struct wp_cache_hdr key;
+	__u8 ext_csd[512], *map;
+	char path[PATH_MAX];
+	__u64 btime = 0;
+	bool use_cache = false;
+	int fd, ret, c, checked = -1;
+	char *device;
+	__u32 wp_sizeblks;
+	__u32 dev_sizeblks;
+	__u32 cnt;
+
+	while ((c = getopt(nargs, argv, "c")) != -1) {
+		switch (c) {
+		case 'c':
+			use_cache = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind != 1)
+		goto usage;
+
+	device = argv[optind];
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	ret = get_wp_group_size_in_blks(ext_csd, &wp_sizeblks);
+	if (ret)
+		exit(1);
+	printf("Write Protect Group size in blocks/bytes: %d/%d\n",
+		wp_sizeblks, wp_sizeblks * 512);
+	dev_sizeblks = get_size_in_blks(fd);
+	cnt = dev_sizeblks / wp_sizeblks;
+	map = malloc(cnt ? cnt : 1);
+	if (!map) {
+		perror("malloc");
+		exit(1);
+	}
+
+	if (use_cache) {
+		get_state_path(device, "wp", path, sizeof(path));
+		wp_cache_key(device, ext_csd, wp_sizeblks, cnt, &key);
+		if (!load_wp_cache(path, &key, map, &btime))
+			checked = validate_wp_cache(fd, wp_sizeblks, cnt, map,
+						    rebooted_since(btime));
+	}
+
+	if (checked < 0) {
+		ret = scan_wp_map(fd, wp_sizeblks, cnt, map);
+		if (ret)
+			goto out;
+		if (use_cache)
+			save_wp_cache(path, &key, map, get_boot_time());
+	} else if (rebooted_since(btime)) {
+		/* validated in this boot now */
+		save_wp_cache(path, &key, map, get_boot_time());
+	}
+
+	print_wp_map(wp_sizeblks, cnt, map);
+	if (use_cache)
+		fprintf(stderr, checked < 0 ?
+			"WP map cache rebuilt by a full scan\n" :
+			"WP map from cache, %d of %u windows re-validated\n",
+			checked, (cnt + WP_BLKS_PER_QUERY - 1) / WP_BLKS_PER_QUERY);
+
+out:
+	free(map);
+	close(fd);
+	return ret;
+
+usage:
+	fprintf(stderr, "Usage: mmc writeprotect user get [-c] </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+/*
+ * After CMD28/CMD29 on groups [@first, @first + @n), re-read them into a
+ * valid cached map, so the next 'get -c' doesn't need a full scan.
+ */
+static void update_wp_cache(int fd, const char *device, __u8 *ext_csd,
+			    __u32 wp_sizeblks, __u32 first, __u32 n)
+{
+	struct wp_cache_hdr key;
+	char path[PATH_MAX];
+	__u32 cnt, w, nwin, *windows;
+	__u64 btime;
+	__u8 *map;
+
+	if (!n)
+		return;
+	cnt = get_size_in_blks(fd) / wp_sizeblks;
+	get_state_path(device, "wp", path, sizeof(path));
+	wp_cache_key(device, ext_csd, wp_sizeblks, cnt, &key);
+	map = malloc(cnt ? cnt : 1);
+	if (!map)
+		return;
+	if (load_wp_cache(path, &key, map, &btime))
+		goto out;
+
+	nwin = (first + n - 1) / WP_BLKS_PER_QUERY -
+	       first / WP_BLKS_PER_QUERY + 1;
+	first /= WP_BLKS_PER_QUERY;
+	windows = calloc(nwin ? nwin : 1, sizeof(*windows));
+	if (!windows)
+		goto out;
+	for (w = 0; w < nwin; w++)
+		windows[w] = (first + w) * WP_BLKS_PER_QUERY;
+	if (read_wp_groups(fd, wp_sizeblks, cnt, windows, nwin, map))
+		unlink(path);
+	else
+		save_wp_cache(path, &key, map, btime);
+	free(windows);
+out:
+	free(map);
+}
+
+int do_writeprotect_user_set(int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	int fd, ret;
+	char *device;
+	int blk_start;
+	int blk_cnt;
+	__u32 wp_blks;
+	__u8 user_wp;
+	int x;
+	int wptype;
+
+	if (nargs != 5)
+		goto usage;
+	device = argv[4];
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	if (!strcmp(argv[1], "none")) {
+		wptype = WPTYPE_NONE;
+	} else if (!strcmp(argv[1], "temp")) {
+		wptype = WPTYPE_TEMP;
 	} else if (!strcmp(argv[1], "pwron")) {
 		wptype = WPTYPE_PWRON;
 #ifdef DANGEROUS_COMMANDS_ENABLED
@@ -557,6 +1356,8 @@ int do_writeprotect_user_set(int nargs, char **argv)
 			exit(1);
 		}
 	}
+	update_wp_cache(fd, device, ext_csd, wp_blks, blk_start / wp_blks,
+			blk_cnt / wp_blks);
 	return ret;
 
 usage:
@@ -868,6 +1669,169 @@ int do_write_bkops_en(int nargs, char **argv)
 	return ret;
 }
 
+struct bkops_ctx {
+	const char *device;
+	struct blk_stat last;
+};
+
+/* Host I/O resumed (or the user gave up) while BKOPS was running */
+static bool bkops_should_stop(void *priv)
+{
+	struct bkops_ctx *ctx = priv;
+	struct blk_stat st;
+
+	if (mmc_interrupted)
+		return true;
+	if (read_blk_stat(ctx->device, &st))
+		return true;
+
+	return st.in_flight ||
+	       st.rd_ios != ctx->last.rd_ios || st.wr_ios != ctx->last.wr_ios;
+}
+
+int do_bkops_run(int nargs, char **argv)
+{
+	__u8 ext_csd[512], level;
+	int fd, ret;
+	char *device;
+	unsigned int poll_ms = 100, duration_s = 0;
+	struct bkops_ctx ctx;
+	struct blk_stat st;
+	struct mmc_ioc_cmd idata = {};
+	__u64 end = 0, start, elapsed, busy_us = 0, longest_us = 0;
+	unsigned int runs = 0, completed = 0, interrupted = 0;
+	unsigned int per_level[4] = {};
+
+	if (nargs < 2 || nargs > 4) {
+		fprintf(stderr, "Usage: mmc bkops run </path/to/mmcblkX> [poll_ms] [duration_s]\n");
+		exit(1);
+	}
+
+	device = argv[1];
+	if (nargs > 2)
+		poll_ms = strtoul(argv[2], NULL, 10);
+	if (nargs > 3)
+		duration_s = strtoul(argv[3], NULL, 10);
+	if (!poll_ms) {
+		fprintf(stderr, "poll_ms must be greater than 0\n");
+		exit(1);
+	}
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V4_4_1 ||
+	    !(ext_csd[EXT_CSD_BKOPS_SUPPORT] & 0x1)) {
+		fprintf(stderr, "%s does not support background operations\n",
+			device);
+		exit(1);
+	}
+	if (!(ext_csd[EXT_CSD_BKOPS_EN] & BKOPS_MAN_ENABLE)) {
+		fprintf(stderr, "Manual BKOPS is not enabled on %s, see 'mmc bkops_en'\n",
+			device);
+		exit(1);
+	}
+	if (!hpi_prepare(fd, ext_csd))
+		fprintf(stderr, "%s does not support HPI, BKOPS cannot be interrupted\n",
+			device);
+
+	ctx.device = device;
+	if (read_blk_stat(device, &ctx.last))
+		exit(1);
+
+	catch_interrupts();
+	if (duration_s)
+		end = get_time_us() + duration_s * 1000000ull;
+
+	/*
+	 * BKOPS_START is sent without waiting for busy, so the ioctl returns
+	 * right away and the device stays in PRG state while it works.
+	 */
+	fill_switch_cmd(&idata, EXT_CSD_BKOPS_START, 1);
+	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+
+	while (!mmc_interrupted && (!end || get_time_us() < end)) {
+		usleep(poll_ms * 1000);
+
+		if (read_blk_stat(device, &st)) {
+			ret = -EIO;
+			break;
+		}
+		if (st.in_flight || st.rd_ios != ctx.last.rd_ios ||
+		    st.wr_ios != ctx.last.wr_ios) {
+			ctx.last = st;
+			continue;
+		}
+
+		/* idle for a whole poll period, is there anything to do? */
+		if (read_extcsd(fd, ext_csd)) {
+			fprintf(stderr, "Could not read EXT_CSD from %s\n",
+				device);
+			ret = -EIO;
+			break;
+		}
+		level = ext_csd[EXT_CSD_BKOPS_STATUS] & BKOPS_STATUS_MASK;
+		if (level == BKOPS_NOT_REQUIRED)
+			continue;
+
+		start = get_time_us();
+		ret = mmc_ioctl(fd, MMC_IOC_CMD, &idata);
+		if (ret) {
+			perror("BKOPS_START ioctl");
+			break;
+		}
+		runs++;
+		per_level[level]++;
+
+		ret = wait_while_prg(fd, 1000, bkops_should_stop, &ctx, NULL);
+		if (ret == 1) {
+			if (hpi_interrupt(fd, ext_csd))
+				ret = -EIO;
+			interrupted++;
+		} else if (ret == 0) {
+			completed++;
+		}
+		elapsed = get_time_us() - start;
+		busy_us += elapsed;
+		if (elapsed > longest_us)
+			longest_us = elapsed;
+
+		printf("BKOPS (status 0x%02x) %s after %llu ms\n", level,
+		       ret < 0 ? "failed" : ret ? "interrupted" : "completed",
+		       elapsed / 1000);
+		if (ret < 0)
+			break;
+
+		if (read_blk_stat(device, &ctx.last)) {
+			ret = -EIO;
+			break;
+		}
+	}
+
+	printf("BKOPS runs: %u (completed %u, interrupted %u)\n",
+	       runs, completed, interrupted);
+	printf(" started at non-critical: %u, performance impacted: %u, critical: %u\n",
+	       per_level[BKOPS_NON_CRITICAL], per_level[BKOPS_PERF_IMPACTED],
+	       per_level[BKOPS_CRITICAL]);
+	printf("Background work absorbed while idle: %llu ms (longest %llu ms)\n",
+	       busy_us / 1000, longest_us / 1000);
+	if (!read_extcsd(fd, ext_csd))
+		printf("BKOPS_STATUS on exit: 0x%02x\n",
+		       ext_csd[EXT_CSD_BKOPS_STATUS]);
+
+	close(fd);
+	return ret < 0 ? 1 : 0;
+}
+
 int do_status_get(int nargs, char **argv)
 {
 	__u32 response;
@@ -1497,20 +2461,168 @@ int do_write_reliability_set(int nargs, char **argv)
 	return 0;
 }
 
-int do_read_extcsd(int nargs, char **argv)
+/* One hardware area of a "layout plan": the user area or GP1..GP4 */
+struct layout_area {
+	const char *name;
+	bool present;
+	bool enh;
+	bool rel;
+	bool max;		/* as much enhanced capacity as is left */
+	unsigned int ext;	/* EXT_PARTITIONS_ATTRIBUTE value */
+	unsigned long long size_kib;
+	unsigned long long start_kib;	/* enhanced user area only */
+	unsigned int mult;	/* size in write protect groups */
+};
+
+/* Sizes are in KiB unless suffixed with K, M or G */
+static int parse_layout_size(const char *str, unsigned long long *kib)
 {
-	__u8 ext_csd[512], ext_csd_rev, reg;
-	__u32 regl;
-	int fd, ret;
+	char *end;
+
+	*kib = strtoull(str, &end, 10);
+	if (end == str)
+		return -1;
+
+	switch (*end) {
+	case 'G':
+		*kib *= 1024;
+		/* fall through */
+	case 'M':
+		*kib *= 1024;
+		/* fall through */
+	case 'K':
+	case '\0':
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/* <area>[=<size>|=max][@<start>][:enh|:ext1|:ext2][:rel] */
+static int parse_layout_area(char *spec, struct layout_area *areas)
+{
+	struct layout_area *a = NULL;
+	char *attr, *size, *start;
+	unsigned int i;
+
+	attr = strchr(spec, ':');
+	if (attr)
+		*attr++ = '\0';
+	size = strchr(spec, '=');
+	if (size)
+		*size++ = '\0';
+
+	for (i = 0; i < 5; i++)
+		if (!strcmp(spec, areas[i].name))
+			a = &areas[i];
+	if (!a) {
+		fprintf(stderr, "Unknown area '%s', must be user or gp1..gp4\n",
+			spec);
+		return -1;
+	}
+	a->present = true;
+
+	while (attr) {
+		char *next = strchr(attr, ':');
+
+		if (next)
+			*next++ = '\0';
+		if (!strcmp(attr, "enh"))
+			a->enh = true;
+		else if (!strcmp(attr, "rel"))
+			a->rel = true;
+		else if (!strcmp(attr, "ext1") && a != &areas[0])
+			a->ext = 1;
+		else if (!strcmp(attr, "ext2") && a != &areas[0])
+			a->ext = 2;
+		else {
+			fprintf(stderr, "Unknown attribute '%s' for %s\n",
+				attr, a->name);
+			return -1;
+		}
+		attr = next;
+	}
+
+	if (a->enh && a->ext) {
+		fprintf(stderr, "%s cannot have both enhanced and extended attributes\n",
+			a->name);
+		return -1;
+	}
+
+	if (size) {
+		start = strchr(size, '@');
+		if (start) {
+			*start++ = '\0';
+			if (a != &areas[0] ||
+			    parse_layout_size(start, &a->start_kib)) {
+				fprintf(stderr, "Invalid start for %s\n",
+					a->name);
+				return -1;
+			}
+		}
+		if (!strcmp(size, "max"))
+			a->max = true;
+		else if (parse_layout_size(size, &a->size_kib)) {
+			fprintf(stderr, "Invalid size for %s\n", a->name);
+			return -1;
+		}
+	}
+
+	/* the user area only takes a size for its enhanced part */
+	if (a == &areas[0] ? (size && !a->enh) || (a->enh && !size) : !size) {
+		fprintf(stderr, "%s needs a size%s\n", a->name,
+			a == &areas[0] ? " with, and only with, :enh" : "");
+		return -1;
+	}
+	if (a->max && !a->enh) {
+		fprintf(stderr, "max is only valid for enhanced areas\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void add_layout_switch(struct mmc_ioc_multi_cmd *multi_cmd,
+			      __u8 index, __u8 value)
+{
+	fill_switch_cmd(&multi_cmd->cmds[multi_cmd->num_of_cmds++], index,
+			value);
+}
+
+int do_layout_plan(int nargs, char **argv)
+{
+	struct layout_area areas[5] = {
+		{ .name = "user" }, { .name = "gp1" }, { .name = "gp2" },
+		{ .name = "gp3" }, { .name = "gp4" },
+	};
+	struct mmc_ioc_multi_cmd *multi_cmd;
+	unsigned long long unit_kib, total_kib, used_kib = 0, start;
+	unsigned int max_enh, enh_used = 0, nr_max = 0, left, i;
+	__u8 ext_csd[512], attr = 0, ext_attr[2] = {}, rel = 0;
+	int fd, ret, dry_run;
 	char *device;
-	const char *str;
+	__u32 response;
 
-	if (nargs != 2) {
-		fprintf(stderr, "Usage: mmc extcsd read </path/to/mmcblkX>\n");
+	if (nargs < 4) {
+		fprintf(stderr, "Usage: mmc layout plan <-y|-n> <area spec>... </path/to/mmcblkX>\n");
 		exit(1);
 	}
 
-	device = argv[1];
+	if (!strcmp(argv[1], "-y"))
+		dry_run = 0;
+	else if (!strcmp(argv[1], "-n"))
+		dry_run = 1;
+	else {
+		fprintf(stderr, "Must pass -y or -n\n");
+		exit(1);
+	}
+	device = argv[nargs - 1];
+
+	for (i = 2; i < nargs - 1; i++)
+		if (parse_layout_area(argv[i], areas))
+			exit(1);
 
 	fd = open(device, O_RDWR);
 	if (fd < 0) {
@@ -1524,36 +2636,285 @@ int do_read_extcsd(int nargs, char **argv)
 		exit(1);
 	}
 
-	ext_csd_rev = ext_csd[EXT_CSD_REV];
-
-	switch (ext_csd_rev) {
+	if (ext_csd[EXT_CSD_PARTITION_SETTING_COMPLETED]) {
+		printf(" Device is already partitioned\n");
+		exit(1);
+	}
+	if (!(ext_csd[EXT_CSD_PARTITIONING_SUPPORT] & EXT_CSD_PARTITIONING_EN)) {
+		fprintf(stderr, "%s does not support partitioning\n", device);
+		exit(1);
+	}
+
+	unit_kib = 512ull * get_hc_wp_grp_size(ext_csd) *
+		   get_hc_erase_grp_size(ext_csd);
+	if (!unit_kib) {
+		fprintf(stderr, "%s reports no high capacity write protect group size\n",
+			device);
+		exit(1);
+	}
+	max_enh = (ext_csd[EXT_CSD_MAX_ENH_SIZE_MULT_2] << 16) |
+		  (ext_csd[EXT_CSD_MAX_ENH_SIZE_MULT_1] << 8) |
+		  ext_csd[EXT_CSD_MAX_ENH_SIZE_MULT_0];
+	total_kib = get_sector_count(ext_csd) / 2;
+
+	for (i = 0; i < 5; i++) {
+		struct layout_area *a = &areas[i];
+
+		if (a->enh && !(ext_csd[EXT_CSD_PARTITIONING_SUPPORT] &
+				EXT_CSD_ENH_ATTRIBUTE_EN)) {
+			fprintf(stderr, "%s does not support enhanced areas\n",
+				device);
+			exit(1);
+		}
+		if (a->ext && !(ext_csd[EXT_CSD_PARTITIONING_SUPPORT] &
+				EXT_CSD_EXT_ATTRIBUTE_EN)) {
+			fprintf(stderr, "%s does not support extended attributes\n",
+				device);
+			exit(1);
+		}
+		if (a->rel && !(ext_csd[EXT_CSD_WR_REL_PARAM] & HS_CTRL_REL)) {
+			fprintf(stderr, "Cannot set write reliability, WR_REL_SET is read-only\n");
+			exit(1);
+		}
+
+		if (a->max) {
+			nr_max++;
+			continue;
+		}
+		/* never hand out less than was asked for */
+		a->mult = (a->size_kib + unit_kib - 1) / unit_kib;
+		if (a->enh)
+			enh_used += a->mult;
+	}
+
+	if (enh_used > max_enh) {
+		fprintf(stderr, "Enhanced areas need %u write protect groups, but MAX_ENH_SIZE_MULT is %u\n",
+			enh_used, max_enh);
+		exit(1);
+	}
+
+	/* share what is left of the enhanced capacity among the "max" areas */
+	left = max_enh - enh_used;
+	for (i = 0; i < 5; i++) {
+		if (!areas[i].max)
+			continue;
+		areas[i].mult = left / nr_max + (left % nr_max ? 1 : 0);
+		left -= areas[i].mult;
+		nr_max--;
+		enh_used += areas[i].mult;
+	}
+
+	printf("Write protect group: %llu KiB, device capacity: %llu KiB\n\n",
+	       unit_kib, total_kib);
+	printf("%-6s %10s %14s  %s\n", "area", "WP groups", "size KiB",
+	       "attributes");
+	for (i = 0; i < 5; i++) {
+		struct layout_area *a = &areas[i];
+
+		if (!a->present)
+			continue;
+		used_kib += a->mult * unit_kib;
+		printf("%-6s %10u %14llu  %s%s%s%s\n", a->name, a->mult,
+		       a->mult * unit_kib, a->enh ? "enhanced " : "",
+		       a->ext == 1 ? "system-code " : "",
+		       a->ext == 2 ? "non-persistent " : "",
+		       a->rel ? "reliable-write" : "");
+	}
+	printf("\nEnhanced: %u of %u write protect groups (%llu of %llu KiB)\n",
+	       enh_used, max_enh, enh_used * unit_kib, max_enh * unit_kib);
+
+	if (used_kib > total_kib) {
+		fprintf(stderr, "Requested total partition size %llu KiB cannot exceed card capacity %llu KiB\n",
+			used_kib, total_kib);
+		exit(1);
+	}
+
+	/* ENH_START_ADDR is in sectors on block addressed devices */
+	start = areas[0].start_kib * (is_blockaddresed(ext_csd) ? 2 : 1024);
+	start -= start % (unit_kib * (is_blockaddresed(ext_csd) ? 2 : 1024));
+	if (areas[0].enh) {
+		printf("Enhanced user area start: %llu KiB\n",
+		       start / (is_blockaddresed(ext_csd) ? 2 : 1024));
+		if (areas[0].start_kib + areas[0].mult * unit_kib >
+		    total_kib - (used_kib - areas[0].mult * unit_kib)) {
+			fprintf(stderr, "Enhanced user area ends past the user area\n");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < 5; i++) {
+		if (areas[i].enh && areas[i].mult)
+			attr |= 1 << i;
+		if (areas[i].rel)
+			rel |= 1 << i;
+		if (i)
+			ext_attr[(i - 1) / 2] |= areas[i].ext << (4 * ((i - 1) % 2));
+	}
+
+	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+			   32 * sizeof(struct mmc_ioc_cmd));
+	if (!multi_cmd) {
+		perror("Failed to allocate memory");
+		exit(1);
+	}
+
+	add_layout_switch(multi_cmd, EXT_CSD_ERASE_GROUP_DEF, 0x1);
+	for (i = 1; i < 5; i++) {
+		__u8 idx = EXT_CSD_GP_SIZE_MULT_1_0 + (i - 1) * 3;
+
+		add_layout_switch(multi_cmd, idx + 2, areas[i].mult >> 16);
+		add_layout_switch(multi_cmd, idx + 1, areas[i].mult >> 8);
+		add_layout_switch(multi_cmd, idx, areas[i].mult);
+	}
+	if (areas[0].enh) {
+		add_layout_switch(multi_cmd, EXT_CSD_ENH_START_ADDR_3, start >> 24);
+		add_layout_switch(multi_cmd, EXT_CSD_ENH_START_ADDR_2, start >> 16);
+		add_layout_switch(multi_cmd, EXT_CSD_ENH_START_ADDR_1, start >> 8);
+		add_layout_switch(multi_cmd, EXT_CSD_ENH_START_ADDR_0, start);
+		add_layout_switch(multi_cmd, EXT_CSD_ENH_SIZE_MULT_2,
+				  areas[0].mult >> 16);
+		add_layout_switch(multi_cmd, EXT_CSD_ENH_SIZE_MULT_1,
+				  areas[0].mult >> 8);
+		add_layout_switch(multi_cmd, EXT_CSD_ENH_SIZE_MULT_0,
+				  areas[0].mult);
+	}
+	add_layout_switch(multi_cmd, EXT_CSD_PARTITIONS_ATTRIBUTE, attr);
+	if (ext_csd[EXT_CSD_PARTITIONING_SUPPORT] & EXT_CSD_EXT_ATTRIBUTE_EN) {
+		add_layout_switch(multi_cmd, EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_0,
+				  ext_attr[0]);
+		add_layout_switch(multi_cmd, EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_1,
+				  ext_attr[1]);
+	}
+	if (ext_csd[EXT_CSD_WR_REL_PARAM] & HS_CTRL_REL)
+		add_layout_switch(multi_cmd, EXT_CSD_WR_REL_SET,
+				  ext_csd[EXT_CSD_WR_REL_SET] | rel);
+	if (dry_run) {
+		printf("\nDry run, pass -y to program the layout with %llu SWITCH commands\n",
+		       multi_cmd->num_of_cmds + 1ull);
+		fprintf(stderr, "NOTE!  This is a one-time programmable (unreversible) change.\n");
+		free(multi_cmd);
+		close(fd);
+		return 0;
+	}
+
+	/*
+	 * The kernel doesn't stop a MULTI_CMD on R1 status bits, so the layout
+	 * goes out on its own and is checked before the one-time commit.
+	 */
+	fprintf(stderr, "setting OTP partition layout\n");
+	ret = mmc_ioctl(fd, MMC_IOC_MULTI_CMD, multi_cmd);
+	if (ret) {
+		perror("Layout multi-cmd ioctl");
+		exit(1);
+	}
+	/* a SWITCH's status is reported in the R1 of the next command */
+	for (i = 1; i < multi_cmd->num_of_cmds; i++) {
+		if (multi_cmd->cmds[i].response[0] & R1_SWITCH_ERROR) {
+			fprintf(stderr, "SWITCH to EXT_CSD[%d] failed on %s\n",
+				(multi_cmd->cmds[i - 1].arg >> 16) & 0xff,
+				device);
+			exit(1);
+		}
+	}
+	ret = send_status(fd, &response);
+	if (ret || response & R1_SWITCH_ERROR) {
+		fprintf(stderr, "Setting the partition layout failed on %s\n",
+			device);
+		exit(1);
+	}
+
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	for (i = 0; i < multi_cmd->num_of_cmds; i++) {
+		__u8 idx = (multi_cmd->cmds[i].arg >> 16) & 0xff;
+		__u8 value = (multi_cmd->cmds[i].arg >> 8) & 0xff;
+
+		if (ext_csd[idx] != value) {
+			fprintf(stderr, "EXT_CSD[%d] reads back 0x%02x instead of 0x%02x on %s, not setting PARTITION_SETTING_COMPLETED\n",
+				idx, ext_csd[idx], value, device);
+			exit(1);
+		}
+	}
+	free(multi_cmd);
+
+	ret = set_partitioning_setting_completed(0, device, fd);
+	close(fd);
+	return ret;
+}
+
+static int print_extcsd(__u8 *ext_csd);
+
+int do_read_extcsd(int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	int fd, ret;
+	char *device;
+
+	if (nargs != 2) {
+		fprintf(stderr, "Usage: mmc extcsd read </path/to/mmcblkX>\n");
+		exit(1);
+	}
+
+	device = argv[1];
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	ret = print_extcsd(ext_csd);
+
+	close(fd);
+	return ret;
+}
+
+/* The MMC version of an EXT_CSD_REV, or NULL if it is unknown */
+static const char *extcsd_rev_str(__u8 rev)
+{
+	switch (rev) {
 	case 8:
-		str = "5.1";
-		break;
+		return "5.1";
 	case 7:
-		str = "5.0";
-		break;
+		return "5.0";
 	case 6:
-		str = "4.5";
-		break;
+		return "4.5";
 	case 5:
-		str = "4.41";
-		break;
+		return "4.41";
 	case 3:
-		str = "4.3";
-		break;
+		return "4.3";
 	case 2:
-		str = "4.2";
-		break;
+		return "4.2";
 	case 1:
-		str = "4.1";
-		break;
+		return "4.1";
 	case 0:
-		str = "4.0";
-		break;
+		return "4.0";
 	default:
-		goto out_free;
+		return NULL;
 	}
+}
+
+static int print_extcsd(__u8 *ext_csd)
+{
+	__u8 ext_csd_rev, reg;
+	__u32 regl;
+	const char *str;
+	int ret = 0;
+
+	ext_csd_rev = ext_csd[EXT_CSD_REV];
+
+	str = extcsd_rev_str(ext_csd_rev);
+	if (!str)
+		goto out_free;
 	printf("=============================================\n");
 	printf("  Extended CSD rev 1.%d (MMC %s)\n", ext_csd_rev, str);
 	printf("=============================================\n\n");
@@ -2042,20 +3403,22 @@ int do_write_extcsd(int nargs, char **argv)
 	return ret;
 }
 
-int do_sanitize(int nargs, char **argv)
+/*
+ * Raw EXT_CSD snapshots are stored as plain 512 byte records, so that dumps
+ * from many devices can simply be concatenated and decoded in one go.
+ */
+int do_dump_extcsd(int nargs, char **argv)
 {
+	__u8 ext_csd[512];
 	int fd, ret;
 	char *device;
-	unsigned int timeout = 0;
+	FILE *out;
 
-	if (nargs != 2 && nargs != 3) {
-		fprintf(stderr, "Usage: mmc sanitize </path/to/mmcblkX> [timeout_in_ms]\n");
+	if (nargs != 3) {
+		fprintf(stderr, "Usage: mmc extcsd dump </path/to/mmcblkX> <file|->\n");
 		exit(1);
 	}
 
-	if (nargs == 3)
-		timeout = strtol(argv[2], NULL, 10);
-
 	device = argv[1];
 
 	fd = open(device, O_RDWR);
@@ -2064,139 +3427,655 @@ int do_sanitize(int nargs, char **argv)
 		exit(1);
 	}
 
-	ret = write_extcsd_value(fd, EXT_CSD_SANITIZE_START, 1, timeout);
+	ret = read_extcsd(fd, ext_csd);
 	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-			1, EXT_CSD_SANITIZE_START, device);
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
 	}
-
 	close(fd);
-	return ret;
 
-}
+	if (!strcmp(argv[2], "-"))
+		out = stdout;
+	else
+		out = fopen(argv[2], "ab");
+	if (!out) {
+		perror(argv[2]);
+		exit(1);
+	}
 
-#define DO_IO(func, fd, buf, nbyte)					\
-	({												\
-		ssize_t ret = 0, r;							\
-		do {										\
-			r = func(fd, buf + ret, nbyte - ret);	\
-			if (r < 0 && errno != EINTR) {			\
-				ret = -1;							\
-				break;								\
-			}										\
-			else if (r > 0)							\
-				ret += r;							\
-		} while (r != 0 && (size_t)ret < nbyte);	\
-													\
-		ret;										\
-	})
+	if (fwrite(ext_csd, sizeof(ext_csd), 1, out) != 1 || fflush(out)) {
+		perror("write EXT_CSD");
+		exit(1);
+	}
 
-#define RPMB_MULTI_CMD_MAX_CMDS 3
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}
 
-enum rpmb_op_type {
-	MMC_RPMB_WRITE_KEY = 0x01,
-	MMC_RPMB_READ_CNT  = 0x02,
-	MMC_RPMB_WRITE     = 0x03,
-	MMC_RPMB_READ      = 0x04,
-	MMC_RPMB_CONF_WRITE = 0x06,
-	MMC_RPMB_CONF_READ = 0x07,
+/* Opens a stream of raw EXT_CSD records, "-" being stdin */
+static FILE *open_extcsd_records(const char *path)
+{
+	FILE *in;
 
-	/* For internal usage only, do not use it directly */
-	MMC_RPMB_READ_RESP = 0x05
-};
+	if (!strcmp(path, "-"))
+		return stdin;
 
-struct rpmb_frame {
-	u_int8_t  stuff[196];           /* Bytes 511 - 316 */
-	u_int8_t  key_mac[32];          /* Bytes 315 - 284 */
-	u_int8_t  data[256];            /* Bytes 283 - 28 */
-	u_int8_t  nonce[16];            /* Bytes 27 - 12 */
-	u_int32_t write_counter;        /* Bytes 11 - 8 */
-	u_int16_t addr;                 /* Bytes 7 - 6 */
-	u_int16_t block_count;          /* Bytes 5 - 4 */
-	u_int16_t result;               /* Bytes 3 - 2 */
-	u_int16_t req_resp;             /* Bytes 1 - 0 */
-} __attribute__((packed));
+	in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		exit(1);
+	}
 
-static inline void set_single_cmd(struct mmc_ioc_cmd *ioc, __u32 opcode,
-				  int write_flag, unsigned int blocks,
-				  __u32 arg)
-{
-	ioc->opcode = opcode;
-	ioc->write_flag = write_flag;
-	ioc->arg = arg;
-	ioc->blksz = 512;
-	ioc->blocks = blocks;
-	ioc->flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	return in;
 }
 
-static int rpmb_get_key(const char key_file_name[], struct rpmb_frame *frame_in,
-			unsigned char key_out[32], bool encrypt)
+/*
+ * Return: 1 when a record was read, 0 at the end of the stream or -1 on a
+ *         read error or truncated record.
+ */
+static int read_extcsd_record(FILE *in, const char *path, __u8 *ext_csd)
 {
-	int ret, key_fd;
-	unsigned char key[32] = {};
+	size_t n = fread(ext_csd, 1, 512, in);
 
-	if (strcmp(key_file_name, "-") == 0) {
-		key_fd = STDIN_FILENO;
-	} else {
-		key_fd = open(key_file_name, O_RDONLY);
-		if (key_fd < 0) {
-			perror("can't open key file");
-			return EXIT_FAILURE;
-		}
+	if (n == 512)
+		return 1;
+	if (ferror(in)) {
+		perror(path);
+		return -1;
 	}
-
-	ret = DO_IO(read, key_fd, key, sizeof(key));
-	if (ret < 0) {
-		perror("read the key");
-		goto out;
-	} else if (ret != sizeof(key)) {
-		printf("Auth key must be %lu bytes length, but we read only %d, exit\n",
-		       (unsigned long)sizeof(key), ret);
-		ret = -EINVAL;
-		goto out;
+	if (n) {
+		fprintf(stderr, "%s: truncated EXT_CSD record (%zu bytes)\n",
+			path, n);
+		return -1;
 	}
 
-	if (key_out)
-		memcpy(key_out, key, 32);
+	return 0;
+}
 
-	if (encrypt) {
-		/* Calculate HMAC SHA256 */
-		hmac_sha256(key, sizeof(key), frame_in->data,
-			    sizeof(struct rpmb_frame) - offsetof(struct rpmb_frame, data),
-			    frame_in->key_mac, sizeof(frame_in->key_mac));
+int do_decode_extcsd(int nargs, char **argv)
+{
+	static char outbuf[1 << 20];
+	__u8 ext_csd[512];
+	unsigned int nr = 0;
+	int ret = 0, r;
+	FILE *in;
+
+	if (nargs != 2) {
+		fprintf(stderr, "Usage: mmc extcsd decode <file|->\n");
+		exit(1);
 	}
 
-	ret = 0;
+	in = open_extcsd_records(argv[1]);
+	setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
 
-out:
-	if (key_fd != STDIN_FILENO)
-		close(key_fd);
+	while ((r = read_extcsd_record(in, argv[1], ext_csd)) > 0) {
+		if (nr++)
+			printf("\n");
+		printf("Record %u\n", nr);
+		ret |= print_extcsd(ext_csd);
+	}
+	if (r < 0)
+		ret = 1;
+	if (!nr && !ret) {
+		fprintf(stderr, "%s: no EXT_CSD records\n", argv[1]);
+		ret = 1;
+	}
 
+	if (in != stdin)
+		fclose(in);
+	fflush(stdout);
 	return ret;
 }
 
-/* Performs RPMB operation.
- *
- * @fd: RPMB device on which we should perform ioctl command
- * @frame_in: input RPMB frame, should be properly inited
- * @frame_out: output (result) RPMB frame. Caller is responsible for checking
- *             result and req_resp for output frame.
- * @out_cnt: count of outer frames. Used only for multiple blocks reading,
- *           in the other cases -EINVAL will be returned.
+/*
+ * EXT_CSD fields by offset and size in bytes, with the EXT_CSD_REV that
+ * first defined them. Anything not listed is reserved or vendor specific.
  */
-static int do_rpmb_op(int fd, const struct rpmb_frame *frame_in,
-		      struct rpmb_frame *frame_out, unsigned int out_cnt)
+static const struct extcsd_field {
+	unsigned int offset;
+	unsigned int len;
+	const char *name;
+	__u8 min_rev;
+} extcsd_fields[] = {
+	{ 15, 1, "CMDQ_MODE_EN", EXT_CSD_REV_V5_1 },
+	{ 16, 1, "SECURE_REMOVAL_TYPE", EXT_CSD_REV_V5_1 },
+	{ 17, 1, "PRODUCT_STATE_AWARENESS_ENABLEMENT", EXT_CSD_REV_V5_0 },
+	{ 18, 4, "MAX_PRE_LOADING_DATA_SIZE", EXT_CSD_REV_V5_0 },
+	{ 22, 4, "PRE_LOADING_DATA_SIZE", EXT_CSD_REV_V5_0 },
+	{ 26, 1, "FFU_STATUS", EXT_CSD_REV_V5_0 },
+	{ 29, 1, "MODE_OPERATION_CODES", EXT_CSD_REV_V5_0 },
+	{ 30, 1, "MODE_CONFIG", EXT_CSD_REV_V5_0 },
+	{ 31, 1, "BARRIER_CTRL", EXT_CSD_REV_V5_1 },
+	{ 32, 1, "FLUSH_CACHE", EXT_CSD_REV_V4_4_1 },
+	{ 33, 1, "CACHE_CTRL", EXT_CSD_REV_V4_4_1 },
+	{ 34, 1, "POWER_OFF_NOTIFICATION", EXT_CSD_REV_V4_5 },
+	{ 35, 1, "PACKED_FAILURE_INDEX", EXT_CSD_REV_V4_5 },
+	{ 36, 1, "PACKED_COMMAND_STATUS", EXT_CSD_REV_V4_5 },
+	{ 37, 15, "CONTEXT_CONF", EXT_CSD_REV_V4_5 },
+	{ 52, 2, "EXT_PARTITIONS_ATTRIBUTE", EXT_CSD_REV_V4_5 },
+	{ 54, 2, "EXCEPTION_EVENTS_STATUS", EXT_CSD_REV_V4_5 },
+	{ 56, 2, "EXCEPTION_EVENTS_CTRL", EXT_CSD_REV_V4_5 },
+	{ 58, 1, "DYNCAP_NEEDED", EXT_CSD_REV_V4_5 },
+	{ 59, 1, "CLASS_6_CTRL", EXT_CSD_REV_V4_5 },
+	{ 60, 1, "INI_TIMEOUT_EMU", EXT_CSD_REV_V4_5 },
+	{ 61, 1, "DATA_SECTOR_SIZE", EXT_CSD_REV_V4_5 },
+	{ 62, 1, "USE_NATIVE_SECTOR", EXT_CSD_REV_V4_5 },
+	{ 63, 1, "NATIVE_SECTOR_SIZE", EXT_CSD_REV_V4_5 },
+	{ 64, 64, "VENDOR_SPECIFIC_FIELD", EXT_CSD_REV_V4_0 },
+	{ 130, 1, "PROGRAM_CID_CSD_DDR_SUPPORT", EXT_CSD_REV_V4_5 },
+	{ 131, 1, "PERIODIC_WAKEUP", EXT_CSD_REV_V4_5 },
+	{ 132, 1, "TCASE_SUPPORT", EXT_CSD_REV_V4_5 },
+	{ 133, 1, "PRODUCTION_STATE_AWARENESS", EXT_CSD_REV_V5_0 },
+	{ 134, 1, "SEC_BAD_BLK_MGMNT", EXT_CSD_REV_V4_4_1 },
+	{ 136, 4, "ENH_START_ADDR", EXT_CSD_REV_V4_4_1 },
+	{ 140, 3, "ENH_SIZE_MULT", EXT_CSD_REV_V4_4_1 },
+	{ 143, 12, "GP_SIZE_MULT", EXT_CSD_REV_V4_4_1 },
+	{ 155, 1, "PARTITION_SETTING_COMPLETED", EXT_CSD_REV_V4_4_1 },
+	{ 156, 1, "PARTITIONS_ATTRIBUTE", EXT_CSD_REV_V4_4_1 },
+	{ 157, 3, "MAX_ENH_SIZE_MULT", EXT_CSD_REV_V4_4_1 },
+	{ 160, 1, "PARTITIONING_SUPPORT", EXT_CSD_REV_V4_4_1 },
+	{ 161, 1, "HPI_MGMT", EXT_CSD_REV_V4_4_1 },
+	{ 162, 1, "RST_n_FUNCTION", EXT_CSD_REV_V4_4_1 },
+	{ 163, 1, "BKOPS_EN", EXT_CSD_REV_V4_4_1 },
+	{ 164, 1, "BKOPS_START", EXT_CSD_REV_V4_4_1 },
+	{ 165, 1, "SANITIZE_START", EXT_CSD_REV_V4_5 },
+	{ 166, 1, "WR_REL_PARAM", EXT_CSD_REV_V4_4_1 },
+	{ 167, 1, "WR_REL_SET", EXT_CSD_REV_V4_4_1 },
+	{ 168, 1, "RPMB_SIZE_MULT", EXT_CSD_REV_V4_4_1 },
+	{ 169, 1, "FW_CONFIG", EXT_CSD_REV_V4_4_1 },
+	{ 171, 1, "USER_WP", EXT_CSD_REV_V4_3 },
+	{ 173, 1, "BOOT_WP", EXT_CSD_REV_V4_4_1 },
+	{ 174, 1, "BOOT_WP_STATUS", EXT_CSD_REV_V5_0 },
+	{ 175, 1, "ERASE_GROUP_DEF", EXT_CSD_REV_V4_3 },
+	{ 177, 1, "BOOT_BUS_CONDITIONS", EXT_CSD_REV_V4_3 },
+	{ 178, 1, "BOOT_CONFIG_PROT", EXT_CSD_REV_V4_4_1 },
+	{ 179, 1, "PARTITION_CONFIG", EXT_CSD_REV_V4_3 },
+	{ 181, 1, "ERASED_MEM_CONT", EXT_CSD_REV_V4_3 },
+	{ 183, 1, "BUS_WIDTH", EXT_CSD_REV_V4_0 },
+	{ 184, 1, "STROBE_SUPPORT", EXT_CSD_REV_V5_0 },
+	{ 185, 1, "HS_TIMING", EXT_CSD_REV_V4_0 },
+	{ 187, 1, "POWER_CLASS", EXT_CSD_REV_V4_0 },
+	{ 189, 1, "CMD_SET_REV", EXT_CSD_REV_V4_0 },
+	{ 191, 1, "CMD_SET", EXT_CSD_REV_V4_0 },
+	{ 192, 1, "EXT_CSD_REV", EXT_CSD_REV_V4_0 },
+	{ 194, 1, "CSD_STRUCTURE", EXT_CSD_REV_V4_0 },
+	{ 196, 1, "DEVICE_TYPE", EXT_CSD_REV_V4_0 },
+	{ 197, 1, "DRIVER_STRENGTH", EXT_CSD_REV_V4_5 },
+	{ 198, 1, "OUT_OF_INTERRUPT_TIME", EXT_CSD_REV_V4_4_1 },
+	{ 199, 1, "PARTITION_SWITCH_TIME", EXT_CSD_REV_V4_4_1 },
+	{ 200, 1, "PWR_CL_52_195", EXT_CSD_REV_V4_0 },
+	{ 201, 1, "PWR_CL_26_195", EXT_CSD_REV_V4_0 },
+	{ 202, 1, "PWR_CL_52_360", EXT_CSD_REV_V4_0 },
+	{ 203, 1, "PWR_CL_26_360", EXT_CSD_REV_V4_0 },
+	{ 205, 1, "MIN_PERF_R_4_26", EXT_CSD_REV_V4_0 },
+	{ 206, 1, "MIN_PERF_W_4_26", EXT_CSD_REV_V4_0 },
+	{ 207, 1, "MIN_PERF_R_8_26_4_52", EXT_CSD_REV_V4_0 },
+	{ 208, 1, "MIN_PERF_W_8_26_4_52", EXT_CSD_REV_V4_0 },
+	{ 209, 1, "MIN_PERF_R_8_52", EXT_CSD_REV_V4_0 },
+	{ 210, 1, "MIN_PERF_W_8_52", EXT_CSD_REV_V4_0 },
+	{ 211, 1, "SECURE_WP_INFO", EXT_CSD_REV_V5_1 },
+	{ 212, 4, "SEC_COUNT", EXT_CSD_REV_V4_0 },
+	{ 216, 1, "SLEEP_NOTIFICATION_TIME", EXT_CSD_REV_V5_0 },
+	{ 217, 1, "S_A_TIMEOUT", EXT_CSD_REV_V4_3 },
+	{ 218, 1, "PRODUCTION_STATE_AWARENESS_TIMEOUT", EXT_CSD_REV_V5_0 },
+	{ 219, 1, "S_C_VCCQ", EXT_CSD_REV_V4_3 },
+	{ 220, 1, "S_C_VCC", EXT_CSD_REV_V4_3 },
+	{ 221, 1, "HC_WP_GRP_SIZE", EXT_CSD_REV_V4_3 },
+	{ 222, 1, "REL_WR_SEC_C", EXT_CSD_REV_V4_3 },
+	{ 223, 1, "ERASE_TIMEOUT_MULT", EXT_CSD_REV_V4_3 },
+	{ 224, 1, "HC_ERASE_GRP_SIZE", EXT_CSD_REV_V4_3 },
+	{ 225, 1, "ACC_SIZE", EXT_CSD_REV_V4_3 },
+	{ 226, 1, "BOOT_SIZE_MULT", EXT_CSD_REV_V4_3 },
+	{ 228, 1, "BOOT_INFO", EXT_CSD_REV_V4_3 },
+	{ 229, 1, "SEC_TRIM_MULT", EXT_CSD_REV_V4_4_1 },
+	{ 230, 1, "SEC_ERASE_MULT", EXT_CSD_REV_V4_4_1 },
+	{ 231, 1, "SEC_FEATURE_SUPPORT", EXT_CSD_REV_V4_4_1 },
+	{ 232, 1, "TRIM_MULT", EXT_CSD_REV_V4_4_1 },
+	{ 234, 1, "MIN_PERF_DDR_R_8_52", EXT_CSD_REV_V4_4_1 },
+	{ 235, 1, "MIN_PERF_DDR_W_8_52", EXT_CSD_REV_V4_4_1 },
+	{ 236, 1, "PWR_CL_200_130", EXT_CSD_REV_V4_5 },
+	{ 237, 1, "PWR_CL_200_195", EXT_CSD_REV_V4_5 },
+	{ 238, 1, "PWR_CL_DDR_52_195", EXT_CSD_REV_V4_4_1 },
+	{ 239, 1, "PWR_CL_DDR_52_360", EXT_CSD_REV_V4_4_1 },
+	{ 240, 1, "CACHE_FLUSH_POLICY", EXT_CSD_REV_V5_1 },
+	{ 241, 1, "INI_TIMEOUT_AP", EXT_CSD_REV_V4_4_1 },
+	{ 242, 4, "CORRECTLY_PRG_SECTORS_NUM", EXT_CSD_REV_V4_4_1 },
+	{ 246, 1, "BKOPS_STATUS", EXT_CSD_REV_V4_4_1 },
+	{ 247, 1, "POWER_OFF_LONG_TIME", EXT_CSD_REV_V4_5 },
+	{ 248, 1, "GENERIC_CMD6_TIME", EXT_CSD_REV_V4_5 },
+	{ 249, 4, "CACHE_SIZE", EXT_CSD_REV_V4_5 },
+	{ 253, 1, "PWR_CL_DDR_200_360", EXT_CSD_REV_V5_0 },
+	{ 254, 8, "FIRMWARE_VERSION", EXT_CSD_REV_V5_0 },
+	{ 262, 2, "DEVICE_VERSION", EXT_CSD_REV_V5_0 },
+	{ 264, 1, "OPTIMAL_TRIM_UNIT_SIZE", EXT_CSD_REV_V5_0 },
+	{ 265, 1, "OPTIMAL_WRITE_SIZE", EXT_CSD_REV_V5_0 },
+	{ 266, 1, "OPTIMAL_READ_SIZE", EXT_CSD_REV_V5_0 },
+	{ 267, 1, "PRE_EOL_INFO", EXT_CSD_REV_V5_0 },
+	{ 268, 1, "DEVICE_LIFE_TIME_EST_TYP_A", EXT_CSD_REV_V5_0 },
+	{ 269, 1, "DEVICE_LIFE_TIME_EST_TYP_B", EXT_CSD_REV_V5_0 },
+	{ 270, 32, "VENDOR_PROPRIETARY_HEALTH_REPORT", EXT_CSD_REV_V5_0 },
+	{ 302, 4, "NUMBER_OF_FW_SECTORS_CORRECTLY_PROGRAMMED", EXT_CSD_REV_V5_0 },
+	{ 307, 1, "CMDQ_DEPTH", EXT_CSD_REV_V5_1 },
+	{ 308, 1, "CMDQ_SUPPORT", EXT_CSD_REV_V5_1 },
+	{ 486, 1, "BARRIER_SUPPORT", EXT_CSD_REV_V5_1 },
+	{ 487, 4, "FFU_ARG", EXT_CSD_REV_V5_0 },
+	{ 491, 1, "OPERATION_CODE_TIMEOUT", EXT_CSD_REV_V5_0 },
+	{ 492, 1, "FFU_FEATURES", EXT_CSD_REV_V5_0 },
+	{ 493, 1, "SUPPORTED_MODES", EXT_CSD_REV_V5_0 },
+	{ 494, 1, "EXT_SUPPORT", EXT_CSD_REV_V4_5 },
+	{ 495, 1, "LARGE_UNIT_SIZE_M1", EXT_CSD_REV_V4_5 },
+	{ 496, 1, "CONTEXT_CAPABILITIES", EXT_CSD_REV_V4_5 },
+	{ 497, 1, "TAG_RES_SIZE", EXT_CSD_REV_V4_5 },
+	{ 498, 1, "TAG_UNIT_SIZE", EXT_CSD_REV_V4_5 },
+	{ 499, 1, "DATA_TAG_SUPPORT", EXT_CSD_REV_V4_5 },
+	{ 500, 1, "MAX_PACKED_WRITES", EXT_CSD_REV_V4_5 },
+	{ 501, 1, "MAX_PACKED_READS", EXT_CSD_REV_V4_5 },
+	{ 502, 1, "BKOPS_SUPPORT", EXT_CSD_REV_V4_4_1 },
+	{ 503, 1, "HPI_FEATURES", EXT_CSD_REV_V4_4_1 },
+	{ 504, 1, "S_CMD_SET", EXT_CSD_REV_V4_0 },
+	{ 505, 1, "EXT_SECURITY_ERR", EXT_CSD_REV_V5_1 },
+};
+
+/* Maps every EXT_CSD offset to its extcsd_fields[] index, -1 if unnamed */
+static void build_extcsd_field_map(int *map)
 {
-	int err;
-	u_int16_t rpmb_type;
-	struct mmc_ioc_multi_cmd *mioc;
-	struct mmc_ioc_cmd *ioc;
+	unsigned int i, j;
+
+	for (i = 0; i < 512; i++)
+		map[i] = -1;
+	for (i = 0; i < ARRAY_SIZE(extcsd_fields); i++)
+		for (j = 0; j < extcsd_fields[i].len; j++)
+			map[extcsd_fields[i].offset + j] = i;
+}
+
+/*
+ * Compares two records a 64 bit word at a time, so that the common case of
+ * mostly identical snapshots costs 64 compares, and flags every differing
+ * byte offset in diff[]. Return: number of differing bytes.
+ */
+static unsigned int extcsd_diff_bytes(const __u64 *a, const __u64 *b,
+				      __u8 *diff)
+{
+	const __u8 *pa, *pb;
+	unsigned int i, j, n = 0;
+
+	memset(diff, 0, 512);
+	for (i = 0; i < 512 / sizeof(__u64); i++) {
+		if (a[i] == b[i])
+			continue;
+		pa = (const __u8 *)&a[i];
+		pb = (const __u8 *)&b[i];
+		for (j = 0; j < sizeof(__u64); j++) {
+			if (pa[j] != pb[j]) {
+				diff[i * sizeof(__u64) + j] = 1;
+				n++;
+			}
+		}
+	}
+
+	return n;
+}
+
+static void print_extcsd_field_value(const __u8 *ext_csd, unsigned int offset,
+				     unsigned int len)
+{
+	int i;
+
+	/* Multi-byte fields are little endian, print them MSB first */
+	printf("0x");
+	for (i = len - 1; i >= 0; i--)
+		printf("%02x", ext_csd[offset + i]);
+}
+
+static void print_extcsd_diff(const __u8 *base, const __u8 *rec,
+			      const __u8 *diff, const int *map)
+{
+	const struct extcsd_field *f;
+	unsigned int i;
+
+	for (i = 0; i < 512; i++) {
+		if (!diff[i])
+			continue;
+
+		if (map[i] < 0) {
+			printf("  [%u] reserved: 0x%02x -> 0x%02x\n",
+			       i, base[i], rec[i]);
+			continue;
+		}
+
+		/* Print a field once, as a whole, then skip its other bytes */
+		f = &extcsd_fields[map[i]];
+		if (f->len > 8) {
+			printf("  [%u] %s[%u]: 0x%02x -> 0x%02x\n", i, f->name,
+			       i - f->offset, base[i], rec[i]);
+			continue;
+		}
+		if (extcsd_rev_str(f->min_rev))
+			printf("  [%u] %s (eMMC %s+): ", f->offset, f->name,
+			       extcsd_rev_str(f->min_rev));
+		else
+			printf("  [%u] %s (rev %u+): ", f->offset, f->name,
+			       f->min_rev);
+		print_extcsd_field_value(base, f->offset, f->len);
+		printf(" -> ");
+		print_extcsd_field_value(rec, f->offset, f->len);
+		printf("\n");
+		i = f->offset + f->len - 1;
+	}
+}
+
+static void print_extcsd_histogram(__u32 (*counts)[256], unsigned int nr,
+				   const int *map)
+{
+	unsigned int i, v, values;
+
+	printf("%u records\n", nr);
+	for (i = 0; i < 512; i++) {
+		values = 0;
+		for (v = 0; v < 256; v++)
+			values += !!counts[i][v];
+		/* Only fields which vary across the cohort are of interest */
+		if (values < 2)
+			continue;
+
+		if (map[i] < 0)
+			printf("[%u] reserved:", i);
+		else if (extcsd_fields[map[i]].len > 1)
+			printf("[%u] %s[%u]:", i, extcsd_fields[map[i]].name,
+			       i - extcsd_fields[map[i]].offset);
+		else
+			printf("[%u] %s:", i, extcsd_fields[map[i]].name);
+
+		for (v = 0; v < 256; v++)
+			if (counts[i][v])
+				printf(" 0x%02x=%u", v, counts[i][v]);
+		printf("\n");
+	}
+}
+
+/*
+ * Records come from snapshot files written by 'extcsd dump', stdin, or are
+ * read live when the argument is an MMC block device.
+ */
+static FILE *open_extcsd_source(const char *path, __u8 *ext_csd, int *live)
+{
+	struct stat st;
+	int fd;
+
+	*live = 0;
+	if (strcmp(path, "-") && !stat(path, &st) && S_ISBLK(st.st_mode)) {
+		fd = open(path, O_RDWR);
+		if (fd < 0) {
+			perror(path);
+			exit(1);
+		}
+		if (read_extcsd(fd, ext_csd)) {
+			fprintf(stderr, "Could not read EXT_CSD from %s\n", path);
+			exit(1);
+		}
+		close(fd);
+		*live = 1;
+		return NULL;
+	}
+
+	return open_extcsd_records(path);
+}
+
+int do_diff_extcsd(int nargs, char **argv)
+{
+	static __u32 counts[512][256];
+	__u64 base[512 / sizeof(__u64)], rec[512 / sizeof(__u64)];
+	__u8 *ext_csd = (__u8 *)rec, diff[512];
+	int map[512], histogram = 0, differ = 0, live, r, opt, i;
+	unsigned int nr = 0, v;
+	FILE *in;
+
+	while ((opt = getopt(nargs, argv, "H")) != -1) {
+		switch (opt) {
+		case 'H':
+			histogram = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: mmc extcsd diff [-H] <file|device|->...\n");
+			exit(1);
+		}
+	}
+
+	if (nargs - optind < 1) {
+		fprintf(stderr, "Usage: mmc extcsd diff [-H] <file|device|->...\n");
+		exit(1);
+	}
+
+	build_extcsd_field_map(map);
+
+	/* Single pass: every record is compared to the first, or counted */
+	for (i = optind; i < nargs; i++) {
+		in = open_extcsd_source(argv[i], ext_csd, &live);
+		r = live;
+		if (!live)
+			r = read_extcsd_record(in, argv[i], ext_csd);
+
+		while (r > 0) {
+			nr++;
+			if (histogram) {
+				for (v = 0; v < 512; v++)
+					counts[v][ext_csd[v]]++;
+			} else if (nr == 1) {
+				memcpy(base, rec, sizeof(base));
+			} else if (extcsd_diff_bytes(base, rec, diff)) {
+				printf("%s: record %u differs from record 1\n",
+				       argv[i], nr);
+				print_extcsd_diff((__u8 *)base, ext_csd, diff,
+						  map);
+				differ = 1;
+			}
+
+			if (live)
+				break;
+			r = read_extcsd_record(in, argv[i], ext_csd);
+		}
+		if (r < 0)
+			exit(1);
+		if (in && in != stdin)
+			fclose(in);
+	}
+
+	if (histogram)
+		print_extcsd_histogram(counts, nr, map);
+	else if (nr < 2) {
+		fprintf(stderr, "Need at least two EXT_CSD records to compare\n");
+		exit(1);
+	}
+
+	return differ;
+}
+
+int do_sanitize(int nargs, char **argv)
+{
+	int fd, ret;
+	char *device;
+	unsigned int timeout = 0;
+	struct mmc_ioc_cmd idata = {};
+	bool interruptible;
+	__u8 ext_csd[512];
+
+	if (nargs != 2 && nargs != 3) {
+		fprintf(stderr, "Usage: mmc sanitize </path/to/mmcblkX> [timeout_in_ms]\n");
+		exit(1);
+	}
+
+	if (nargs == 3)
+		timeout = strtol(argv[2], NULL, 10);
+
+	device = argv[1];
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	fill_switch_cmd(&idata, EXT_CSD_SANITIZE_START, 1);
+	idata.cmd_timeout_ms = timeout;
+	/*
+	 * With a timeout, poll for completion ourselves, so it can be
+	 * interrupted with HPI. Otherwise the host waits for busy.
+	 */
+	interruptible = timeout && hpi_prepare(fd, ext_csd);
+	if (interruptible)
+		idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+
+	ret = mmc_ioctl(fd, MMC_IOC_CMD, &idata);
+	if (ret) {
+		perror("ioctl");
+		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
+			1, EXT_CSD_SANITIZE_START, device);
+		exit(1);
+	}
+
+	if (interruptible)
+		ret = wait_busy_or_hpi(fd, ext_csd, 10000, timeout);
+	if (ret) {
+		fprintf(stderr, "Sanitize of %s did not complete\n", device);
+		exit(1);
+	}
+
+	close(fd);
+	return ret;
+
+}
+
+#define DO_IO(func, fd, buf, nbyte)					\
+	({												\
+		ssize_t ret = 0, r;							\
+		do {										\
+			r = func(fd, buf + ret, nbyte - ret);	\
+			if (r < 0 && errno != EINTR) {			\
+				ret = -1;							\
+				break;								\
+			}										\
+			else if (r > 0)							\
+				ret += r;							\
+		} while (r != 0 && (size_t)ret < nbyte);	\
+													\
+		ret;										\
+	})
+
+#define RPMB_MULTI_CMD_MAX_CMDS 3
+
+enum rpmb_op_type {
+	MMC_RPMB_WRITE_KEY = 0x01,
+	MMC_RPMB_READ_CNT  = 0x02,
+	MMC_RPMB_WRITE     = 0x03,
+	MMC_RPMB_READ      = 0x04,
+	MMC_RPMB_CONF_WRITE = 0x06,
+	MMC_RPMB_CONF_READ = 0x07,
+
+	/* For internal usage only, do not use it directly */
+	MMC_RPMB_READ_RESP = 0x05
+};
+
+struct rpmb_frame {
+	u_int8_t  stuff[196];           /* Bytes 511 - 316 */
+	u_int8_t  key_mac[32];          /* Bytes 315 - 284 */
+	u_int8_t  data[256];            /* Bytes 283 - 28 */
+	u_int8_t  nonce[16];            /* Bytes 27 - 12 */
+	u_int32_t write_counter;        /* Bytes 11 - 8 */
+	u_int16_t addr;                 /* Bytes 7 - 6 */
+	u_int16_t block_count;          /* Bytes 5 - 4 */
+	u_int16_t result;               /* Bytes 3 - 2 */
+	u_int16_t req_resp;             /* Bytes 1 - 0 */
+} __attribute__((packed));
+
+static inline void set_single_cmd(struct mmc_ioc_cmd *ioc, __u32 opcode,
+				  int write_flag, unsigned int blocks,
+				  __u32 arg)
+{
+	ioc->opcode = opcode;
+	ioc->write_flag = write_flag;
+	ioc->arg = arg;
+	ioc->blksz = 512;
+	ioc->blocks = blocks;
+	ioc->flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+}
+
+static int rpmb_get_key(const char key_file_name[], struct rpmb_frame *frame_in,
+			unsigned char key_out[32], bool encrypt)
+{
+	int ret, key_fd;
+	unsigned char key[32] = {};
+
+	if (strcmp(key_file_name, "-") == 0) {
+		key_fd = STDIN_FILENO;
+	} else {
+		key_fd = open(key_file_name, O_RDONLY);
+		if (key_fd < 0) {
+			perror("can't open key file");
+			return EXIT_FAILURE;
+		}
+	}
+
+	ret = DO_IO(read, key_fd, key, sizeof(key));
+	if (ret < 0) {
+		perror("read the key");
+		goto out;
+	} else if (ret != sizeof(key)) {
+		printf("Auth key must be %lu bytes length, but we read only %d, exit\n",
+		       (unsigned long)sizeof(key), ret);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (key_out)
+		memcpy(key_out, key, 32);
+
+	if (encrypt) {
+		/* Calculate HMAC SHA256 */
+		hmac_sha256(key, sizeof(key), frame_in->data,
+			    sizeof(struct rpmb_frame) - offsetof(struct rpmb_frame, data),
+			    frame_in->key_mac, sizeof(frame_in->key_mac));
+	}
+
+	ret = 0;
+
+out:
+	if (key_fd != STDIN_FILENO)
+		close(key_fd);
+
+	return ret;
+}
+
+/* Performs RPMB operation.
+ *
+ * @fd: RPMB device on which we should perform ioctl command
+ * @frame_in: input RPMB frames, should be properly inited
+ * @in_cnt: count of input frames. Used only for multiple blocks writing,
+ *          in the other cases -EINVAL will be returned.
+ * @frame_out: output (result) RPMB frame. Caller is responsible for checking
+ *             result and req_resp for output frame.
+ * @out_cnt: count of outer frames. Used only for multiple blocks reading,
+ *           in the other cases -EINVAL will be returned.
+ */
+static int do_rpmb_op_frames(int fd, const struct rpmb_frame *frame_in,
+			     unsigned int in_cnt, struct rpmb_frame *frame_out,
+			     unsigned int out_cnt)
+{
+	int err;
+	u_int16_t rpmb_type;
+	struct mmc_ioc_multi_cmd *mioc;
+	struct mmc_ioc_cmd *ioc;
 	struct rpmb_frame frame_status;
 
 	memset(&frame_status, 0, sizeof(frame_status));
 
-	if (!frame_in || !frame_out || !out_cnt)
+	if (!frame_in || !frame_out || !in_cnt || !out_cnt)
 		return -EINVAL;
 
 	/* prepare arguments for MMC_IOC_MULTI_CMD ioctl */
@@ -2213,7 +4092,8 @@ static int do_rpmb_op(int fd, const struct rpmb_frame *frame_in,
 	case MMC_RPMB_WRITE:
 	case MMC_RPMB_WRITE_KEY:
 	case MMC_RPMB_CONF_WRITE:
-		if (out_cnt != 1) {
+		if (out_cnt != 1 ||
+		    (in_cnt != 1 && rpmb_type != MMC_RPMB_WRITE)) {
 			err = -EINVAL;
 			goto out;
 		}
@@ -2222,7 +4102,8 @@ static int do_rpmb_op(int fd, const struct rpmb_frame *frame_in,
 
 		/* Write request */
 		ioc = &mioc->cmds[0];
-		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, (1 << 31) | 1, 1, 0);
+		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, (1 << 31) | 1,
+			       in_cnt, 0);
 		mmc_ioc_cmd_set_data((*ioc), frame_in);
 
 		/* Result request */
@@ -2246,6 +4127,10 @@ static int do_rpmb_op(int fd, const struct rpmb_frame *frame_in,
 		/* fall through */
 
 	case MMC_RPMB_READ:
+		if (in_cnt != 1) {
+			err = -EINVAL;
+			goto out;
+		}
 		mioc->num_of_cmds = 2;
 
 		/* Read request */
@@ -2264,13 +4149,19 @@ static int do_rpmb_op(int fd, const struct rpmb_frame *frame_in,
 		goto out;
 	}
 
-	err = ioctl(fd, MMC_IOC_MULTI_CMD, mioc);
+	err = mmc_ioctl(fd, MMC_IOC_MULTI_CMD, mioc);
 
 out:
 	free(mioc);
 	return err;
 }
 
+static int do_rpmb_op(int fd, const struct rpmb_frame *frame_in,
+		      struct rpmb_frame *frame_out, unsigned int out_cnt)
+{
+	return do_rpmb_op_frames(fd, frame_in, 1, frame_out, out_cnt);
+}
+
 int do_rpmb_write_key(int nargs, char **argv)
 {
 	int ret, dev_fd;
@@ -2700,22 +4591,187 @@ int do_rpmb_sec_wp_en_read(int nargs, char **argv)
 	return rpmb_auth_read(nargs, argv, usage);
 }
 
-int do_rpmb_write_block(int nargs, char **argv)
+/* mmcblkXrpmb has no sysfs node of its own; its EXT_CSD and CID are mmcblkX's */
+static int rpmb_parent_device(const char *rpmb, char *parent, size_t size)
 {
-	int ret, dev_fd, data_fd;
-	uint16_t addr;
-	unsigned int cnt;
-	struct rpmb_frame frame_in = {
-		.req_resp    = htobe16(MMC_RPMB_WRITE),
-		.block_count = htobe16(1)
-	}, frame_out = {};
+	size_t len = strlen(rpmb);
 
-	if (nargs != 5) {
-		fprintf(stderr, "Usage: mmc rpmb write-block </path/to/mmcblkXrpmb> <address> </path/to/input_file> </path/to/key>\n");
-		exit(1);
+	if (len < 4 || len >= size || strcmp(rpmb + len - 4, "rpmb")) {
+		fprintf(stderr, "%s is not an RPMB device node\n", rpmb);
+		return -EINVAL;
 	}
+	memcpy(parent, rpmb, len - 4);
+	parent[len - 4] = '\0';
 
-	dev_fd = open(argv[1], O_RDWR);
+	return 0;
+}
+
+/*
+ * The write counter journal is a text file of "<epoch> <counter>" lines,
+ * appended to whenever we learn the counter. It defaults to the state
+ * directory, named by the CID of the device.
+ */
+static int rpmb_journal_path(const char *rpmb, char *path, size_t len)
+{
+	char parent[PATH_MAX];
+
+	if (rpmb_parent_device(rpmb, parent, sizeof(parent)))
+		return -EINVAL;
+	get_state_path(parent, "rpmb", path, len);
+
+	return 0;
+}
+
+static void rpmb_journal_append(const char *path, unsigned int counter)
+{
+	FILE *f;
+	int ret = -1;
+
+	make_state_dir(path);
+	f = fopen(path, "a");
+	if (f) {
+		ret = fprintf(f, "%lld %u\n", (long long)time(NULL), counter);
+		if (fclose(f))
+			ret = -1;
+	}
+	if (ret < 0)
+		fprintf(stderr, "Could not record the write counter in %s: %s\n",
+			path, strerror(errno));
+}
+
+/* For commands without a -j option: record in the default journal */
+static void rpmb_journal_record(const char *rpmb, unsigned int counter)
+{
+	char path[PATH_MAX];
+
+	if (!rpmb_journal_path(rpmb, path, sizeof(path)))
+		rpmb_journal_append(path, counter);
+}
+
+/*
+ * Forecasts exhaustion of the write counter from the journal at @path.
+ * The counter never goes back, so an entry above a later one means the
+ * journal was carried over from another device (or key programming); the
+ * forecast only uses what follows it.
+ */
+static void rpmb_journal_forecast(const char *path, unsigned int counter)
+{
+	long long t, first_t = 0, last_t = 0;
+	unsigned int c, first_c = 0, last_c = 0, entries = 0;
+	double rate, days;
+	char line[64], date[32];
+	time_t when;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		printf("No journal in %s yet\n", path);
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lld %u", &t, &c) != 2)
+			continue;
+		if (!entries || c < last_c) {
+			first_t = t;
+			first_c = c;
+			entries = 0;
+		}
+		last_t = t;
+		last_c = c;
+		entries++;
+	}
+	fclose(f);
+
+	when = first_t;
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&when));
+	printf("Journal: %s, %u entries since %s\n", path, entries, date);
+
+	if (entries < 2 || last_t - first_t < 60) {
+		printf("Not enough history for a forecast yet\n");
+		return;
+	}
+
+	rate = (double)(last_c - first_c) * 86400 / (last_t - first_t);
+	printf("Burn rate: %.1f writes/day\n", rate);
+	if (rate <= 0) {
+		printf("Projected exhaustion: never at this rate\n");
+		return;
+	}
+
+	days = (0xffffffffU - counter) / rate;
+	if (days > 365.0 * 1000) {
+		printf("Projected exhaustion: more than 1000 years away\n");
+		return;
+	}
+	when = last_t + (time_t)(days * 86400);
+	strftime(date, sizeof(date), "%Y-%m-%d", localtime(&when));
+	printf("Projected exhaustion: %s (%.0f days)\n", date, days);
+}
+
+int do_rpmb_counter(int nargs, char **argv)
+{
+	char path[PATH_MAX] = "";
+	unsigned int cnt;
+	int c, ret, dev_fd;
+
+	while ((c = getopt(nargs, argv, "j:")) != -1) {
+		switch (c) {
+		case 'j':
+			snprintf(path, sizeof(path), "%s", optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind != 1)
+		goto usage;
+
+	if (!path[0] && rpmb_journal_path(argv[optind], path, sizeof(path)))
+		exit(1);
+
+	dev_fd = open(argv[optind], O_RDWR);
+	if (dev_fd < 0) {
+		perror("device open");
+		exit(1);
+	}
+
+	ret = rpmb_read_counter(dev_fd, &cnt);
+	if (ret != 0) {
+		printf("RPMB read counter operation failed, retcode 0x%04x\n",
+		       ret);
+		exit(1);
+	}
+	close(dev_fd);
+
+	rpmb_journal_append(path, cnt);
+
+	printf("Counter value: 0x%08x\n", cnt);
+	printf("Writes left: %u\n", 0xffffffffU - cnt);
+	rpmb_journal_forecast(path, cnt);
+
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc rpmb counter [-j journal] <rpmb device>\n");
+	exit(1);
+}
+
+int do_rpmb_write_block(int nargs, char **argv)
+{
+	int ret, dev_fd, data_fd;
+	uint16_t addr;
+	unsigned int cnt;
+	struct rpmb_frame frame_in = {
+		.req_resp    = htobe16(MMC_RPMB_WRITE),
+		.block_count = htobe16(1)
+	}, frame_out = {};
+
+	if (nargs != 5) {
+		fprintf(stderr, "Usage: mmc rpmb write-block </path/to/mmcblkXrpmb> <address> </path/to/input_file> </path/to/key>\n");
+		exit(1);
+	}
+
+	dev_fd = open(argv[1], O_RDWR);
 	if (dev_fd < 0) {
 		perror("device open");
 		exit(1);
@@ -2777,6 +4833,7 @@ int do_rpmb_write_block(int nargs, char **argv)
 			   be16toh(frame_out.result));
 		exit(1);
 	}
+	rpmb_journal_record(argv[1], be32toh(frame_out.write_counter));
 
 	close(dev_fd);
 	if (data_fd != STDIN_FILENO)
@@ -2785,223 +4842,5394 @@ int do_rpmb_write_block(int nargs, char **argv)
 	return ret;
 }
 
-static int do_cache_ctrl(int value, int nargs, char **argv)
+#define RPMB_BLOCK_SIZE		256	/* data bytes per RPMB frame */
+#define RPMB_READ_CHUNK		64	/* frames per streamed read */
+
+static int read_rpmb_parent_extcsd(const char *rpmb, __u8 *ext_csd)
 {
-	__u8 ext_csd[512];
+	char parent[PATH_MAX];
 	int fd, ret;
-	char *device;
 
-	if (nargs != 2) {
-	       fprintf(stderr, "Usage: mmc cache enable </path/to/mmcblkX>\n");
-	       exit(1);
+	if (rpmb_parent_device(rpmb, parent, sizeof(parent)))
+		return -EINVAL;
+
+	fd = open(parent, O_RDWR);
+	if (fd < 0) {
+		perror(parent);
+		return -errno;
+	}
+	ret = read_extcsd(fd, ext_csd);
+	if (ret)
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", parent);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * An authenticated write takes 1 or 2 frames, or 32 once EN_RPMB_REL_WR
+ * allows 8KB writes, and burns one write counter increment either way.
+ */
+static unsigned int rpmb_max_write_frames(__u8 *ext_csd)
+{
+	if (ext_csd[EXT_CSD_REV] >= EXT_CSD_REV_V5_1 &&
+	    ext_csd[EXT_CSD_WR_REL_PARAM] & EN_RPMB_REL_WR)
+		return 32;
+
+	return 2;
+}
+
+static void rpmb_fill_nonce(struct rpmb_frame *frame)
+{
+	int fd = open("/dev/urandom", O_RDONLY);
+
+	if (fd < 0 || DO_IO(read, fd, frame->nonce, sizeof(frame->nonce)) !=
+		      sizeof(frame->nonce))
+		memset(frame->nonce, 0, sizeof(frame->nonce));
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * Reads @blocks frames from @addr into @data in chunks, checking the MAC of
+ * every chunk against @key.
+ */
+static int rpmb_read_data(int fd, const unsigned char *key, __u16 addr,
+			  unsigned int blocks, __u8 *data)
+{
+	struct rpmb_frame frame_in = {
+		.req_resp = htobe16(MMC_RPMB_READ),
+	}, *frames;
+	unsigned char mac[32];
+	hmac_sha256_ctx ctx;
+	unsigned int n, i;
+	int ret = 0;
+
+	frames = calloc(RPMB_READ_CHUNK, sizeof(*frames));
+	if (!frames)
+		return -ENOMEM;
+
+	while (blocks) {
+		n = blocks < RPMB_READ_CHUNK ? blocks : RPMB_READ_CHUNK;
+		frame_in.addr = htobe16(addr);
+		rpmb_fill_nonce(&frame_in);
+
+		ret = do_rpmb_op(fd, &frame_in, frames, n);
+		if (ret) {
+			perror("RPMB ioctl failed");
+			break;
+		}
+		if (frames[n - 1].result) {
+			fprintf(stderr, "RPMB read at 0x%04x failed, retcode 0x%04x\n",
+				addr, be16toh(frames[n - 1].result));
+			ret = -EIO;
+			break;
+		}
+
+		hmac_sha256_init(&ctx, key, 32);
+		for (i = 0; i < n; i++)
+			hmac_sha256_update(&ctx, frames[i].data,
+					   sizeof(frames[i]) -
+					   offsetof(struct rpmb_frame, data));
+		hmac_sha256_final(&ctx, mac, sizeof(mac));
+		if (memcmp(mac, frames[n - 1].key_mac, sizeof(mac)) ||
+		    memcmp(frame_in.nonce, frames[n - 1].nonce,
+			   sizeof(frame_in.nonce))) {
+			fprintf(stderr, "RPMB MAC mismatch at 0x%04x\n", addr);
+			ret = -EBADMSG;
+			break;
+		}
+
+		for (i = 0; i < n; i++)
+			memcpy(data + i * RPMB_BLOCK_SIZE, frames[i].data,
+			       RPMB_BLOCK_SIZE);
+		data += n * RPMB_BLOCK_SIZE;
+		addr += n;
+		blocks -= n;
+	}
+
+	free(frames);
+	return ret;
+}
+
+/*
+ * Writes @blocks frames of @data to @addr, as few authenticated writes as
+ * @max_frames allows. @counter is the current write counter, and is kept
+ * up to date.
+ *
+ * Return: the number of authenticated writes issued, or a negative error.
+ */
+static int rpmb_write_data(int fd, const unsigned char *key,
+			   unsigned int max_frames, unsigned int *counter,
+			   __u16 addr, unsigned int blocks, const __u8 *data)
+{
+	struct rpmb_frame *frames, frame_out;
+	hmac_sha256_ctx ctx;
+	unsigned int n, i;
+	int ret = 0, writes = 0;
+
+	frames = calloc(max_frames, sizeof(*frames));
+	if (!frames)
+		return -ENOMEM;
+
+	while (blocks) {
+		/* RPMB writes are 1, 2 or, with EN_RPMB_REL_WR, 32 frames */
+		if (blocks >= 32 && max_frames >= 32)
+			n = 32;
+		else
+			n = blocks >= 2 && max_frames >= 2 ? 2 : 1;
+
+		memset(frames, 0, n * sizeof(*frames));
+		for (i = 0; i < n; i++) {
+			memcpy(frames[i].data, data + i * RPMB_BLOCK_SIZE,
+			       RPMB_BLOCK_SIZE);
+			frames[i].write_counter = htobe32(*counter);
+			frames[i].addr = htobe16(addr);
+			frames[i].block_count = htobe16(n);
+			frames[i].req_resp = htobe16(MMC_RPMB_WRITE);
+		}
+
+		/* the MAC covers all frames and goes into the last one */
+		hmac_sha256_init(&ctx, key, 32);
+		for (i = 0; i < n; i++)
+			hmac_sha256_update(&ctx, frames[i].data,
+					   sizeof(frames[i]) -
+					   offsetof(struct rpmb_frame, data));
+		hmac_sha256_final(&ctx, frames[n - 1].key_mac,
+				  sizeof(frames[n - 1].key_mac));
+
+		memset(&frame_out, 0, sizeof(frame_out));
+		ret = do_rpmb_op_frames(fd, frames, n, &frame_out, 1);
+		if (ret) {
+			perror("RPMB ioctl failed");
+			break;
+		}
+		if (frame_out.result) {
+			fprintf(stderr, "RPMB write at 0x%04x failed, retcode 0x%04x\n",
+				addr, be16toh(frame_out.result));
+			ret = -EIO;
+			break;
+		}
+
+		*counter = be32toh(frame_out.write_counter);
+		writes++;
+		data += n * RPMB_BLOCK_SIZE;
+		addr += n;
+		blocks -= n;
+	}
+
+	free(frames);
+	return ret ? ret : writes;
+}
+
+/*
+ * RPMB key/value store
+ *
+ * The store takes a region of RPMB blocks. Its first block is a superblock,
+ * the rest is split in two halves of which one is active. The active half
+ * holds a log of put and delete records, which is appended to in place; the
+ * last partial block is rewritten after the new blocks, so an append becomes
+ * visible all at once. When the log
+ * runs out of space, the live records are compacted into the other half and
+ * the superblock switched over, in one more authenticated write.
+ *
+ * Records carry the generation of the superblock that wrote them, so stale
+ * records left over in a half from earlier generations end the log. The
+ * generation only ever grows, also across formats. A CRC over each record
+ * ends the log at a record an interrupted append left incomplete.
+ */
+#define RPMB_KV_MAGIC		"MMCKVST2"
+#define RPMB_KV_PUT		1
+#define RPMB_KV_DEL		2
+#define RPMB_KV_MAX_NAME	255
+
+struct rpmb_kv_super {
+	char magic[8];
+	__u32 gen;		/* little endian */
+	__u16 blocks;		/* little endian, superblock included */
+	__u8 active;
+	__u8 reserved[RPMB_BLOCK_SIZE - 15];
+} __attribute__((packed));
+
+struct rpmb_kv_rec {
+	__u8 type;
+	__u8 name_len;
+	__u16 value_len;	/* little endian */
+	__u32 gen;		/* little endian */
+	__u32 crc;		/* little endian, of the record with crc 0 */
+} __attribute__((packed));
+
+/* CRC-32 (IEEE 802.3), bitwise: records are small and few */
+static __u32 rpmb_kv_crc32(__u32 crc, const __u8 *buf, size_t len)
+{
+	int i;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+/* CRC of the @len bytes long record at @buf, as if its crc field was 0 */
+static __u32 rpmb_kv_rec_crc(const __u8 *buf, size_t len)
+{
+	static const __u8 zero[4];
+	size_t crc_off = offsetof(struct rpmb_kv_rec, crc);
+	__u32 crc;
+
+	crc = rpmb_kv_crc32(0, buf, crc_off);
+	crc = rpmb_kv_crc32(crc, zero, sizeof(zero));
+	return rpmb_kv_crc32(crc, buf + crc_off + sizeof(zero),
+			     len - crc_off - sizeof(zero));
+}
+
+struct rpmb_kv_entry {
+	char *name;
+	__u8 *value;
+	unsigned int len;
+};
+
+struct rpmb_kv {
+	const char *device;
+	int fd;
+	unsigned char key[32];
+	unsigned int max_frames;
+	unsigned int counter;
+	unsigned int writes;
+	__u16 start;
+	struct rpmb_kv_super sb;
+	unsigned int half_blocks;
+	__u8 *log;		/* the active half, half_blocks frames */
+	size_t tail;		/* bytes of log in use */
+	struct rpmb_kv_entry *entries;
+	unsigned int n;
+};
+
+static __u16 rpmb_kv_half_addr(struct rpmb_kv *kv, int half)
+{
+	return kv->start + 1 + half * kv->half_blocks;
+}
+
+static struct rpmb_kv_entry *rpmb_kv_find(struct rpmb_kv *kv,
+					  const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < kv->n; i++)
+		if (!strcmp(kv->entries[i].name, name))
+			return &kv->entries[i];
+
+	return NULL;
+}
+
+static void rpmb_kv_apply(struct rpmb_kv *kv, int type, const char *name,
+			  const __u8 *value, unsigned int len)
+{
+	struct rpmb_kv_entry *e = rpmb_kv_find(kv, name), *tmp;
+
+	if (type == RPMB_KV_DEL) {
+		if (e) {
+			free(e->name);
+			free(e->value);
+			*e = kv->entries[--kv->n];
+		}
+		return;
+	}
+
+	if (!e) {
+		tmp = realloc(kv->entries, (kv->n + 1) * sizeof(*tmp));
+		if (!tmp) {
+			perror("realloc");
+			exit(1);
+		}
+		kv->entries = tmp;
+		e = &kv->entries[kv->n++];
+		e->name = strdup(name);
+	} else {
+		free(e->value);
+	}
+
+	e->value = malloc(len ? len : 1);
+	if (!e->name || !e->value) {
+		perror("malloc");
+		exit(1);
+	}
+	memcpy(e->value, value, len);
+	e->len = len;
+}
+
+/* Appends one record to @buf, which must have room for it */
+static size_t rpmb_kv_encode(__u8 *buf, int type, __u32 gen, const char *name,
+			     const __u8 *value, unsigned int len)
+{
+	struct rpmb_kv_rec rec = {
+		.type = type,
+		.name_len = strlen(name),
+		.value_len = htole16(len),
+		.gen = htole32(gen),
+	};
+
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), name, rec.name_len);
+	if (len)
+		memcpy(buf + sizeof(rec) + rec.name_len, value, len);
+	rec.crc = htole32(rpmb_kv_rec_crc(buf, sizeof(rec) + rec.name_len +
+					  len));
+	memcpy(buf + offsetof(struct rpmb_kv_rec, crc), &rec.crc,
+	       sizeof(rec.crc));
+
+	return sizeof(rec) + rec.name_len + len;
+}
+
+/*
+ * Rebuilds the index from the log, stopping at the first foreign or
+ * incomplete record
+ */
+static void rpmb_kv_parse(struct rpmb_kv *kv)
+{
+	size_t size = (size_t)kv->half_blocks * RPMB_BLOCK_SIZE, off = 0;
+	char name[RPMB_KV_MAX_NAME + 1];
+	struct rpmb_kv_rec rec;
+	size_t len;
+
+	while (off + sizeof(rec) <= size) {
+		memcpy(&rec, kv->log + off, sizeof(rec));
+		if ((rec.type != RPMB_KV_PUT && rec.type != RPMB_KV_DEL) ||
+		    !rec.name_len || le32toh(rec.gen) != le32toh(kv->sb.gen))
+			break;
+		len = sizeof(rec) + rec.name_len + le16toh(rec.value_len);
+		if (off + len > size)
+			break;
+		if (le32toh(rec.crc) != rpmb_kv_rec_crc(kv->log + off, len)) {
+			fprintf(stderr, "Record at offset %zu of the log is incomplete, ignoring it and what follows\n",
+				off);
+			break;
+		}
+
+		memcpy(name, kv->log + off + sizeof(rec), rec.name_len);
+		name[rec.name_len] = '\0';
+		rpmb_kv_apply(kv, rec.type, name,
+			      kv->log + off + sizeof(rec) + rec.name_len,
+			      le16toh(rec.value_len));
+		off += len;
+	}
+
+	/* whatever follows the log is garbage, it gets overwritten */
+	kv->tail = off;
+	memset(kv->log + off, 0, size - off);
+}
+
+static int rpmb_kv_read_log(struct rpmb_kv *kv)
+{
+	unsigned int done = 0, n;
+	__u16 addr = rpmb_kv_half_addr(kv, kv->sb.active);
+	struct rpmb_kv_rec rec;
+	size_t off = 0, len;
+	int ret;
+
+	/*
+	 * One streamed scan: read ahead in chunks, and stop as soon as a chunk
+	 * holds the end of the log.
+	 */
+	while (done < kv->half_blocks) {
+		n = kv->half_blocks - done;
+		if (n > RPMB_READ_CHUNK)
+			n = RPMB_READ_CHUNK;
+		ret = rpmb_read_data(kv->fd, kv->key, addr + done, n,
+				     kv->log + done * RPMB_BLOCK_SIZE);
+		if (ret)
+			return ret;
+		done += n;
+
+		while (off + sizeof(rec) <= done * RPMB_BLOCK_SIZE) {
+			memcpy(&rec, kv->log + off, sizeof(rec));
+			if ((rec.type != RPMB_KV_PUT &&
+			     rec.type != RPMB_KV_DEL) ||
+			    le32toh(rec.gen) != le32toh(kv->sb.gen))
+				goto parse;
+			len = sizeof(rec) + rec.name_len +
+			      le16toh(rec.value_len);
+			if (off + len > done * RPMB_BLOCK_SIZE)
+				break;
+			off += len;
+		}
+	}
+
+parse:
+	/* don't let unread blocks look like records */
+	memset(kv->log + done * RPMB_BLOCK_SIZE, 0,
+	       (kv->half_blocks - done) * RPMB_BLOCK_SIZE);
+	rpmb_kv_parse(kv);
+
+	return 0;
+}
+
+static void rpmb_kv_open(struct rpmb_kv *kv, const char *device,
+			 const char *key_file, __u16 start, bool need_super)
+{
+	struct rpmb_frame dummy = {};
+	__u8 ext_csd[512];
+	int ret;
+
+	memset(kv, 0, sizeof(*kv));
+	kv->device = device;
+	kv->start = start;
+
+	if (read_rpmb_parent_extcsd(device, ext_csd))
+		exit(1);
+	kv->max_frames = rpmb_max_write_frames(ext_csd);
+
+	kv->fd = open(device, O_RDWR);
+	if (kv->fd < 0) {
+		perror("device open");
+		exit(1);
+	}
+
+	if (rpmb_get_key(key_file, &dummy, kv->key, false))
+		exit(1);
+
+	ret = rpmb_read_counter(kv->fd, &kv->counter);
+	if (ret) {
+		printf("RPMB read counter operation failed, retcode 0x%04x\n",
+		       ret);
+		exit(1);
+	}
+
+	if (!need_super)
+		return;
+
+	if (rpmb_read_data(kv->fd, kv->key, start, 1, (__u8 *)&kv->sb))
+		exit(1);
+	if (memcmp(kv->sb.magic, RPMB_KV_MAGIC, sizeof(kv->sb.magic))) {
+		fprintf(stderr, "No key/value store at RPMB block %u, see 'rpmb kv format'\n",
+			start);
+		exit(1);
+	}
+
+	kv->half_blocks = (le16toh(kv->sb.blocks) - 1) / 2;
+	kv->log = calloc(kv->half_blocks, RPMB_BLOCK_SIZE);
+	if (!kv->log) {
+		perror("calloc");
+		exit(1);
+	}
+	if (rpmb_kv_read_log(kv))
+		exit(1);
+}
+
+static void rpmb_kv_close(struct rpmb_kv *kv)
+{
+	unsigned int i;
+
+	for (i = 0; i < kv->n; i++) {
+		free(kv->entries[i].name);
+		free(kv->entries[i].value);
+	}
+	free(kv->entries);
+	free(kv->log);
+	close(kv->fd);
+
+	if (kv->writes)
+		rpmb_journal_record(kv->device, kv->counter);
+}
+
+static int rpmb_kv_write(struct rpmb_kv *kv, __u16 addr, unsigned int blocks,
+			 const __u8 *data)
+{
+	int ret;
+
+	ret = rpmb_write_data(kv->fd, kv->key, kv->max_frames, &kv->counter,
+			      addr, blocks, data);
+	if (ret < 0)
+		return ret;
+	kv->writes += ret;
+
+	return 0;
+}
+
+static int rpmb_kv_write_super(struct rpmb_kv *kv)
+{
+	return rpmb_kv_write(kv, kv->start, 1, (__u8 *)&kv->sb);
+}
+
+/* Writes the live records to the inactive half and switches over to it */
+static int rpmb_kv_compact(struct rpmb_kv *kv)
+{
+	size_t size = (size_t)kv->half_blocks * RPMB_BLOCK_SIZE, off = 0;
+	__u32 gen = le32toh(kv->sb.gen) + 1;
+	unsigned int i, blocks;
+	__u8 *log;
+	int ret;
+
+	log = calloc(kv->half_blocks, RPMB_BLOCK_SIZE);
+	if (!log)
+		return -ENOMEM;
+
+	for (i = 0; i < kv->n; i++) {
+		if (off + sizeof(struct rpmb_kv_rec) + strlen(kv->entries[i].name) +
+		    kv->entries[i].len > size) {
+			fprintf(stderr, "The live records don't fit the store\n");
+			free(log);
+			return -ENOSPC;
+		}
+		off += rpmb_kv_encode(log + off, RPMB_KV_PUT, gen,
+				      kv->entries[i].name,
+				      kv->entries[i].value,
+				      kv->entries[i].len);
+	}
+
+	blocks = (off + RPMB_BLOCK_SIZE - 1) / RPMB_BLOCK_SIZE;
+	ret = rpmb_kv_write(kv, rpmb_kv_half_addr(kv, !kv->sb.active), blocks,
+			    log);
+	if (ret) {
+		free(log);
+		return ret;
+	}
+
+	kv->sb.active = !kv->sb.active;
+	kv->sb.gen = htole32(gen);
+	ret = rpmb_kv_write_super(kv);
+
+	free(kv->log);
+	kv->log = log;
+	kv->tail = off;
+
+	return ret;
+}
+
+/*
+ * Commits the records in @buf, which are already applied to the index, in
+ * as few authenticated writes as possible: appended to the log when they
+ * fit, compacted together with everything else when they don't.
+ */
+static int rpmb_kv_commit(struct rpmb_kv *kv, const __u8 *buf, size_t len)
+{
+	size_t size = (size_t)kv->half_blocks * RPMB_BLOCK_SIZE;
+	__u16 addr = rpmb_kv_half_addr(kv, kv->sb.active);
+	unsigned int first, last;
+	int ret;
+
+	if (kv->tail + len > size)
+		return rpmb_kv_compact(kv);
+
+	if (!len)
+		return 0;
+
+	memcpy(kv->log + kv->tail, buf, len);
+	first = kv->tail / RPMB_BLOCK_SIZE;
+	kv->tail += len;
+	/* the zeroes ending the log go along, also when they start a block */
+	last = kv->tail / RPMB_BLOCK_SIZE;
+	if (last == kv->half_blocks)
+		last--;
+
+	/*
+	 * The block holding the old end of the log goes last, in a write of
+	 * its own: until it is in, the log ends where it did, so none of the
+	 * new records are live if the commit is interrupted.
+	 */
+	if (last > first) {
+		ret = rpmb_kv_write(kv, addr + first + 1, last - first,
+				    kv->log + (first + 1) * RPMB_BLOCK_SIZE);
+		if (ret)
+			return ret;
+	}
+
+	return rpmb_kv_write(kv, addr + first, 1,
+			     kv->log + first * RPMB_BLOCK_SIZE);
+}
+
+static void rpmb_kv_usage(void)
+{
+	fprintf(stderr, "Usage: mmc rpmb kv <format|put|get|del|list|compact> [-s start] </path/to/mmcblkXrpmb> </path/to/key> ...\n");
+	exit(1);
+}
+
+/* Parses the common [-s start] <rpmb> <key> arguments */
+static int rpmb_kv_args(int nargs, char **argv, __u16 *start)
+{
+	int c;
+
+	*start = 0;
+	while ((c = getopt(nargs, argv, "s:")) != -1) {
+		switch (c) {
+		case 's':
+			*start = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			rpmb_kv_usage();
+		}
+	}
+	if (nargs - optind < 2)
+		rpmb_kv_usage();
+
+	return optind;
+}
+
+static void rpmb_kv_report(struct rpmb_kv *kv)
+{
+	printf("%u authenticated write%s, write counter now 0x%08x\n",
+	       kv->writes, kv->writes == 1 ? "" : "s", kv->counter);
+}
+
+int do_rpmb_kv_format(int nargs, char **argv)
+{
+	struct rpmb_kv kv;
+	unsigned long blocks, rpmb_blocks;
+	__u8 ext_csd[512];
+	__u32 gen;
+	int i;
+
+	i = rpmb_kv_args(nargs, argv, &kv.start);
+	if (nargs - i != 3)
+		rpmb_kv_usage();
+
+	if (read_rpmb_parent_extcsd(argv[i], ext_csd))
+		exit(1);
+	/* RPMB_SIZE_MULT is in units of 128K */
+	rpmb_blocks = ext_csd[EXT_CSD_RPMB_SIZE_MULT] * 128 * 1024 /
+		      RPMB_BLOCK_SIZE;
+
+	blocks = strtoul(argv[i + 2], NULL, 0);
+	if (blocks < 3 || blocks > 0xffff ||
+	    kv.start + blocks > rpmb_blocks) {
+		fprintf(stderr, "The store needs 3 to %lu blocks from block %u\n",
+			rpmb_blocks - kv.start, kv.start);
+		exit(1);
+	}
+
+	rpmb_kv_open(&kv, argv[i], argv[i + 1], kv.start, false);
+	kv.half_blocks = (blocks - 1) / 2;
+
+	/* Outgrow any earlier store here, so none of its records survive */
+	gen = time(NULL);
+	if (!rpmb_read_data(kv.fd, kv.key, kv.start, 1, (__u8 *)&kv.sb) &&
+	    !memcmp(kv.sb.magic, RPMB_KV_MAGIC, sizeof(kv.sb.magic)) &&
+	    le32toh(kv.sb.gen) >= gen)
+		gen = le32toh(kv.sb.gen) + 1;
+
+	memset(&kv.sb, 0, sizeof(kv.sb));
+	memcpy(kv.sb.magic, RPMB_KV_MAGIC, sizeof(kv.sb.magic));
+	kv.sb.gen = htole32(gen);
+	kv.sb.blocks = htole16(blocks);
+	kv.sb.active = 0;
+	if (rpmb_kv_write_super(&kv))
+		exit(1);
+
+	printf("Key/value store of %lu blocks (%u KiB of log) at RPMB block %u\n",
+	       blocks, kv.half_blocks / 4, kv.start);
+	rpmb_kv_report(&kv);
+	rpmb_kv_close(&kv);
+
+	return 0;
+}
+
+/* Reads a value given as @file, or - for stdin */
+static __u8 *rpmb_kv_read_value(const char *file, unsigned int *len)
+{
+	size_t size = 0, cap = 0;
+	__u8 *buf = NULL;
+	ssize_t r;
+	int fd;
+
+	fd = strcmp(file, "-") ? open(file, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0) {
+		perror(file);
+		exit(1);
+	}
+
+	do {
+		if (size == cap) {
+			cap = cap ? cap * 2 : 4096;
+			buf = realloc(buf, cap);
+			if (!buf) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		r = read(fd, buf + size, cap - size);
+		if (r > 0)
+			size += r;
+	} while (r > 0 || (r < 0 && errno == EINTR));
+	if (r < 0) {
+		perror(file);
+		exit(1);
+	}
+	if (size > 0xffff) {
+		fprintf(stderr, "%s: values are limited to 64K\n", file);
+		exit(1);
+	}
+
+	if (fd != STDIN_FILENO)
+		close(fd);
+	*len = size;
+	return buf;
+}
+
+int do_rpmb_kv_put(int nargs, char **argv)
+{
+	struct rpmb_kv kv;
+	__u16 start;
+	__u8 *buf = NULL, *value, *tmp;
+	size_t len = 0, cap = 0;
+	unsigned int vlen, records = 0;
+	char *name, *eq;
+	int i, first;
+
+	first = rpmb_kv_args(nargs, argv, &start);
+	if (nargs - first < 3)
+		rpmb_kv_usage();
+	rpmb_kv_open(&kv, argv[first], argv[first + 1], start, true);
+
+	/* All puts of one invocation are committed together */
+	for (i = first + 2; i < nargs; i++) {
+		name = argv[i];
+		eq = strchr(name, '=');
+		if (!eq || eq == name || eq - name > RPMB_KV_MAX_NAME) {
+			fprintf(stderr, "Expected <name>=<value> or <name>=@<file>, not '%s'\n",
+				name);
+			exit(1);
+		}
+		*eq = '\0';
+		if (eq[1] == '@') {
+			value = rpmb_kv_read_value(eq + 2, &vlen);
+		} else {
+			vlen = strlen(eq + 1);
+			if (vlen > 0xffff) {
+				fprintf(stderr, "%s: values are limited to 64K\n",
+					name);
+				exit(1);
+			}
+			value = (__u8 *)strdup(eq + 1);
+		}
+
+		if (len + sizeof(struct rpmb_kv_rec) + strlen(name) + vlen > cap) {
+			cap = (len + sizeof(struct rpmb_kv_rec) + strlen(name) +
+			       vlen) * 2;
+			tmp = realloc(buf, cap);
+			if (!tmp) {
+				perror("realloc");
+				exit(1);
+			}
+			buf = tmp;
+		}
+		len += rpmb_kv_encode(buf + len, RPMB_KV_PUT,
+				      le32toh(kv.sb.gen), name, value, vlen);
+		rpmb_kv_apply(&kv, RPMB_KV_PUT, name, value, vlen);
+		records++;
+		free(value);
+	}
+
+	if (rpmb_kv_commit(&kv, buf, len))
+		exit(1);
+
+	printf("Stored %u record%s\n", records, records == 1 ? "" : "s");
+	rpmb_kv_report(&kv);
+	free(buf);
+	rpmb_kv_close(&kv);
+
+	return 0;
+}
+
+int do_rpmb_kv_del(int nargs, char **argv)
+{
+	struct rpmb_kv kv;
+	__u16 start;
+	__u8 *buf;
+	size_t len = 0;
+	int i, first;
+
+	first = rpmb_kv_args(nargs, argv, &start);
+	if (nargs - first < 3)
+		rpmb_kv_usage();
+	rpmb_kv_open(&kv, argv[first], argv[first + 1], start, true);
+
+	buf = calloc(nargs - first - 2,
+		     sizeof(struct rpmb_kv_rec) + RPMB_KV_MAX_NAME);
+	if (!buf) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = first + 2; i < nargs; i++) {
+		if (!rpmb_kv_find(&kv, argv[i])) {
+			fprintf(stderr, "No such key '%s'\n", argv[i]);
+			exit(1);
+		}
+		len += rpmb_kv_encode(buf + len, RPMB_KV_DEL,
+				      le32toh(kv.sb.gen), argv[i], NULL, 0);
+		rpmb_kv_apply(&kv, RPMB_KV_DEL, argv[i], NULL, 0);
+	}
+
+	if (rpmb_kv_commit(&kv, buf, len))
+		exit(1);
+
+	rpmb_kv_report(&kv);
+	free(buf);
+	rpmb_kv_close(&kv);
+
+	return 0;
+}
+
+int do_rpmb_kv_get(int nargs, char **argv)
+{
+	struct rpmb_kv_entry *e;
+	struct rpmb_kv kv;
+	__u16 start;
+	int first;
+
+	first = rpmb_kv_args(nargs, argv, &start);
+	if (nargs - first != 3)
+		rpmb_kv_usage();
+	rpmb_kv_open(&kv, argv[first], argv[first + 1], start, true);
+
+	e = rpmb_kv_find(&kv, argv[first + 2]);
+	if (!e) {
+		fprintf(stderr, "No such key '%s'\n", argv[first + 2]);
+		exit(1);
+	}
+	if (DO_IO(write, STDOUT_FILENO, e->value, e->len) != (ssize_t)e->len) {
+		perror("write");
+		exit(1);
+	}
+
+	rpmb_kv_close(&kv);
+	return 0;
+}
+
+static int rpmb_kv_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct rpmb_kv_entry *)a)->name,
+		      ((const struct rpmb_kv_entry *)b)->name);
+}
+
+int do_rpmb_kv_list(int nargs, char **argv)
+{
+	struct rpmb_kv kv;
+	unsigned int i;
+	__u16 start;
+	size_t live = 0;
+	int first;
+
+	first = rpmb_kv_args(nargs, argv, &start);
+	if (nargs - first != 2)
+		rpmb_kv_usage();
+	rpmb_kv_open(&kv, argv[first], argv[first + 1], start, true);
+
+	qsort(kv.entries, kv.n, sizeof(*kv.entries), rpmb_kv_cmp);
+	for (i = 0; i < kv.n; i++) {
+		printf("%-32s %6u\n", kv.entries[i].name, kv.entries[i].len);
+		live += sizeof(struct rpmb_kv_rec) +
+			strlen(kv.entries[i].name) + kv.entries[i].len;
+	}
+	printf("%u keys, log %zu of %u bytes used, %zu of them live\n",
+	       kv.n, kv.tail, kv.half_blocks * RPMB_BLOCK_SIZE, live);
+
+	rpmb_kv_close(&kv);
+	return 0;
+}
+
+int do_rpmb_kv_compact(int nargs, char **argv)
+{
+	struct rpmb_kv kv;
+	__u16 start;
+	size_t before;
+	int first;
+
+	first = rpmb_kv_args(nargs, argv, &start);
+	if (nargs - first != 2)
+		rpmb_kv_usage();
+	rpmb_kv_open(&kv, argv[first], argv[first + 1], start, true);
+
+	before = kv.tail;
+	if (rpmb_kv_compact(&kv))
+		exit(1);
+
+	printf("Log compacted from %zu to %zu bytes\n", before, kv.tail);
+	rpmb_kv_report(&kv);
+	rpmb_kv_close(&kv);
+
+	return 0;
+}
+
+/*
+ * rpmb write-batch: updates read from stdin are buffered for a time window.
+ * Later updates of a block replace earlier ones, and whatever is pending at
+ * the end of the window is committed in address order, contiguous blocks
+ * sharing authenticated writes.
+ */
+struct rpmb_update {
+	__u16 addr;
+	__u8 data[RPMB_BLOCK_SIZE];
+};
+
+struct rpmb_batch {
+	int fd;
+	unsigned char key[32];
+	unsigned int max_frames;
+	unsigned int counter;
+	const char *journal;
+	struct rpmb_update *pending;
+	unsigned int n, cap;
+	unsigned int updates;	/* blocks received */
+	unsigned int blocks;	/* blocks written */
+	unsigned int writes;	/* authenticated writes */
+};
+
+static void rpmb_batch_add(struct rpmb_batch *b, __u16 addr, const __u8 *data)
+{
+	unsigned int i;
+
+	b->updates++;
+	for (i = 0; i < b->n; i++) {
+		if (b->pending[i].addr == addr) {
+			memcpy(b->pending[i].data, data, RPMB_BLOCK_SIZE);
+			return;
+		}
+	}
+
+	if (b->n == b->cap) {
+		b->cap = b->cap ? b->cap * 2 : 64;
+		b->pending = realloc(b->pending, b->cap * sizeof(*b->pending));
+		if (!b->pending) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	b->pending[b->n].addr = addr;
+	memcpy(b->pending[b->n].data, data, RPMB_BLOCK_SIZE);
+	b->n++;
+}
+
+static int cmp_rpmb_update(const void *a, const void *b)
+{
+	const struct rpmb_update *ua = a, *ub = b;
+
+	return (int)ua->addr - (int)ub->addr;
+}
+
+static int rpmb_batch_flush(struct rpmb_batch *b)
+{
+	unsigned int i, j, run, blocks = 0;
+	__u8 *data;
+	int ret = 0, writes = 0;
+
+	if (!b->n)
+		return 0;
+
+	data = malloc(b->n * RPMB_BLOCK_SIZE);
+	if (!data) {
+		perror("malloc");
+		exit(1);
+	}
+
+	qsort(b->pending, b->n, sizeof(*b->pending), cmp_rpmb_update);
+	for (i = 0; i < b->n; i = j) {
+		for (j = i; j < b->n; j++) {
+			if (b->pending[j].addr != b->pending[i].addr + (j - i))
+				break;
+			memcpy(data + (j - i) * RPMB_BLOCK_SIZE,
+			       b->pending[j].data, RPMB_BLOCK_SIZE);
+		}
+		run = j - i;
+		ret = rpmb_write_data(b->fd, b->key, b->max_frames, &b->counter,
+				      b->pending[i].addr, run, data);
+		if (ret < 0)
+			break;
+		writes += ret;
+		blocks += run;
+		ret = 0;
+	}
+	free(data);
+
+	b->blocks += blocks;
+	b->writes += writes;
+	if (writes)
+		rpmb_journal_append(b->journal, b->counter);
+	printf("Committed %u block%s in %d authenticated write%s, write counter now 0x%08x\n",
+	       blocks, blocks == 1 ? "" : "s", writes, writes == 1 ? "" : "s",
+	       b->counter);
+	fflush(stdout);
+	b->n = 0;
+
+	return ret;
+}
+
+static int hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Parses "<address> <hex data>". Data longer than a block continues at the
+ * following addresses, and the last block is padded with zeroes. Nothing is
+ * queued unless the whole line is valid.
+ */
+static int rpmb_batch_parse(struct rpmb_batch *b, char *line)
+{
+	unsigned long addr;
+	unsigned int i, len, blocks;
+	__u8 *data;
+	char *p;
+	int hi, lo;
+
+	while (*line == ' ' || *line == '\t')
+		line++;
+	if (!*line || *line == '#')
+		return 0;
+
+	errno = 0;
+	addr = strtoul(line, &p, 0);
+	if (errno || p == line || addr > 0xffff)
+		return -EINVAL;
+	while (*p == ' ' || *p == '\t')
+		p++;
+	if (!*p)
+		return -EINVAL;
+
+	len = strcspn(p, " \t");
+	if (len % 2)
+		return -EINVAL;
+	len /= 2;
+	blocks = (len + RPMB_BLOCK_SIZE - 1) / RPMB_BLOCK_SIZE;
+	if (addr + blocks - 1 > 0xffff)
+		return -EINVAL;
+
+	data = calloc(blocks, RPMB_BLOCK_SIZE);
+	if (!data) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < len; i++, p += 2) {
+		hi = hex_nibble(p[0]);
+		lo = hi < 0 ? -1 : hex_nibble(p[1]);
+		if (lo < 0) {
+			free(data);
+			return -EINVAL;
+		}
+		data[i] = hi << 4 | lo;
+	}
+
+	for (i = 0; i < blocks; i++)
+		rpmb_batch_add(b, addr + i, data + i * RPMB_BLOCK_SIZE);
+	free(data);
+
+	return 0;
+}
+
+int do_rpmb_write_batch(int nargs, char **argv)
+{
+	struct rpmb_batch b = {};
+	struct rpmb_frame dummy = {};
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	char journal[PATH_MAX] = "";
+	char *buf = NULL, *line, *nl;
+	size_t len = 0, cap = 0;
+	unsigned int window_ms = 1000, lineno = 0;
+	__u64 deadline = 0, now;
+	__u8 ext_csd[512];
+	ssize_t r;
+	int c, ret = 0, timeout;
+
+	while ((c = getopt(nargs, argv, "w:j:")) != -1) {
+		switch (c) {
+		case 'w':
+			window_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			snprintf(journal, sizeof(journal), "%s", optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind != 2)
+		goto usage;
+	if (!strcmp(argv[optind + 1], "-")) {
+		fprintf(stderr, "The key can't be read from stdin, which carries the updates\n");
+		exit(1);
+	}
+
+	if (!journal[0] &&
+	    rpmb_journal_path(argv[optind], journal, sizeof(journal)))
+		exit(1);
+	b.journal = journal;
+
+	if (read_rpmb_parent_extcsd(argv[optind], ext_csd))
+		exit(1);
+	b.max_frames = rpmb_max_write_frames(ext_csd);
+
+	b.fd = open(argv[optind], O_RDWR);
+	if (b.fd < 0) {
+		perror("device open");
+		exit(1);
+	}
+	if (rpmb_get_key(argv[optind + 1], &dummy, b.key, false))
+		exit(1);
+	ret = rpmb_read_counter(b.fd, &b.counter);
+	if (ret) {
+		printf("RPMB read counter operation failed, retcode 0x%04x\n",
+		       ret);
+		exit(1);
+	}
+
+	catch_interrupts();
+	while (!mmc_interrupted) {
+		timeout = -1;
+		if (b.n) {
+			now = get_time_us();
+			timeout = deadline > now ? (deadline - now + 999) / 1000 : 0;
+		}
+
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (!ret) {
+			ret = rpmb_batch_flush(&b);
+			if (ret)
+				break;
+			continue;
+		}
+
+		if (cap - len < 4096) {
+			cap = cap ? cap * 2 : 8192;
+			buf = realloc(buf, cap);
+			if (!buf) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		r = read(STDIN_FILENO, buf + len, cap - len - 1);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (r < 0) {
+				perror("read");
+				ret = -1;
+			}
+			break;
+		}
+		len += r;
+		buf[len] = '\0';
+
+		line = buf;
+		while ((nl = strchr(line, '\n'))) {
+			*nl = '\0';
+			lineno++;
+			if (!b.n)
+				deadline = get_time_us() + window_ms * 1000ULL;
+			if (rpmb_batch_parse(&b, line))
+				fprintf(stderr, "stdin:%u: expected <address> <hex data>\n",
+					lineno);
+			line = nl + 1;
+		}
+		len -= line - buf;
+		memmove(buf, line, len);
+	}
+
+	/* a last line without newline */
+	if (!mmc_interrupted && len) {
+		buf[len] = '\0';
+		if (rpmb_batch_parse(&b, buf))
+			fprintf(stderr, "stdin:%u: expected <address> <hex data>\n",
+				lineno + 1);
+	}
+	if (rpmb_batch_flush(&b))
+		ret = -1;
+
+	printf("%u update%s, %u block%s written in %u authenticated write%s (%u without coalescing)\n",
+	       b.updates, b.updates == 1 ? "" : "s",
+	       b.blocks, b.blocks == 1 ? "" : "s",
+	       b.writes, b.writes == 1 ? "" : "s", b.updates);
+
+	free(buf);
+	free(b.pending);
+	close(b.fd);
+
+	return ret < 0 ? 1 : 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc rpmb write-batch [-w window_ms] [-j journal] <rpmb device> <key file>\n");
+	exit(1);
+}
+
+/*
+ * rpmb provision: programs the authentication key of many RPMB partitions
+ * at once, one forked worker per device, and verifies each by an
+ * authenticated counter read. Workers hand their result back over a pipe
+ * so the report comes out in the order the devices were given.
+ */
+#define RPMB_RESULT_MASK	0x007f	/* bit 7 flags an expired counter */
+#define RPMB_RESULT_NO_KEY	0x0007
+
+enum {
+	RPMB_PROVISIONED,
+	RPMB_ALREADY_PROVISIONED,
+	RPMB_PROVISION_FAILED,
+};
+
+struct rpmb_provision_result {
+	int status;
+	unsigned int counter;
+	__u64 time_us;
+	char cid[40];
+	char msg[96];
+};
+
+struct rpmb_provision_worker {
+	const char *device;
+	pid_t pid;
+	int fd;
+	struct rpmb_provision_result res;
+};
+
+/*
+ * Reads the write counter with a fresh nonce and checks the MAC of the
+ * response against @key, which proves the device holds that key.
+ *
+ * Return: 0, the RPMB result code of a failed read, or a negative error.
+ */
+static int rpmb_read_counter_auth(int fd, const unsigned char *key,
+				  unsigned int *cnt)
+{
+	struct rpmb_frame frame_in = {
+		.req_resp = htobe16(MMC_RPMB_READ_CNT)
+	}, frame_out = {};
+	unsigned char mac[32];
+
+	rpmb_fill_nonce(&frame_in);
+	if (do_rpmb_op(fd, &frame_in, &frame_out, 1))
+		return -errno;
+	if (frame_out.result)
+		return be16toh(frame_out.result);
+
+	hmac_sha256(key, 32, frame_out.data,
+		    sizeof(frame_out) - offsetof(struct rpmb_frame, data),
+		    mac, sizeof(mac));
+	if (memcmp(mac, frame_out.key_mac, sizeof(mac)) ||
+	    memcmp(frame_in.nonce, frame_out.nonce, sizeof(frame_in.nonce)))
+		return -EBADMSG;
+
+	*cnt = be32toh(frame_out.write_counter);
+	return 0;
+}
+
+/*
+ * Keys either come from <dir>/<CID>.key, or are derived as
+ * HMAC-SHA256(master key, CID) over the 16 CID bytes.
+ */
+static int rpmb_provision_key(const char *key_dir, const unsigned char *master,
+			      const char *cid, unsigned char *key, char *msg,
+			      size_t len)
+{
+	char path[PATH_MAX];
+	__u8 raw[16];
+	int i, fd, hi, lo;
+	ssize_t r;
+
+	if (key_dir) {
+		snprintf(path, sizeof(path), "%s/%s.key", key_dir, cid);
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			snprintf(msg, len, "%s.key: %s", cid, strerror(errno));
+			return -1;
+		}
+		r = DO_IO(read, fd, key, 32);
+		close(fd);
+		if (r != 32) {
+			snprintf(msg, len, "%s.key: not a 32 byte key", cid);
+			return -1;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < 16; i++) {
+		hi = hex_nibble(cid[2 * i]);
+		lo = hi < 0 ? -1 : hex_nibble(cid[2 * i + 1]);
+		if (lo < 0) {
+			snprintf(msg, len, "malformed CID %s", cid);
+			return -1;
+		}
+		raw[i] = hi << 4 | lo;
+	}
+	hmac_sha256((unsigned char *)master, 32, raw, sizeof(raw), key, 32);
+
+	return 0;
+}
+
+static void rpmb_provision_one(const char *device, const char *key_dir,
+			       const unsigned char *master,
+			       struct rpmb_provision_result *res)
+{
+	struct rpmb_frame frame_in = {
+		.req_resp = htobe16(MMC_RPMB_WRITE_KEY)
+	}, frame_out = {};
+	char parent[PATH_MAX];
+	unsigned char key[32];
+	__u64 start = get_time_us();
+	int fd, ret;
+
+	res->status = RPMB_PROVISION_FAILED;
+	if (rpmb_parent_device(device, parent, sizeof(parent))) {
+		snprintf(res->msg, sizeof(res->msg), "not an RPMB device");
+		return;
+	}
+	get_cid_string(parent, res->cid, sizeof(res->cid));
+	if (strlen(res->cid) != 32) {
+		snprintf(res->msg, sizeof(res->msg), "no CID in sysfs");
+		return;
+	}
+	if (rpmb_provision_key(key_dir, master, res->cid, key, res->msg,
+			       sizeof(res->msg)))
+		return;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		snprintf(res->msg, sizeof(res->msg), "%s", strerror(errno));
+		return;
+	}
+
+	/* A key can only be programmed once: see if it is already ours */
+	ret = rpmb_read_counter_auth(fd, key, &res->counter);
+	if (!ret) {
+		res->status = RPMB_ALREADY_PROVISIONED;
+		goto out;
+	}
+	if (ret == -EBADMSG) {
+		snprintf(res->msg, sizeof(res->msg), "programmed with another key");
+		goto out;
+	}
+	if (ret < 0 || (ret & RPMB_RESULT_MASK) != RPMB_RESULT_NO_KEY) {
+		snprintf(res->msg, sizeof(res->msg), ret < 0 ?
+			 "counter read failed" : "counter read failed, retcode 0x%04x",
+			 ret);
+		goto out;
+	}
+
+	memcpy(frame_in.key_mac, key, sizeof(frame_in.key_mac));
+	ret = do_rpmb_op(fd, &frame_in, &frame_out, 1);
+	memset(frame_in.key_mac, 0, sizeof(frame_in.key_mac));
+	if (ret || frame_out.result) {
+		snprintf(res->msg, sizeof(res->msg), ret ?
+			 "key programming failed" :
+			 "key programming failed, retcode 0x%04x",
+			 be16toh(frame_out.result));
+		goto out;
+	}
+
+	ret = rpmb_read_counter_auth(fd, key, &res->counter);
+	if (ret) {
+		snprintf(res->msg, sizeof(res->msg), ret < 0 ?
+			 "verification failed" :
+			 "verification failed, retcode 0x%04x", ret);
+		goto out;
+	}
+	res->status = RPMB_PROVISIONED;
+	rpmb_journal_record(device, res->counter);
+
+out:
+	memset(key, 0, sizeof(key));
+	close(fd);
+	res->time_us = get_time_us() - start;
+}
+
+static void rpmb_provision_start(struct rpmb_provision_worker *w,
+				 const char *key_dir,
+				 const unsigned char *master)
+{
+	struct rpmb_provision_result res = {};
+	int pfd[2];
+
+	if (pipe(pfd)) {
+		perror("pipe");
+		exit(1);
+	}
+
+	fflush(NULL);
+	w->pid = fork();
+	if (w->pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (!w->pid) {
+		close(pfd[0]);
+		rpmb_provision_one(w->device, key_dir, master, &res);
+		/* a result is well below PIPE_BUF, so this write is atomic */
+		if (write(pfd[1], &res, sizeof(res)) != sizeof(res))
+			_exit(2);
+		_exit(0);
+	}
+	close(pfd[1]);
+	w->fd = pfd[0];
+}
+
+static void rpmb_provision_finish(struct rpmb_provision_worker *w)
+{
+	if (DO_IO(read, w->fd, &w->res, sizeof(w->res)) != sizeof(w->res)) {
+		memset(&w->res, 0, sizeof(w->res));
+		w->res.status = RPMB_PROVISION_FAILED;
+		snprintf(w->res.msg, sizeof(w->res.msg), "worker died");
+	}
+	close(w->fd);
+}
+
+int do_rpmb_provision(int nargs, char **argv)
+{
+	static const char * const status_names[] = {
+		[RPMB_PROVISIONED] = "provisioned",
+		[RPMB_ALREADY_PROVISIONED] = "already provisioned",
+		[RPMB_PROVISION_FAILED] = "FAILED",
+	};
+	struct rpmb_provision_worker *workers;
+	struct rpmb_frame dummy = {};
+	unsigned char master[32];
+	const char *key_dir = NULL, *master_file = NULL;
+	unsigned int jobs = 0, running = 0, next = 0, i, n, failed = 0;
+	__u64 start;
+	pid_t pid;
+	int c;
+
+	while ((c = getopt(nargs, argv, "k:m:j:")) != -1) {
+		switch (c) {
+		case 'k':
+			key_dir = optarg;
+			break;
+		case 'm':
+			master_file = optarg;
+			break;
+		case 'j':
+			jobs = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind < 1 || !key_dir == !master_file)
+		goto usage;
+
+	if (master_file && rpmb_get_key(master_file, &dummy, master, false))
+		exit(1);
+
+	n = nargs - optind;
+	if (!jobs || jobs > n)
+		jobs = n;
+	workers = calloc(n, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		workers[i].device = argv[optind + i];
+
+	start = get_time_us();
+	while (next < n || running) {
+		if (next < n && running < jobs) {
+			rpmb_provision_start(&workers[next++], key_dir, master);
+			running++;
+			continue;
+		}
+		pid = wait(NULL);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("wait");
+			exit(1);
+		}
+		for (i = 0; i < next; i++)
+			if (workers[i].pid == pid)
+				running--;
+	}
+	memset(master, 0, sizeof(master));
+
+	printf("%-24s %-32s %-20s %10s %8s\n", "device", "CID", "status",
+	       "counter", "time ms");
+	for (i = 0; i < n; i++) {
+		struct rpmb_provision_result *res = &workers[i].res;
+
+		rpmb_provision_finish(&workers[i]);
+		if (res->status == RPMB_PROVISION_FAILED)
+			failed++;
+		printf("%-24s %-32s %-20s ", workers[i].device,
+		       res->cid[0] ? res->cid : "-", status_names[res->status]);
+		if (res->status == RPMB_PROVISION_FAILED)
+			printf("%s\n", res->msg);
+		else
+			printf("0x%08x %8llu\n", res->counter,
+			       (unsigned long long)res->time_us / 1000);
+	}
+	printf("%u of %u devices provisioned in %llu ms\n", n - failed, n,
+	       (unsigned long long)(get_time_us() - start) / 1000);
+
+	free(workers);
+	return failed ? 1 : 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc rpmb provision -k <key dir>|-m <master key file> [-j jobs] <rpmb device>...\n");
+	exit(1);
+}
+
+static unsigned int get_cache_size_kib(__u8 *ext_csd)
+{
+	/* CACHE_SIZE is in units of 1 kibit */
+	return per_byte_htole32(&ext_csd[EXT_CSD_CACHE_SIZE_0]) / 8;
+}
+
+static bool cache_available(__u8 *ext_csd, const char *device)
+{
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V4_5) {
+		fprintf(stderr,
+			"The CACHE option is only availabe on devices >= "
+			"MMC 4.5 %s\n", device);
+		return false;
+	}
+
+	/* If the cache size is zero, this device does not have a cache */
+	if (!get_cache_size_kib(ext_csd)) {
+		fprintf(stderr,
+			"The CACHE option is not available on %s\n",
+			device);
+		return false;
+	}
+
+	return true;
+}
+
+static int do_cache_ctrl(int value, int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	int fd, ret;
+	char *device;
+
+	if (nargs != 2) {
+	       fprintf(stderr, "Usage: mmc cache enable </path/to/mmcblkX>\n");
+	       exit(1);
+	}
+
+	device = argv[1];
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	if (!cache_available(ext_csd, device))
+		exit(1);
+
+	ret = write_extcsd_value(fd, EXT_CSD_CACHE_CTRL, value, 0);
+	if (ret) {
+		fprintf(stderr,
+			"Could not write 0x%02x to EXT_CSD[%d] in %s\n",
+			value, EXT_CSD_CACHE_CTRL, device);
+		exit(1);
+	}
+
+	close(fd);
+	return ret;
+}
+
+int do_cache_en(int nargs, char **argv)
+{
+	return do_cache_ctrl(1, nargs, argv);
+}
+
+int do_cache_dis(int nargs, char **argv)
+{
+	return do_cache_ctrl(0, nargs, argv);
+}
+
+/* Same as the kernel, the spec doesn't give a bound for flushing */
+#define MMC_CACHE_FLUSH_TIMEOUT_MS	(30 * 1000)
+
+/*
+ * Writes FLUSH_CACHE and waits for the device to finish.
+ *
+ * @value: EXT_CSD_FLUSH for a full flush, EXT_CSD_BARRIER for a barrier
+ * @interruptible: poll for completion instead of the host's busy wait, so
+ *	Ctrl-C or the flush timeout interrupts it with HPI
+ *
+ * Return: 0 on success with the time spent in *@elapsed_us.
+ */
+static int flush_cache(int fd, __u8 *ext_csd, __u8 value, bool interruptible,
+		       __u64 *elapsed_us)
+{
+	struct mmc_ioc_cmd idata = {};
+	__u64 start;
+	int ret;
+
+	if (interruptible && !hpi_prepare(fd, ext_csd)) {
+		fprintf(stderr, "HPI is not supported, the flush can't be interrupted\n");
+		interruptible = false;
+	}
+
+	fill_switch_cmd(&idata, EXT_CSD_FLUSH_CACHE, value);
+	idata.cmd_timeout_ms = MMC_CACHE_FLUSH_TIMEOUT_MS;
+	if (interruptible)
+		idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+
+	start = get_time_us();
+	ret = mmc_ioctl(fd, MMC_IOC_CMD, &idata);
+	if (ret)
+		perror("ioctl");
+	else if (interruptible)
+		ret = wait_busy_or_hpi(fd, ext_csd, 100,
+				       MMC_CACHE_FLUSH_TIMEOUT_MS);
+	*elapsed_us = get_time_us() - start;
+
+	return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	__u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* @samples must be sorted */
+static __u64 percentile(const __u64 *samples, unsigned int n, unsigned int pct)
+{
+	unsigned int idx;
+
+	if (!n)
+		return 0;
+	idx = (n * pct + 99) / 100;
+	return samples[idx ? idx - 1 : 0];
+}
+
+static void print_latency_header(const char *what)
+{
+	printf("%10s %6s %10s %10s %10s %10s %10s\n", what, "n",
+	       "min ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+}
+
+/* sorts @samples in place */
+static void print_latency_row(const char *label, __u64 *samples,
+			      unsigned int n)
+{
+	qsort(samples, n, sizeof(*samples), cmp_u64);
+	printf("%10s %6u %10.3f %10.3f %10.3f %10.3f %10.3f\n", label, n,
+	       n ? samples[0] / 1000.0 : 0,
+	       percentile(samples, n, 50) / 1000.0,
+	       percentile(samples, n, 90) / 1000.0,
+	       percentile(samples, n, 99) / 1000.0,
+	       n ? samples[n - 1] / 1000.0 : 0);
+}
+
+static int open_cache_device(char *device, __u8 *ext_csd)
+{
+	int fd;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	if (read_extcsd(fd, ext_csd)) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	if (!cache_available(ext_csd, device))
+		exit(1);
+
+	if (!(ext_csd[EXT_CSD_CACHE_CTRL] & 0x1)) {
+		fprintf(stderr, "The cache is turned off on %s\n", device);
+		exit(1);
+	}
+
+	return fd;
+}
+
+static bool barrier_available(__u8 *ext_csd, const char *device)
+{
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V5_1 ||
+	    !(ext_csd[EXT_CSD_BARRIER_SUPPORT] & 0x1)) {
+		fprintf(stderr, "Cache barrier is not supported on %s\n",
+			device);
+		return false;
+	}
+
+	return true;
+}
+
+int do_cache_flush(int nargs, char **argv)
+{
+	bool interruptible = false;
+	__u8 ext_csd[512];
+	__u64 elapsed;
+	int fd, ret, c;
+	char *device;
+
+	while ((c = getopt(nargs, argv, "i")) != -1) {
+		if (c != 'i')
+			goto usage;
+		interruptible = true;
+	}
+	if (nargs - optind != 1)
+		goto usage;
+
+	device = argv[optind];
+	fd = open_cache_device(device, ext_csd);
+
+	ret = flush_cache(fd, ext_csd, EXT_CSD_FLUSH, interruptible, &elapsed);
+	if (ret) {
+		fprintf(stderr, "Could not flush the cache of %s\n", device);
+		exit(1);
+	}
+	printf("Cache flushed in %.3f ms\n", elapsed / 1000.0);
+
+	close(fd);
+	return ret;
+
+usage:
+	fprintf(stderr, "Usage: mmc cache flush [-i] </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+int do_cache_barrier(int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	__u64 elapsed;
+	int fd, ret;
+	char *device;
+
+	if (nargs != 2) {
+		fprintf(stderr, "Usage: mmc cache barrier </path/to/mmcblkX>\n");
+		exit(1);
+	}
+
+	device = argv[1];
+	fd = open_cache_device(device, ext_csd);
+
+	if (!barrier_available(ext_csd, device))
+		exit(1);
+
+	if (!(ext_csd[EXT_CSD_BARRIER_CTRL] & 0x1)) {
+		printf("Enabling cache barrier [BARRIER_CTRL] on %s\n", device);
+		ret = write_extcsd_value(fd, EXT_CSD_BARRIER_CTRL, 1, 0);
+		if (ret) {
+			fprintf(stderr, "Could not write 0x01 to EXT_CSD[%d] in %s\n",
+				EXT_CSD_BARRIER_CTRL, device);
+			exit(1);
+		}
+	}
+
+	ret = flush_cache(fd, ext_csd, EXT_CSD_BARRIER, false, &elapsed);
+	if (ret) {
+		fprintf(stderr, "Could not issue a cache barrier on %s\n",
+			device);
+		exit(1);
+	}
+	printf("Cache barrier completed in %.3f ms\n", elapsed / 1000.0);
+
+	close(fd);
+	return ret;
+}
+
+#define CACHE_BENCH_MIN_BYTES	(4 * 1024)
+#define CACHE_BENCH_MAX_BYTES	(64 * 1024 * 1024)
+
+/*
+ * Dirties the device cache with O_DIRECT writes of increasing size to a
+ * scratch file (which should live on the device) and measures how long the
+ * following flush, and barrier if enabled, takes.
+ */
+/*
+ * Times @iterations FLUSH_CACHE or BARRIER switches (@value), each after
+ * writing @size bytes of @buf to the scratch file. A barrier leaves the data
+ * dirty, so the cache is flushed again after each one, untimed.
+ */
+static int cache_bench_pass(int fd, __u8 *ext_csd, int file_fd, void *buf,
+			    size_t size, __u8 value, __u64 *samples,
+			    unsigned int iterations)
+{
+	unsigned int i;
+	__u64 elapsed;
+
+	for (i = 0; i < iterations; i++) {
+		if (pwrite(file_fd, buf, size, 0) != size) {
+			perror("write scratch file");
+			return -1;
+		}
+		if (flush_cache(fd, ext_csd, value, false, &samples[i]))
+			return -1;
+		if (value == EXT_CSD_BARRIER &&
+		    flush_cache(fd, ext_csd, EXT_CSD_FLUSH, false, &elapsed))
+			return -1;
+	}
+
+	return 0;
+}
+
+int do_cache_bench(int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	int fd, file_fd, ret = 0;
+	char *device, *scratch;
+	char label[32];
+	unsigned int iterations = 16;
+	size_t size, max_bytes;
+	__u64 *flush_us, *barrier_us;
+	bool barrier;
+	void *buf;
+
+	if (nargs < 3 || nargs > 5) {
+		fprintf(stderr, "Usage: mmc cache bench </path/to/mmcblkX> </path/to/scratch_file> [max KiB] [iterations]\n");
+		exit(1);
+	}
+
+	device = argv[1];
+	scratch = argv[2];
+	fd = open_cache_device(device, ext_csd);
+
+	max_bytes = (size_t)get_cache_size_kib(ext_csd) * 1024;
+	if (max_bytes > CACHE_BENCH_MAX_BYTES)
+		max_bytes = CACHE_BENCH_MAX_BYTES;
+	if (nargs > 3)
+		max_bytes = strtoul(argv[3], NULL, 10) * 1024;
+	if (nargs > 4)
+		iterations = strtoul(argv[4], NULL, 10);
+	/* O_DIRECT writes to the scratch file must be whole 4 KiB blocks */
+	max_bytes &= ~((size_t)CACHE_BENCH_MIN_BYTES - 1);
+	if (max_bytes < CACHE_BENCH_MIN_BYTES || !iterations) {
+		fprintf(stderr, "Invalid size or iteration count\n");
+		exit(1);
+	}
+
+	barrier = ext_csd[EXT_CSD_REV] >= EXT_CSD_REV_V5_1 &&
+		  (ext_csd[EXT_CSD_BARRIER_SUPPORT] & 0x1) &&
+		  (ext_csd[EXT_CSD_BARRIER_CTRL] & 0x1);
+
+	file_fd = open(scratch, O_RDWR | O_CREAT | O_DIRECT, 0600);
+	if (file_fd < 0) {
+		perror("open scratch file");
+		exit(1);
+	}
+
+	flush_us = calloc(iterations, sizeof(*flush_us));
+	barrier_us = calloc(iterations, sizeof(*barrier_us));
+	if (!flush_us || !barrier_us ||
+	    posix_memalign(&buf, 4096, max_bytes)) {
+		perror("Failed to allocate memory");
+		exit(1);
+	}
+	memset(buf, 0x5a, max_bytes);
+
+	/* allocate the scratch area up front, so no metadata gets dirty */
+	if (pwrite(file_fd, buf, max_bytes, 0) != max_bytes ||
+	    fsync(file_fd)) {
+		perror("prepare scratch file");
+		ret = 1;
+		goto out;
+	}
+
+	printf("Cache size %u KiB, barrier %s\n", get_cache_size_kib(ext_csd),
+	       barrier ? "enabled" : "disabled");
+	print_latency_header("dirty");
+
+	for (size = CACHE_BENCH_MIN_BYTES; size <= max_bytes; size *= 2) {
+		/* separate passes, so each op sees exactly @size dirty bytes */
+		if (cache_bench_pass(fd, ext_csd, file_fd, buf, size,
+				     EXT_CSD_FLUSH, flush_us, iterations) ||
+		    (barrier &&
+		     cache_bench_pass(fd, ext_csd, file_fd, buf, size,
+				      EXT_CSD_BARRIER, barrier_us,
+				      iterations))) {
+			ret = 1;
+			goto out;
+		}
+
+		snprintf(label, sizeof(label), "%zuK", size / 1024);
+		print_latency_row(label, flush_us, iterations);
+		if (barrier) {
+			snprintf(label, sizeof(label), "%zuK bar", size / 1024);
+			print_latency_row(label, barrier_us, iterations);
+		}
+	}
+
+out:
+	free(buf);
+	free(flush_us);
+	free(barrier_us);
+	close(file_fd);
+	close(fd);
+	return ret;
+}
+
+/* Geometry hints from EXT_CSD, in bytes, 0 if not defined */
+struct align_geometry {
+	unsigned long long super_page;
+	unsigned long long opt_read;
+	unsigned long long opt_write;
+	unsigned long long opt_trim;
+	unsigned long long erase_grp;
+	unsigned long long wp_grp;
+	unsigned long long large_unit;
+};
+
+static void get_align_geometry(__u8 *ext_csd, struct align_geometry *g)
+{
+	unsigned int n;
+
+	memset(g, 0, sizeof(*g));
+
+	/* SUPER_PAGE_SIZE is 512B * 2^(n - 1) */
+	n = ext_csd[EXT_CSD_ACC_SIZE] & 0xf;
+	if (n && n <= 8)
+		g->super_page = 512ull << (n - 1);
+
+	g->erase_grp = get_hc_erase_grp_size(ext_csd) * 512ull * 1024;
+	g->wp_grp = g->erase_grp * get_hc_wp_grp_size(ext_csd);
+
+	if (ext_csd[EXT_CSD_REV] >= EXT_CSD_REV_V4_5)
+		g->large_unit = (ext_csd[EXT_CSD_LARGE_UNIT_SIZE_M1] + 1ull) *
+				1024 * 1024;
+
+	if (ext_csd[EXT_CSD_REV] >= EXT_CSD_REV_V5_0) {
+		g->opt_read = ext_csd[EXT_CSD_OPTIMAL_READ_SIZE] * 4096ull;
+		g->opt_write = ext_csd[EXT_CSD_OPTIMAL_WRITE_SIZE] * 4096ull;
+		n = ext_csd[EXT_CSD_OPTIMAL_TRIM_UNIT_SIZE];
+		if (n && n <= 32)
+			g->opt_trim = 4096ull << (n - 1);
+	}
+}
+
+static void print_align_size(const char *name, unsigned long long bytes)
+{
+	if (!bytes)
+		printf("  %-34s not defined\n", name);
+	else if (bytes % (1024 * 1024))
+		printf("  %-34s %llu KiB\n", name, bytes / 1024);
+	else
+		printf("  %-34s %llu MiB\n", name, bytes / (1024 * 1024));
+}
+
+/* Checks that [@start, @start + @size) honours every defined boundary */
+static bool check_alignment(const char *what, unsigned long long start,
+			    unsigned long long size, struct align_geometry *g)
+{
+	const struct {
+		const char *name;
+		unsigned long long unit;
+	} units[] = {
+		{ "super page", g->super_page },
+		{ "optimal write size", g->opt_write },
+		{ "optimal trim unit", g->opt_trim },
+		{ "erase group", g->erase_grp },
+		{ "large unit", g->large_unit },
+	};
+	bool ok = true;
+	unsigned int i;
+
+	printf("  %-14s start %10llu KiB  size %10llu KiB  ", what,
+	       start / 1024, size / 1024);
+	for (i = 0; i < ARRAY_SIZE(units); i++) {
+		if (!units[i].unit)
+			continue;
+		if (start % units[i].unit) {
+			printf("%sstart not %s aligned", ok ? "" : ", ",
+			       units[i].name);
+			ok = false;
+		} else if (size % units[i].unit) {
+			printf("%ssize not a multiple of the %s",
+			       ok ? "" : ", ", units[i].name);
+			ok = false;
+		}
+	}
+	printf("%s\n", ok ? "OK" : "");
+
+	return ok;
+}
+
+static int read_sysfs_ull(const char *path, unsigned long long *val)
+{
+	FILE *f = fopen(path, "r");
+	int ret;
+
+	if (!f)
+		return -1;
+	ret = fscanf(f, "%llu", val) == 1 ? 0 : -1;
+	fclose(f);
+
+	return ret;
+}
+
+/* Checks the partitions the kernel found in the block device's table */
+static int check_partition_alignment(const char *device,
+				     struct align_geometry *g)
+{
+	const char *name = blk_dev_name(device);
+	unsigned long long start, size;
+	char path[PATH_MAX];
+	struct dirent *de;
+	int misaligned = 0, found = 0;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/sys/class/block/%s", name);
+	dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		return -1;
+	}
+
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, name, strlen(name)) ||
+		    !strcmp(de->d_name, name))
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/block/%s/%s/start",
+			 name, de->d_name);
+		if (read_sysfs_ull(path, &start))
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/block/%s/%s/size",
+			 name, de->d_name);
+		if (read_sysfs_ull(path, &size))
+			continue;
+
+		found++;
+		/* sysfs counts 512 byte sectors */
+		if (!check_alignment(de->d_name, start * 512, size * 512, g))
+			misaligned++;
+	}
+	closedir(dir);
+
+	if (!found)
+		printf("  no partitions found\n");
+
+	return misaligned;
+}
+
+int do_align_check(int nargs, char **argv)
+{
+	struct align_geometry g;
+	unsigned long long start, stride_unit, stripe_unit;
+	unsigned int i, mult, misaligned = 0;
+	__u8 ext_csd[512];
+	char name[8];
+	char *device;
+	int fd, ret;
+
+	if (nargs != 2) {
+		fprintf(stderr, "Usage: mmc align check </path/to/mmcblkX>\n");
+		exit(1);
+	}
+
+	device = argv[1];
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	close(fd);
+
+	get_align_geometry(ext_csd, &g);
+
+	printf("Device geometry:\n");
+	print_align_size("Super page [ACC_SIZE]", g.super_page);
+	print_align_size("Optimal read [OPTIMAL_READ_SIZE]", g.opt_read);
+	print_align_size("Optimal write [OPTIMAL_WRITE_SIZE]", g.opt_write);
+	print_align_size("Optimal trim [OPTIMAL_TRIM_UNIT_SIZE]", g.opt_trim);
+	print_align_size("Erase group [HC_ERASE_GRP_SIZE]", g.erase_grp);
+	print_align_size("WP group [HC_WP_GRP_SIZE]", g.wp_grp);
+	print_align_size("Large unit [LARGE_UNIT_SIZE_M1]", g.large_unit);
+
+	printf("\nPartitions of %s:\n", device);
+	ret = check_partition_alignment(device, &g);
+	if (ret > 0)
+		misaligned += ret;
+
+	printf("\nHardware partitions:\n");
+	if (ext_csd[EXT_CSD_PARTITIONS_ATTRIBUTE] & EXT_CSD_ENH_USR) {
+		start = ((unsigned long long)ext_csd[EXT_CSD_ENH_START_ADDR_3] << 24) |
+			(ext_csd[EXT_CSD_ENH_START_ADDR_2] << 16) |
+			(ext_csd[EXT_CSD_ENH_START_ADDR_1] << 8) |
+			ext_csd[EXT_CSD_ENH_START_ADDR_0];
+		if (is_blockaddresed(ext_csd))
+			start *= 512;
+		mult = (ext_csd[EXT_CSD_ENH_SIZE_MULT_2] << 16) |
+		       (ext_csd[EXT_CSD_ENH_SIZE_MULT_1] << 8) |
+		       ext_csd[EXT_CSD_ENH_SIZE_MULT_0];
+		if (!check_alignment("enhanced user", start, mult * g.wp_grp,
+				     &g))
+			misaligned++;
+	}
+	for (i = 0; i < 4; i++) {
+		mult = (ext_csd[EXT_CSD_GP_SIZE_MULT_1_2 + i * 3] << 16) |
+		       (ext_csd[EXT_CSD_GP_SIZE_MULT_1_1 + i * 3] << 8) |
+		       ext_csd[EXT_CSD_GP_SIZE_MULT_1_0 + i * 3];
+		if (!mult)
+			continue;
+		snprintf(name, sizeof(name), "gp%u", i + 1);
+		if (!check_alignment(name, 0, mult * g.wp_grp, &g))
+			misaligned++;
+	}
+
+	/*
+	 * Stride covers what the device wants written in one go, the stripe
+	 * width what it erases or maps in one go.
+	 */
+	stride_unit = g.opt_write ? g.opt_write : g.super_page;
+	if (stride_unit < 4096)
+		stride_unit = 4096;
+	stripe_unit = g.large_unit ? g.large_unit : g.erase_grp;
+	if (stripe_unit < stride_unit)
+		stripe_unit = stride_unit;
+
+	printf("\nSuggestions:\n");
+	printf("  Start and size partitions on multiples of %llu KiB\n",
+	       stripe_unit / 1024);
+	printf("  mkfs.ext4 -b 4096 -E stride=%llu,stripe_width=%llu\n",
+	       stride_unit / 4096, stripe_unit / 4096);
+	/* f2fs segments are 2 MiB */
+	printf("  mkfs.f2fs -s %llu\n", stripe_unit > 2 * 1024 * 1024 ?
+	       stripe_unit / (2 * 1024 * 1024) : 1);
+
+	if (misaligned)
+		printf("\n%u misaligned area(s) found\n", misaligned);
+
+	return misaligned ? 1 : 0;
+}
+
+#define BENCH_MIN_BS		(4 * 1024)
+#define BENCH_MAX_BS		(512 * 1024)
+#define BENCH_MAX_QD		64
+
+/* One measurement point, shared by all workers */
+struct bench_job {
+	int fd;
+	size_t bs;
+	__u64 size;		/* of the target, multiple of bs */
+	bool random;
+	unsigned int read_pct;	/* share of reads, 0 to 100 */
+	__u64 deadline;
+	__u64 next_off;		/* for sequential access */
+};
+
+struct bench_worker {
+	pthread_t thread;
+	struct bench_job *job;
+	unsigned int seed;
+	void *buf;
+	__u64 *lat_us;
+	size_t nr_lat, max_lat;
+	__u64 bytes;
+	int err;
+};
+
+struct bench_result {
+	double mbps;
+	double iops;
+	__u64 *lat_us;		/* sorted */
+	size_t nr_lat;
+};
+
+static void *bench_worker_fn(void *arg)
+{
+	struct bench_worker *w = arg;
+	struct bench_job *job = w->job;
+	__u64 off, t, nr_blocks = job->size / job->bs;
+	bool read;
+	ssize_t ret;
+
+	while (!mmc_interrupted && (t = get_time_us()) < job->deadline) {
+		if (job->random)
+			off = ((__u64)rand_r(&w->seed) << 16 ^ rand_r(&w->seed)) %
+			      nr_blocks * job->bs;
+		else
+			off = __atomic_fetch_add(&job->next_off, job->bs,
+						 __ATOMIC_RELAXED) % job->size;
+		read = (unsigned int)(rand_r(&w->seed) % 100) < job->read_pct;
+
+		if (read)
+			ret = pread(job->fd, w->buf, job->bs, off);
+		else
+			ret = pwrite(job->fd, w->buf, job->bs, off);
+		if (ret != job->bs) {
+			w->err = ret < 0 ? errno : EIO;
+			break;
+		}
+
+		if (w->nr_lat == w->max_lat) {
+			w->max_lat = w->max_lat ? w->max_lat * 2 : 4096;
+			w->lat_us = realloc(w->lat_us,
+					    w->max_lat * sizeof(*w->lat_us));
+			if (!w->lat_us) {
+				w->err = ENOMEM;
+				break;
+			}
+		}
+		w->lat_us[w->nr_lat++] = get_time_us() - t;
+		w->bytes += job->bs;
+	}
+
+	return NULL;
+}
+
+/*
+ * Runs @job with @qd synchronous O_DIRECT workers for @seconds.
+ * On success the caller owns @res->lat_us.
+ */
+static int run_bench_job(struct bench_job *job, unsigned int qd,
+			 unsigned int seconds, struct bench_result *res)
+{
+	struct bench_worker *w;
+	__u64 start, elapsed, bytes = 0;
+	size_t nr_lat = 0;
+	unsigned int i;
+	int err = 0;
+
+	w = calloc(qd, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+
+	job->next_off = 0;
+	start = get_time_us();
+	job->deadline = start + seconds * 1000000ull;
+
+	for (i = 0; i < qd; i++) {
+		w[i].job = job;
+		w[i].seed = start + i;
+		if (posix_memalign(&w[i].buf, 4096, job->bs)) {
+			err = -ENOMEM;
+			break;
+		}
+		memset(w[i].buf, 0xa5, job->bs);
+		if (pthread_create(&w[i].thread, NULL, bench_worker_fn, &w[i])) {
+			free(w[i].buf);
+			w[i].buf = NULL;
+			err = -EAGAIN;
+			break;
+		}
+	}
+	if (err)
+		job->deadline = 0;
+
+	for (i = 0; i < qd && w[i].buf; i++) {
+		pthread_join(w[i].thread, NULL);
+		if (w[i].err && !err)
+			err = -w[i].err;
+		bytes += w[i].bytes;
+		nr_lat += w[i].nr_lat;
+	}
+	elapsed = get_time_us() - start;
+
+	memset(res, 0, sizeof(*res));
+	if (!err) {
+		res->lat_us = malloc((nr_lat ? nr_lat : 1) * sizeof(*res->lat_us));
+		if (!res->lat_us)
+			err = -ENOMEM;
+	}
+	for (i = 0; i < qd && w[i].buf; i++) {
+		if (!err) {
+			memcpy(res->lat_us + res->nr_lat, w[i].lat_us,
+			       w[i].nr_lat * sizeof(*res->lat_us));
+			res->nr_lat += w[i].nr_lat;
+		}
+		free(w[i].lat_us);
+		free(w[i].buf);
+	}
+	free(w);
+
+	if (err)
+		return err;
+
+	qsort(res->lat_us, res->nr_lat, sizeof(*res->lat_us), cmp_u64);
+	res->mbps = bytes / (double)elapsed;
+	res->iops = res->nr_lat * 1000000.0 / elapsed;
+
+	return 0;
+}
+
+/*
+ * Opens a block device, or a regular file standing in for one, for
+ * O_DIRECT access and returns its usable size in *@size.
+ */
+static int open_bench_target(const char *path, bool write, __u64 *size)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, (write ? O_RDWR : O_RDONLY) | O_DIRECT);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+
+	if (fstat(fd, &st)) {
+		perror(path);
+		exit(1);
+	}
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(fd, BLKGETSIZE64, size)) {
+			perror("BLKGETSIZE64");
+			exit(1);
+		}
+	} else {
+		*size = st.st_size;
+	}
+
+	if (*size < BENCH_MAX_BS) {
+		fprintf(stderr, "%s is too small to benchmark\n", path);
+		exit(1);
+	}
+
+	return fd;
+}
+
+static int parse_depths(char *str, unsigned int *depths, unsigned int max)
+{
+	unsigned int n = 0;
+	char *tok;
+
+	for (tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+		if (n == max)
+			return -1;
+		depths[n] = strtoul(tok, NULL, 10);
+		if (!depths[n] || depths[n] > BENCH_MAX_QD)
+			return -1;
+		n++;
+	}
+
+	return n ? n : -1;
+}
+
+static void print_bench_header(void)
+{
+	printf("%-10s %6s %4s %9s %10s %9s %9s %9s\n", "workload", "bs",
+	       "qd", "MB/s", "IOPS", "p50 ms", "p99 ms", "max ms");
+}
+
+static void print_bench_row(const char *workload, size_t bs, unsigned int qd,
+			    struct bench_result *res)
+{
+	printf("%-10s %5zuK %4u %9.2f %10.1f %9.3f %9.3f %9.3f\n", workload,
+	       bs / 1024, qd, res->mbps, res->iops,
+	       percentile(res->lat_us, res->nr_lat, 50) / 1000.0,
+	       percentile(res->lat_us, res->nr_lat, 99) / 1000.0,
+	       res->nr_lat ? res->lat_us[res->nr_lat - 1] / 1000.0 : 0);
+}
+
+/*
+ * MIN_PERF_* hold the performance class, in units of 300KB/s for SDR and
+ * 600KB/s for the DDR variants; 0 means no class is declared.
+ */
+static void print_min_perf(const char *name, __u8 class, unsigned int unit_kbs,
+			   double measured, bool ran)
+{
+	double min = class * unit_kbs / 1000.0;
+
+	if (!class) {
+		printf("%-22s %12s\n", name, "not defined");
+		return;
+	}
+
+	printf("%-22s %7.1f MB/s", name, min);
+	if (ran)
+		printf("  measured %7.1f MB/s  %s", measured,
+		       measured >= min ? "OK" : "BELOW CLASS");
+	printf("\n");
+}
+
+static const char *const hs_timing_str[] = {
+	"backward compatible", "high speed", "HS200", "HS400"
+};
+
+int do_bench(int nargs, char **argv)
+{
+	static const struct {
+		const char *name;
+		bool random;
+		unsigned int read_pct;
+	} workloads[] = {
+		{ "seqread", false, 100 },
+		{ "randread", true, 100 },
+		{ "seqwrite", false, 0 },
+		{ "randwrite", true, 0 },
+	};
+	unsigned int depths[8] = { 1, 4 }, nr_depths = 2;
+	unsigned int seconds = 1, i, d;
+	double best_read = 0, best_write = 0;
+	char *target, *extcsd_dev = NULL;
+	bool write = false, have_extcsd = false;
+	struct bench_job job = {};
+	struct bench_result res;
+	__u8 ext_csd[512], timing;
+	int fd, c, ret = 0;
+	__u64 size;
+	size_t bs;
+
+	while ((c = getopt(nargs, argv, "wq:t:e:")) != -1) {
+		switch (c) {
+		case 'w':
+			write = true;
+			break;
+		case 'q':
+			ret = parse_depths(optarg, depths, ARRAY_SIZE(depths));
+			if (ret < 0) {
+				fprintf(stderr, "Invalid queue depths, at most %zu values of 1 to %d\n",
+					ARRAY_SIZE(depths), BENCH_MAX_QD);
+				exit(1);
+			}
+			nr_depths = ret;
+			ret = 0;
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			extcsd_dev = optarg;
+			break;
+		default:
+			exit(1);
+		}
+	}
+
+	if (optind != nargs - 1 || !seconds) {
+		fprintf(stderr, "Usage: mmc bench [-w] [-q depth,...] [-t seconds] [-e /path/to/mmcblkX] </path/to/target>\n");
+		exit(1);
+	}
+	target = argv[optind];
+
+	fd = open_bench_target(target, write, &size);
+
+	/* EXT_CSD comes from the target itself unless told otherwise */
+	if (extcsd_dev) {
+		int dev_fd = open(extcsd_dev, O_RDWR);
+
+		if (dev_fd < 0) {
+			perror(extcsd_dev);
+			exit(1);
+		}
+		have_extcsd = !read_extcsd(dev_fd, ext_csd);
+		close(dev_fd);
+	} else {
+		struct stat st;
+
+		if (!fstat(fd, &st) && S_ISBLK(st.st_mode))
+			have_extcsd = !read_extcsd(fd, ext_csd);
+	}
+
+	catch_interrupts();
+	job.fd = fd;
+
+	print_bench_header();
+	for (i = 0; i < ARRAY_SIZE(workloads) && !mmc_interrupted; i++) {
+		if (!workloads[i].read_pct && !write)
+			continue;
+		job.random = workloads[i].random;
+		job.read_pct = workloads[i].read_pct;
+
+		for (bs = BENCH_MIN_BS; bs <= BENCH_MAX_BS; bs *= 2) {
+			job.bs = bs;
+			job.size = size - size % bs;
+			for (d = 0; d < nr_depths && !mmc_interrupted; d++) {
+				ret = run_bench_job(&job, depths[d], seconds,
+						    &res);
+				if (ret) {
+					fprintf(stderr, "%s failed: %s\n",
+						workloads[i].name,
+						strerror(-ret));
+					goto out;
+				}
+				print_bench_row(workloads[i].name, bs,
+						depths[d], &res);
+				free(res.lat_us);
+
+				if (workloads[i].random)
+					continue;
+				if (job.read_pct && res.mbps > best_read)
+					best_read = res.mbps;
+				if (!job.read_pct && res.mbps > best_write)
+					best_write = res.mbps;
+			}
+		}
+	}
+
+	if (!have_extcsd) {
+		printf("\nNo EXT_CSD available, pass -e to compare with the declared performance classes\n");
+		goto out;
+	}
+
+	/* bits 7:4 select the driver strength */
+	timing = ext_csd[EXT_CSD_HS_TIMING] & 0x0f;
+	printf("\nDeclared minimum performance (EXT_CSD), bus timing %s:\n",
+	       timing < ARRAY_SIZE(hs_timing_str) ?
+	       hs_timing_str[timing] : "unknown");
+	print_min_perf("MIN_PERF_R_8_52", ext_csd[EXT_CSD_MIN_PERF_R_8_52],
+		       300, best_read, true);
+	print_min_perf("MIN_PERF_W_8_52", ext_csd[EXT_CSD_MIN_PERF_W_8_52],
+		       300, best_write, write);
+	print_min_perf("MIN_PERF_DDR_R_8_52",
+		       ext_csd[EXT_CSD_MIN_PERF_DDR_R_8_52], 600, best_read,
+		       true);
+	print_min_perf("MIN_PERF_DDR_W_8_52",
+		       ext_csd[EXT_CSD_MIN_PERF_DDR_W_8_52], 600, best_write,
+		       write);
+	if (timing >= 2)
+		printf("NOTE! No performance class is defined for HS200/HS400, the 52MHz classes are a lower bound.\n");
+
+out:
+	close(fd);
+	return ret ? 1 : 0;
+}
+
+/*
+ * CMDQ_MODE_EN reads back as 0 while the kernel handles our ioctls, so the
+ * runtime state comes from the card's sysfs node when there is one.
+ *
+ * Return: 1 if enabled, 0 if disabled, -1 if unknown.
+ */
+static int get_cmdq_runtime_state(const char *device, __u8 *ext_csd,
+				  const char **source)
+{
+	char path[PATH_MAX];
+	int val;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/block/%s/device/cmdq_en",
+		 blk_dev_name(device));
+	f = fopen(path, "r");
+	if (f) {
+		if (fscanf(f, "%d", &val) != 1)
+			val = -1;
+		fclose(f);
+		*source = "sysfs cmdq_en";
+		return val < 0 ? -1 : !!val;
+	}
+
+	*source = "EXT_CSD CMDQ_MODE_EN";
+	return ext_csd[EXT_CSD_CMDQ_MODE_EN] & 0x1;
+}
+
+struct cmdq_bench_point {
+	unsigned int qd;
+	double iops;
+	double mbps;
+	__u64 p50_us;
+	__u64 p99_us;
+};
+
+/* Loads the depth lines of an earlier "cmdq bench" report */
+static int read_cmdq_report(const char *path, struct cmdq_bench_point *points,
+			    unsigned int max, char *state, size_t state_len)
+{
+	struct cmdq_bench_point *p;
+	unsigned int n = 0;
+	char line[256];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	snprintf(state, state_len, "unknown");
+	while (fgets(line, sizeof(line), f)) {
+		p = &points[n];
+		if (!strncmp(line, "cmdq=", 5)) {
+			line[strcspn(line, "\n")] = '\0';
+			snprintf(state, state_len, "%.*s", (int)state_len - 1,
+				 line + 5);
+		} else if (n < max &&
+			   sscanf(line, "qd=%u iops=%lf mbps=%lf p50_us=%llu p99_us=%llu",
+				  &p->qd, &p->iops, &p->mbps, &p->p50_us,
+				  &p->p99_us) == 5) {
+			n++;
+		}
+	}
+	fclose(f);
+
+	return n;
+}
+
+static double pct_change(double now, double before)
+{
+	return before ? (now - before) * 100.0 / before : 0;
+}
+
+int do_cmdq_bench(int nargs, char **argv)
+{
+	struct cmdq_bench_point points[8], prev[8];
+	unsigned int depths[8], nr_depths = 0;
+	char *device, *report = NULL, *compare = NULL;
+	const char *source, *state_str;
+	unsigned int seconds = 5, max_qd, qd, n = 0, nr_prev = 0, i, j;
+	char prev_state[32];
+	struct bench_job job = {};
+	struct bench_result res;
+	__u8 ext_csd[512];
+	bool write = false;
+	int fd, c, state, ret = 0;
+	FILE *out = NULL;
+	__u64 size;
+
+	while ((c = getopt(nargs, argv, "wt:o:c:")) != -1) {
+		switch (c) {
+		case 'w':
+			write = true;
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 10);
+			break;
+		case 'o':
+			report = optarg;
+			break;
+		case 'c':
+			compare = optarg;
+			break;
+		default:
+			exit(1);
+		}
+	}
+
+	if (optind != nargs - 1 || !seconds) {
+		fprintf(stderr, "Usage: mmc cmdq bench [-w] [-t seconds] [-o report] [-c previous report] </path/to/mmcblkX>\n");
+		exit(1);
+	}
+	device = argv[optind];
+
+	fd = open_bench_target(device, write, &size);
+	if (read_extcsd(fd, ext_csd)) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V5_0 ||
+	    !(ext_csd[EXT_CSD_CMDQ_SUPPORT] & 0x1)) {
+		fprintf(stderr, "%s does not support command queuing\n", device);
+		exit(1);
+	}
+	max_qd = (ext_csd[EXT_CSD_CMDQ_DEPTH] & 0x1f) + 1;
+
+	if (compare) {
+		ret = read_cmdq_report(compare, prev, ARRAY_SIZE(prev),
+				       prev_state, sizeof(prev_state));
+		if (ret < 0)
+			exit(1);
+		nr_prev = ret;
+		ret = 0;
+	}
+
+	state = get_cmdq_runtime_state(device, ext_csd, &source);
+	state_str = state < 0 ? "unknown" : state ? "enabled" : "disabled";
+	printf("CMDQ %s (from %s), CMDQ_DEPTH %u\n", state_str, source, max_qd);
+	printf("Workload: random 4K, %s, %u s per depth\n",
+	       write ? "70% read / 30% write" : "read only", seconds);
+
+	job.fd = fd;
+	job.bs = BENCH_MIN_BS;
+	job.size = size - size % job.bs;
+	job.random = true;
+	job.read_pct = write ? 70 : 100;
+	catch_interrupts();
+
+	printf("%4s %10s %9s %9s %9s", "qd", "IOPS", "MB/s", "p50 ms", "p99 ms");
+	if (nr_prev)
+		printf("   vs %s: %8s %8s", prev_state, "IOPS", "p99");
+	printf("\n");
+
+	/* powers of two up to, and including, the device queue depth */
+	for (qd = 1; qd < max_qd; qd *= 2)
+		depths[nr_depths++] = qd;
+	depths[nr_depths++] = max_qd;
+
+	for (i = 0; i < nr_depths && !mmc_interrupted; i++) {
+		qd = depths[i];
+		ret = run_bench_job(&job, qd, seconds, &res);
+		if (ret) {
+			fprintf(stderr, "Benchmark failed: %s\n", strerror(-ret));
+			goto out;
+		}
+
+		points[n].qd = qd;
+		points[n].iops = res.iops;
+		points[n].mbps = res.mbps;
+		points[n].p50_us = percentile(res.lat_us, res.nr_lat, 50);
+		points[n].p99_us = percentile(res.lat_us, res.nr_lat, 99);
+		free(res.lat_us);
+
+		printf("%4u %10.1f %9.2f %9.3f %9.3f", qd, points[n].iops,
+		       points[n].mbps, points[n].p50_us / 1000.0,
+		       points[n].p99_us / 1000.0);
+		for (j = 0; j < nr_prev; j++) {
+			if (prev[j].qd != qd)
+				continue;
+			printf("   %*s  %+7.1f%% %+7.1f%%",
+			       (int)strlen(prev_state) + 3, "",
+			       pct_change(points[n].iops, prev[j].iops),
+			       pct_change(points[n].p99_us, prev[j].p99_us));
+		}
+		printf("\n");
+		n++;
+	}
+
+	if (report) {
+		out = fopen(report, "w");
+		if (!out) {
+			perror(report);
+			ret = 1;
+			goto out;
+		}
+		fprintf(out, "# mmc cmdq bench %s\n", device);
+		fprintf(out, "cmdq=%s\n", state_str);
+		fprintf(out, "cmdq_depth=%u\n", max_qd);
+		fprintf(out, "workload=%s\n", write ? "randrw70" : "randread");
+		for (i = 0; i < n; i++)
+			fprintf(out, "qd=%u iops=%.1f mbps=%.2f p50_us=%llu p99_us=%llu\n",
+				points[i].qd, points[i].iops, points[i].mbps,
+				points[i].p50_us, points[i].p99_us);
+		fclose(out);
+		printf("Report written to %s\n", report);
+	}
+
+out:
+	close(fd);
+	return ret ? 1 : 0;
+}
+
+#define WEAR_HISTORY_MAGIC	"MMCWEAR1"
+#define WEAR_LIFE_STEPS		10	/* DEVICE_LIFE_TIME_EST steps of 10% */
+
+/* One sample in the history file, which is a magic followed by these */
+struct wear_record {
+	__u64 time;		/* seconds since the epoch */
+	__u64 btime;		/* boot time, to detect stat counter resets */
+	__u64 host_sectors;	/* host writes, accumulated across reboots */
+	__u64 raw_sectors;	/* write sectors as read from the stat file */
+	__u8 life_a;
+	__u8 life_b;
+	__u8 pre_eol;
+	__u8 reserved[5];
+};
+
+static const char *const pre_eol_str[] = {
+	"Not defined", "Normal", "Warning", "Urgent",
+};
+
+static void print_life_time(const char *type, __u8 life)
+{
+	printf("Life time estimation %s: ", type);
+	if (!life)
+		printf("not defined\n");
+	else if (life <= WEAR_LIFE_STEPS)
+		printf("%d%% - %d%% used\n", (life - 1) * 10, life * 10);
+	else
+		printf("exceeded its maximum estimated life time\n");
+}
+
+/*
+ * Return: the number of records loaded into *recs, which the caller frees.
+ *         A missing history file is an empty history.
+ */
+static int load_wear_history(const char *path, struct wear_record **recs)
+{
+	char magic[sizeof(WEAR_HISTORY_MAGIC) - 1];
+	struct wear_record rec, *tmp;
+	int n = 0;
+	FILE *f;
+
+	*recs = NULL;
+	f = fopen(path, "rb");
+	if (!f) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		exit(1);
+	}
+
+	if (fread(magic, sizeof(magic), 1, f) != 1 ||
+	    memcmp(magic, WEAR_HISTORY_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "%s: not a wear history file\n", path);
+		exit(1);
+	}
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		tmp = realloc(*recs, (n + 1) * sizeof(rec));
+		if (!tmp) {
+			perror("realloc");
+			exit(1);
+		}
+		*recs = tmp;
+		(*recs)[n++] = rec;
+	}
+	fclose(f);
+
+	return n;
+}
+
+static void append_wear_record(const char *path, struct wear_record *rec)
+{
+	FILE *f;
+
+	make_state_dir(path);
+	f = fopen(path, "ab");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	/* A fresh file starts with the magic */
+	if (!ftell(f) && fwrite(WEAR_HISTORY_MAGIC,
+				sizeof(WEAR_HISTORY_MAGIC) - 1, 1, f) != 1) {
+		perror(path);
+		exit(1);
+	}
+	if (fwrite(rec, sizeof(*rec), 1, f) != 1 || fclose(f)) {
+		perror(path);
+		exit(1);
+	}
+}
+
+static void print_wear_history(const struct wear_record *recs, int n)
+{
+	char date[32];
+	time_t t;
+	int i;
+
+	printf("%-20s %14s %6s %6s %s\n", "time", "host_MiB", "life_a",
+	       "life_b", "pre_eol");
+	for (i = 0; i < n; i++) {
+		t = recs[i].time;
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+			 localtime(&t));
+		printf("%-20s %14llu %6u %6u %s\n", date,
+		       (unsigned long long)(recs[i].host_sectors >> 11),
+		       recs[i].life_a, recs[i].life_b,
+		       pre_eol_str[recs[i].pre_eol & 3]);
+	}
+}
+
+/*
+ * Life time only advances in 10% steps, so everything derived from it is
+ * bracketed: seeing d steps over the history means between d - 1 and d + 1
+ * steps worth of the rated endurance were really consumed.
+ */
+static void print_wear_estimates(const struct wear_record *first,
+				 const struct wear_record *now,
+				 __u64 capacity, unsigned int cycles)
+{
+	double days = (double)(now->time - first->time) / 86400;
+	double host = (double)(now->host_sectors - first->host_sectors) * 512;
+	double step_bytes, remaining;
+	int life_first, life_now, d;
+
+	life_first = first->life_a > first->life_b ?
+			first->life_a : first->life_b;
+	life_now = now->life_a > now->life_b ? now->life_a : now->life_b;
+	d = life_now - life_first;
+
+	printf("History: %.1f days, %.1f MiB written by the host (%.1f MiB/day)\n",
+	       days, host / (1 << 20), days > 0 ? host / (1 << 20) / days : 0);
+	if (days <= 0 || !life_now || !life_first) {
+		printf("Not enough history to estimate wear yet\n");
+		return;
+	}
+
+	if (!cycles) {
+		printf("Write amplification: pass -c <rated P/E cycles> to estimate\n");
+	} else if (host <= 0) {
+		printf("Write amplification: no host writes in the history\n");
+	} else {
+		step_bytes = (double)capacity * cycles / WEAR_LIFE_STEPS;
+		if (d > 0)
+			printf("Write amplification: ~%.1f (%.1f - %.1f)\n",
+			       d * step_bytes / host,
+			       (d - 1) * step_bytes / host,
+			       (d + 1) * step_bytes / host);
+		else
+			printf("Write amplification: < %.1f\n",
+			       step_bytes / host);
+	}
+
+	if (life_now > WEAR_LIFE_STEPS) {
+		printf("Projected time to EOL: reached\n");
+		return;
+	}
+
+	/* On average the current step is half consumed */
+	remaining = WEAR_LIFE_STEPS + 0.5 - life_now;
+	if (d > 1)
+		printf("Projected time to EOL: ~%.0f days (%.0f - %.0f)\n",
+		       remaining * days / d, remaining * days / (d + 1),
+		       remaining * days / (d - 1));
+	else if (d == 1)
+		printf("Projected time to EOL: ~%.0f days (at least %.0f)\n",
+		       remaining * days, remaining * days / 2);
+	else
+		printf("Projected time to EOL: > %.0f days\n",
+		       remaining * days);
+}
+
+int do_wear(int nargs, char **argv)
+{
+	__u8 ext_csd[512];
+	char path[PATH_MAX] = "";
+	struct wear_record *recs, now = {};
+	struct blk_stat st;
+	const struct wear_record *last;
+	unsigned int cycles = 0;
+	int fd, ret, n, c, dry_run = 0, list = 0;
+	char *device;
+
+	while ((c = getopt(nargs, argv, "f:c:nl")) != -1) {
+		switch (c) {
+		case 'f':
+			snprintf(path, sizeof(path), "%s", optarg);
+			break;
+		case 'c':
+			cycles = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: mmc wear [-f history] [-c cycles] [-n] [-l] </path/to/mmcblkX>\n");
+			exit(1);
+		}
+	}
+
+	if (nargs != optind + 1) {
+		fprintf(stderr, "Usage: mmc wear [-f history] [-c cycles] [-n] [-l] </path/to/mmcblkX>\n");
+		exit(1);
+	}
+	device = argv[optind];
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	close(fd);
+
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V5_0) {
+		fprintf(stderr, "%s doesn't report life time estimates (needs eMMC 5.0)\n",
+			device);
+		exit(1);
+	}
+
+	if (read_blk_stat(device, &st))
+		exit(1);
+
+	if (!path[0])
+		get_state_path(device, "wear", path, sizeof(path));
+	n = load_wear_history(path, &recs);
+
+	now.time = time(NULL);
+	now.btime = get_boot_time();
+	now.raw_sectors = st.wr_sectors;
+	now.host_sectors = st.wr_sectors;
+	now.life_a = ext_csd[EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_A];
+	now.life_b = ext_csd[EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_B];
+	now.pre_eol = ext_csd[EXT_CSD_PRE_EOL_INFO];
+
+	if (n) {
+		last = &recs[n - 1];
+		/* The stat counters start over from zero on every boot */
+		if (now.raw_sectors < last->raw_sectors ||
+		    rebooted_since(last->btime))
+			now.host_sectors = last->host_sectors + now.raw_sectors;
+		else
+			now.host_sectors = last->host_sectors +
+					   now.raw_sectors - last->raw_sectors;
+	}
+
+	if (list)
+		print_wear_history(recs, n);
+
+	print_life_time("A (SLC)", now.life_a);
+	print_life_time("B (MLC)", now.life_b);
+	printf("Pre EOL information: %s\n", pre_eol_str[now.pre_eol & 3]);
+
+	if (n)
+		print_wear_estimates(&recs[0], &now,
+				     get_sector_count(ext_csd) * 512ULL, cycles);
+	else
+		printf("No history yet in %s\n", path);
+
+	if (!dry_run)
+		append_wear_record(path, &now);
+
+	free(recs);
+	return 0;
+}
+
+#define EXPORTER_DEFAULT_INTERVAL_S	60
+#define EXPORTER_MAX_DEVICES		16
+
+/* Upper bounds in seconds, the last bucket is +Inf */
+static const double exporter_buckets[] = {
+	0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1,
+};
+
+struct latency_hist {
+	unsigned long long count;
+	unsigned long long buckets[ARRAY_SIZE(exporter_buckets) + 1];
+	double sum;
+};
+
+struct exporter_dev {
+	const char *device;
+	int fd;
+	bool up;
+	__u8 ext_csd[512];
+	__u32 status;
+	unsigned long long errors;
+	struct latency_hist extcsd_lat;
+	struct latency_hist status_lat;
+};
+
+static void latency_hist_observe(struct latency_hist *h, __u64 us)
+{
+	double s = us / 1e6;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(exporter_buckets); i++)
+		if (s <= exporter_buckets[i])
+			break;
+	h->buckets[i]++;
+	h->count++;
+	h->sum += s;
+}
+
+static void exporter_sample(struct exporter_dev *dev)
+{
+	__u64 start;
+	int ret;
+
+	start = get_time_us();
+	ret = read_extcsd(dev->fd, dev->ext_csd);
+	latency_hist_observe(&dev->extcsd_lat, get_time_us() - start);
+	if (ret) {
+		dev->errors++;
+		dev->up = false;
+		return;
+	}
+
+	start = get_time_us();
+	ret = send_status(dev->fd, &dev->status);
+	latency_hist_observe(&dev->status_lat, get_time_us() - start);
+	if (ret)
+		dev->errors++;
+	dev->up = !ret;
+}
+
+static void print_latency_hist(FILE *out, const char *device, const char *cmd,
+			       const struct latency_hist *h)
+{
+	unsigned long long cum = 0;
+	unsigned int i;
+
+	/* Prometheus buckets are cumulative */
+	for (i = 0; i < ARRAY_SIZE(exporter_buckets); i++) {
+		cum += h->buckets[i];
+		fprintf(out, "mmc_ioctl_duration_seconds_bucket{device=\"%s\",cmd=\"%s\",le=\"%g\"} %llu\n",
+			device, cmd, exporter_buckets[i], cum);
+	}
+	fprintf(out, "mmc_ioctl_duration_seconds_bucket{device=\"%s\",cmd=\"%s\",le=\"+Inf\"} %llu\n",
+		device, cmd, h->count);
+	fprintf(out, "mmc_ioctl_duration_seconds_sum{device=\"%s\",cmd=\"%s\"} %.6f\n",
+		device, cmd, h->sum);
+	fprintf(out, "mmc_ioctl_duration_seconds_count{device=\"%s\",cmd=\"%s\"} %llu\n",
+		device, cmd, h->count);
+}
+
+#define EXPORTER_GAUGE(out, devs, n, name, help, expr)			\
+	do {								\
+		int _i;							\
+		fprintf(out, "# HELP %s %s\n", name, help);		\
+		fprintf(out, "# TYPE %s gauge\n", name);		\
+		for (_i = 0; _i < (n); _i++) {				\
+			const struct exporter_dev *d = &(devs)[_i];	\
+			if (!d->up)					\
+				continue;				\
+			fprintf(out, name "{device=\"%s\"} %llu\n",	\
+				d->device, (unsigned long long)(expr));	\
+		}							\
+	} while (0)
+
+/* Renders the Prometheus text exposition format into a malloc'ed buffer */
+static char *exporter_render(const struct exporter_dev *devs, int n,
+			     size_t *len)
+{
+	char *buf = NULL;
+	FILE *out;
+	int i;
+
+	out = open_memstream(&buf, len);
+	if (!out) {
+		perror("open_memstream");
+		exit(1);
+	}
+
+	fprintf(out, "# HELP mmc_up Whether the last EXT_CSD and status reads succeeded.\n");
+	fprintf(out, "# TYPE mmc_up gauge\n");
+	for (i = 0; i < n; i++)
+		fprintf(out, "mmc_up{device=\"%s\"} %d\n", devs[i].device,
+			devs[i].up);
+
+	fprintf(out, "# HELP mmc_scrape_errors_total Failed EXT_CSD and status reads.\n");
+	fprintf(out, "# TYPE mmc_scrape_errors_total counter\n");
+	for (i = 0; i < n; i++)
+		fprintf(out, "mmc_scrape_errors_total{device=\"%s\"} %llu\n",
+			devs[i].device, devs[i].errors);
+
+	EXPORTER_GAUGE(out, devs, n, "mmc_life_time_estimate_a",
+		       "DEVICE_LIFE_TIME_EST_TYP_A, in 10% steps of life used.",
+		       d->ext_csd[EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_A]);
+	EXPORTER_GAUGE(out, devs, n, "mmc_life_time_estimate_b",
+		       "DEVICE_LIFE_TIME_EST_TYP_B, in 10% steps of life used.",
+		       d->ext_csd[EXT_CSD_DEVICE_LIFE_TIME_EST_TYP_B]);
+	EXPORTER_GAUGE(out, devs, n, "mmc_pre_eol_info",
+		       "PRE_EOL_INFO, 1 normal, 2 warning, 3 urgent.",
+		       d->ext_csd[EXT_CSD_PRE_EOL_INFO]);
+	EXPORTER_GAUGE(out, devs, n, "mmc_bkops_status",
+		       "BKOPS_STATUS, 0 none to 3 critical.",
+		       d->ext_csd[EXT_CSD_BKOPS_STATUS]);
+	EXPORTER_GAUGE(out, devs, n, "mmc_cache_size_bytes",
+		       "Size of the volatile cache.",
+		       get_cache_size_kib((__u8 *)d->ext_csd) * 1024ULL);
+	EXPORTER_GAUGE(out, devs, n, "mmc_cache_enabled",
+		       "Whether the volatile cache is turned on.",
+		       d->ext_csd[EXT_CSD_CACHE_CTRL] & 1);
+	EXPORTER_GAUGE(out, devs, n, "mmc_exception_events_status",
+		       "EXCEPTION_EVENTS_STATUS bits.",
+		       d->ext_csd[EXT_CSD_EXCEPTION_EVENTS_STATUS] |
+		       d->ext_csd[EXT_CSD_EXCEPTION_EVENTS_STATUS + 1] << 8);
+	EXPORTER_GAUGE(out, devs, n, "mmc_card_status",
+		       "R1 card status from CMD13.",
+		       d->status);
+
+	fprintf(out, "# HELP mmc_ioctl_duration_seconds Latency of the MMC ioctls issued by the exporter.\n");
+	fprintf(out, "# TYPE mmc_ioctl_duration_seconds histogram\n");
+	for (i = 0; i < n; i++) {
+		print_latency_hist(out, devs[i].device, "ext_csd",
+				   &devs[i].extcsd_lat);
+		print_latency_hist(out, devs[i].device, "status",
+				   &devs[i].status_lat);
+	}
+
+	if (fclose(out)) {
+		perror("render metrics");
+		exit(1);
+	}
+
+	return buf;
+}
+
+/* Written to a temporary file first, so collectors never see a partial file */
+static int exporter_write_textfile(const char *path, const char *buf,
+				   size_t len)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror(tmp);
+		return -1;
+	}
+	if (fwrite(buf, 1, len, f) != len || fclose(f)) {
+		perror(tmp);
+		unlink(tmp);
+		return -1;
+	}
+	if (rename(tmp, path)) {
+		perror(path);
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int exporter_listen(unsigned int port)
+{
+	struct sockaddr_in addr = {};
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		exit(1);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	/* Metrics are only served locally, put a proxy in front if needed */
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 8)) {
+		perror("bind");
+		exit(1);
+	}
+
+	return fd;
+}
+
+/* Any request gets the metrics, this is all a scraper needs */
+static void exporter_serve(int lfd, const char *buf, size_t len)
+{
+	char req[1024], hdr[128];
+	struct timeval tv = { .tv_sec = 1 };
+	ssize_t w;
+	int fd, n;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (read(fd, req, sizeof(req)) > 0) {
+		n = snprintf(hdr, sizeof(hdr),
+			     "HTTP/1.0 200 OK\r\n"
+			     "Content-Type: text/plain; version=0.0.4\r\n"
+			     "Content-Length: %zu\r\n\r\n", len);
+		/* A scraper hanging up early must not SIGPIPE us */
+		if (send(fd, hdr, n, MSG_NOSIGNAL) == n) {
+			while (len) {
+				w = send(fd, buf, len, MSG_NOSIGNAL);
+				if (w <= 0)
+					break;
+				buf += w;
+				len -= w;
+			}
+		}
+	}
+	close(fd);
+}
+
+int do_exporter(int nargs, char **argv)
+{
+	struct exporter_dev devs[EXPORTER_MAX_DEVICES] = {};
+	unsigned int interval = EXPORTER_DEFAULT_INTERVAL_S, port = 0;
+	const char *textfile = NULL;
+	struct pollfd pfd;
+	__u64 next, now;
+	size_t len = 0;
+	char *buf = NULL;
+	int c, i, n, lfd = -1, timeout;
+
+	while ((c = getopt(nargs, argv, "i:t:p:")) != -1) {
+		switch (c) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			textfile = optarg;
+			break;
+		case 'p':
+			port = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: mmc exporter [-i seconds] [-t textfile] [-p port] </path/to/mmcblkX>...\n");
+			exit(1);
+		}
+	}
+
+	n = nargs - optind;
+	if (n < 1 || n > EXPORTER_MAX_DEVICES || !interval ||
+	    port > 65535 || (!textfile && !port)) {
+		fprintf(stderr, "Usage: mmc exporter [-i seconds] [-t textfile] [-p port] </path/to/mmcblkX>...\n");
+		fprintf(stderr, "At least one of -t and -p is needed, and up to %d devices\n",
+			EXPORTER_MAX_DEVICES);
+		exit(1);
+	}
+
+	/* Devices stay open for the whole run, instead of once per scrape */
+	for (i = 0; i < n; i++) {
+		devs[i].device = argv[optind + i];
+		devs[i].fd = open(devs[i].device, O_RDWR);
+		if (devs[i].fd < 0) {
+			perror(devs[i].device);
+			exit(1);
+		}
+	}
+
+	if (port)
+		lfd = exporter_listen(port);
+	catch_interrupts();
+
+	next = get_time_us();
+	while (!mmc_interrupted) {
+		now = get_time_us();
+		if (now >= next) {
+			for (i = 0; i < n; i++)
+				exporter_sample(&devs[i]);
+			free(buf);
+			buf = exporter_render(devs, n, &len);
+			if (textfile)
+				exporter_write_textfile(textfile, buf, len);
+			next += interval * 1000000ULL;
+			if (next <= now)
+				next = now + interval * 1000000ULL;
+			continue;
+		}
+
+		timeout = (next - now + 999) / 1000;
+		if (lfd < 0) {
+			usleep(next - now);
+			continue;
+		}
+
+		pfd.fd = lfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout) > 0)
+			exporter_serve(lfd, buf, len);
+	}
+
+	if (lfd >= 0)
+		close(lfd);
+	for (i = 0; i < n; i++)
+		close(devs[i].fd);
+	free(buf);
+
+	return 0;
+}
+
+/* Used by the kernel too when GENERIC_CMD6_TIME isn't set */
+#define MMC_DEFAULT_CMD6_TIMEOUT_MS	500
+
+static const struct power_notification {
+	const char *name;
+	__u8 value;
+} power_notifications[] = {
+	{ "on", EXT_CSD_POWER_ON },
+	{ "short", EXT_CSD_POWER_OFF_SHORT },
+	{ "long", EXT_CSD_POWER_OFF_LONG },
+	{ "sleep", EXT_CSD_SLEEP_NOTIFICATION },
+};
+
+static unsigned int get_cmd6_timeout_ms(__u8 *ext_csd)
+{
+	/* GENERIC_CMD6_TIME is in units of 10ms */
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V4_5 ||
+	    !ext_csd[EXT_CSD_GENERIC_CMD6_TIME])
+		return MMC_DEFAULT_CMD6_TIMEOUT_MS;
+
+	return ext_csd[EXT_CSD_GENERIC_CMD6_TIME] * 10;
+}
+
+/* Return: the timeout in us the device specifies for @value */
+static __u64 get_power_notification_timeout_us(__u8 *ext_csd, __u8 value)
+{
+	__u8 n;
+
+	switch (value) {
+	case EXT_CSD_POWER_OFF_LONG:
+		/* POWER_OFF_LONG_TIME is in units of 10ms */
+		return ext_csd[EXT_CSD_POWER_OFF_LONG_TIME] * 10000ull;
+	case EXT_CSD_SLEEP_NOTIFICATION:
+		/* SLEEP_NOTIFICATION_TIME is 10us * 2^n, n at most 0x17 */
+		n = ext_csd[EXT_CSD_SLEEP_NOTIFICATION_TIME];
+		return n ? 10ull << (n > 0x17 ? 0x17 : n) : 0;
+	default:
+		return get_cmd6_timeout_ms(ext_csd) * 1000ull;
+	}
+}
+
+/* S_A_TIMEOUT is 100ns * 2^n, n at most 0x17, rounded up to whole ms */
+static unsigned int get_sleep_awake_timeout_ms(__u8 *ext_csd)
+{
+	__u8 n = ext_csd[EXT_CSD_S_A_TIMEOUT];
+
+	if (!n)
+		return 0;
+	if (n > 0x17)
+		n = 0x17;
+
+	return ((100ull << n) + 999999) / 1000000;
+}
+
+static int get_card_rca(const char *device, unsigned int *rca)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "/sys/class/block/%s/device/rca",
+		 blk_dev_name(device));
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	ret = fscanf(f, "%x", rca) == 1 ? 0 : -1;
+	fclose(f);
+	if (ret)
+		fprintf(stderr, "Could not parse %s\n", path);
+
+	return ret;
+}
+
+/*
+ * Sends the POWER_OFF_NOTIFICATION switch without busy wait and polls the
+ * device out of PRG state ourselves, to see how long it really takes.
+ */
+static int power_notify(int fd, __u8 *ext_csd, __u8 value, __u64 *elapsed_us)
+{
+	struct mmc_ioc_cmd idata = {};
+	__u64 start, limit_us, deadline;
+	__u32 status;
+	int ret;
+
+	limit_us = get_power_notification_timeout_us(ext_csd, value);
+
+	fill_switch_cmd(&idata, EXT_CSD_POWER_OFF_NOTIFICATION, value);
+	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+
+	start = get_time_us();
+	ret = mmc_ioctl(fd, MMC_IOC_CMD, &idata);
+	if (ret) {
+		perror("ioctl");
+		return ret;
+	}
+
+	/* give a device that misses its own limit the benefit of the doubt */
+	deadline = start + (limit_us ? limit_us : 1000000) * 10;
+	ret = wait_while_prg(fd, 100, deadline_passed, &deadline, &status);
+	*elapsed_us = get_time_us() - start;
+	if (ret) {
+		fprintf(stderr, "Device still busy after %llu ms\n",
+			*elapsed_us / 1000);
+		return -EIO;
+	}
+
+	/* the switch result shows up in the CMD13 after busy cleared */
+	if (status & R1_SWITCH_ERROR) {
+		fprintf(stderr, "Device refused POWER_OFF_NOTIFICATION 0x%02x\n",
+			value);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void print_power_timing(const char *what, __u64 elapsed_us,
+			       __u64 limit_us)
+{
+	printf("%s took %.3f ms", what, elapsed_us / 1000.0);
+	if (limit_us)
+		printf(" (limit %.3f ms)%s", limit_us / 1000.0,
+		       elapsed_us > limit_us ? ", EXCEEDED" : "");
+	printf("\n");
+}
+
+/*
+ * Deselect (CMD7 to RCA 0) and CMD5 go out back to back in one request, so
+ * nothing else is sent to the device in between.
+ */
+static int sleep_awake(int fd, __u8 *ext_csd, unsigned int rca, bool sleep,
+		       __u64 *elapsed_us)
+{
+	struct mmc_ioc_multi_cmd *mioc;
+	struct mmc_ioc_cmd *cmd;
+	__u64 start;
+	int ret;
+
+	mioc = calloc(1, sizeof(*mioc) + 2 * sizeof(struct mmc_ioc_cmd));
+	if (!mioc) {
+		perror("calloc");
+		exit(1);
+	}
+	mioc->num_of_cmds = 2;
+
+	cmd = &mioc->cmds[sleep ? 0 : 1];
+	cmd->opcode = MMC_SELECT_CARD;
+	cmd->arg = sleep ? 0 : rca << 16;
+	cmd->flags = sleep ? MMC_RSP_NONE | MMC_CMD_AC :
+			     MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	cmd->cmd_timeout_ms = get_cmd6_timeout_ms(ext_csd);
+
+	cmd = &mioc->cmds[sleep ? 1 : 0];
+	cmd->opcode = MMC_SLEEP_AWAKE;
+	cmd->arg = rca << 16 | (sleep ? MMC_SLEEP_ARG : 0);
+	cmd->flags = MMC_RSP_R1B | MMC_CMD_AC;
+	cmd->cmd_timeout_ms = get_sleep_awake_timeout_ms(ext_csd);
+
+	start = get_time_us();
+	ret = mmc_ioctl(fd, MMC_IOC_MULTI_CMD, mioc);
+	*elapsed_us = get_time_us() - start;
+	if (ret)
+		perror("ioctl");
+
+	free(mioc);
+	return ret;
+}
+
+int do_power_notify(int nargs, char **argv)
+{
+	const struct power_notification *pn = NULL;
+	__u8 ext_csd[512];
+	__u64 elapsed_us;
+	unsigned int i, rca = 0;
+	int fd, ret;
+	char *device;
+
+	if (nargs != 3) {
+		fprintf(stderr, "Usage: mmc power notify <on|short|long|sleep> </path/to/mmcblkX>\n");
+		exit(1);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(power_notifications); i++)
+		if (!strcmp(argv[1], power_notifications[i].name))
+			pn = &power_notifications[i];
+	if (!pn) {
+		fprintf(stderr, "Unknown power notification '%s'\n", argv[1]);
+		exit(1);
+	}
+	device = argv[2];
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V4_5) {
+		fprintf(stderr, "%s doesn't support power off notification (needs eMMC 4.5)\n",
+			device);
+		exit(1);
+	}
+	if (pn->value == EXT_CSD_SLEEP_NOTIFICATION &&
+	    ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V5_0)
+		printf("Sleep notification needs eMMC 5.0, going to sleep without it\n");
+
+	/* Look up the RCA before the device stops answering */
+	if (pn->value == EXT_CSD_SLEEP_NOTIFICATION &&
+	    get_card_rca(device, &rca))
+		exit(1);
+
+	/* Notifications only take effect once the host declared POWERED_ON */
+	if (pn->value != EXT_CSD_POWER_ON &&
+	    ext_csd[EXT_CSD_POWER_OFF_NOTIFICATION] == EXT_CSD_NO_POWER_NOTIFICATION) {
+		ret = power_notify(fd, ext_csd, EXT_CSD_POWER_ON, &elapsed_us);
+		if (ret)
+			exit(1);
+		print_power_timing("POWERED_ON", elapsed_us,
+				   get_power_notification_timeout_us(ext_csd,
+							EXT_CSD_POWER_ON));
+	}
+
+	if (pn->value != EXT_CSD_SLEEP_NOTIFICATION ||
+	    ext_csd[EXT_CSD_REV] >= EXT_CSD_REV_V5_0) {
+		ret = power_notify(fd, ext_csd, pn->value, &elapsed_us);
+		if (ret)
+			exit(1);
+		print_power_timing("Notification", elapsed_us,
+				   get_power_notification_timeout_us(ext_csd,
+								     pn->value));
+	}
+
+	if (pn->value == EXT_CSD_SLEEP_NOTIFICATION) {
+		ret = sleep_awake(fd, ext_csd, rca, true, &elapsed_us);
+		if (ret)
+			exit(1);
+		print_power_timing("Sleep", elapsed_us,
+				   get_sleep_awake_timeout_ms(ext_csd) * 1000ull);
+		printf("%s is asleep, wake it up with 'mmc power awake' before any I/O\n",
+		       device);
+	} else if (pn->value != EXT_CSD_POWER_ON) {
+		printf("%s is ready to lose power\n", device);
+	}
+
+	close(fd);
+	return 0;
+}
+
+int do_power_awake(int nargs, char **argv)
+{
+	__u8 ext_csd[512] = {};
+	unsigned int rca;
+	__u64 elapsed_us;
+	int fd, ret;
+	char *device;
+
+	if (nargs != 2) {
+		fprintf(stderr, "Usage: mmc power awake </path/to/mmcblkX>\n");
+		exit(1);
+	}
+	device = argv[1];
+
+	if (get_card_rca(device, &rca))
+		exit(1);
+
+	/*
+	 * A sleeping device can't be asked for its EXT_CSD, so allow for the
+	 * largest S_A_TIMEOUT there is.
+	 */
+	ext_csd[EXT_CSD_S_A_TIMEOUT] = 0x17;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	ret = sleep_awake(fd, ext_csd, rca, false, &elapsed_us);
+	if (ret)
+		exit(1);
+	print_power_timing("Awake", elapsed_us, 0);
+
+	close(fd);
+	return 0;
+}
+
+#define BOOT_IMAGE_CHUNK	(1024 * 1024)
+
+/* The kernel exposes the boot areas as e.g. mmcblk0boot0 and mmcblk0boot1 */
+static void get_boot_part_path(const char *device, int part, char *path,
+			       size_t len)
+{
+	snprintf(path, len, "%sboot%d", device, part);
+}
+
+static int parse_boot_part(const char *arg)
+{
+	if (strcmp(arg, "0") && strcmp(arg, "1")) {
+		fprintf(stderr, "Boot partition must be 0 or 1, not '%s'\n",
+			arg);
+		exit(1);
+	}
+
+	return arg[0] - '0';
+}
+
+/*
+ * Return: the previous force_ro value of the boot partition at @path, so it
+ *         can be restored, or -1 on error.
+ */
+static int set_boot_force_ro(const char *path, int ro)
+{
+	char sysfs[PATH_MAX];
+	unsigned long long old;
+	FILE *f;
+
+	snprintf(sysfs, sizeof(sysfs), "/sys/class/block/%s/force_ro",
+		 blk_dev_name(path));
+	if (read_sysfs_ull(sysfs, &old)) {
+		perror(sysfs);
+		return -1;
+	}
+	if (old == (unsigned long long)ro)
+		return old;
+
+	f = fopen(sysfs, "w");
+	if (!f || fprintf(f, "%d", ro) < 0 || fclose(f)) {
+		perror(sysfs);
+		return -1;
+	}
+
+	return old;
+}
+
+static void *alloc_boot_chunk(void)
+{
+	void *buf;
+
+	/* O_DIRECT needs buffers aligned to the logical block size */
+	if (posix_memalign(&buf, 4096, BOOT_IMAGE_CHUNK)) {
+		fprintf(stderr, "Could not allocate the I/O buffer\n");
+		exit(1);
+	}
+
+	return buf;
+}
+
+/*
+ * Logical block size of the boot partition open at @fd, 4 KiB when
+ * DATA_SECTOR_SIZE is set. O_DIRECT transfers are whole blocks of it.
+ */
+static size_t get_boot_block_size(int fd)
+{
+	int bs;
+
+	if (ioctl(fd, BLKSSZGET, &bs) || bs < 512 || bs > 4096)
+		return 512;
+
+	return bs;
+}
+
+static void print_sha256(const char *what, const unsigned char *digest)
+{
+	int i;
+
+	printf("%s sha256: ", what);
+	for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+		printf("%02x", digest[i]);
+	printf("\n");
+}
+
+/* Size of the boot partitions, from BOOT_SIZE_MULT in units of 128K */
+static __u64 get_boot_part_size(const char *device)
+{
+	__u8 ext_csd[512];
+	int fd;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	if (read_extcsd(fd, ext_csd)) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	close(fd);
+
+	return ext_csd[EXT_CSD_BOOT_MULT] * 128 * 1024ULL;
+}
+
+/*
+ * Streams the first @len bytes of the boot partition at @path through
+ * SHA-256, and into @out_fd unless that is negative.
+ */
+static int hash_boot_part(const char *path, __u64 len, int out_fd,
+			  unsigned char *digest)
+{
+	sha256_ctx ctx;
+	__u8 *buf;
+	__u64 done = 0;
+	size_t n, blocks, bs;
+	ssize_t r;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_DIRECT);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	bs = get_boot_block_size(fd);
+
+	buf = alloc_boot_chunk();
+	sha256_init(&ctx);
+	while (done < len) {
+		n = len - done < BOOT_IMAGE_CHUNK ? len - done : BOOT_IMAGE_CHUNK;
+		/* O_DIRECT reads whole blocks, hash only what was asked for */
+		blocks = (n + bs - 1) / bs * bs;
+		r = DO_IO(read, fd, buf, blocks);
+		if (r < (ssize_t)n) {
+			fprintf(stderr, "%s: short read at %llu\n", path,
+				(unsigned long long)done);
+			break;
+		}
+		sha256_update(&ctx, buf, n);
+		if (out_fd >= 0 && DO_IO(write, out_fd, buf, n) != (ssize_t)n) {
+			perror("write image");
+			break;
+		}
+		done += n;
+	}
+	sha256_final(&ctx, digest);
+
+	free(buf);
+	close(fd);
+
+	return done == len ? 0 : -1;
+}
+
+/*
+ * Streams @image_fd to the boot partition at @path in large O_DIRECT writes,
+ * hashing it on the way. The tail is padded with zeros to a whole block.
+ */
+static int write_boot_part(int image_fd, const char *path, __u64 *len,
+			   unsigned char *digest)
+{
+	sha256_ctx ctx;
+	__u8 *buf;
+	ssize_t r, n, bs;
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY | O_DIRECT);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	bs = get_boot_block_size(fd);
+
+	buf = alloc_boot_chunk();
+	sha256_init(&ctx);
+	*len = 0;
+	while ((r = DO_IO(read, image_fd, buf, BOOT_IMAGE_CHUNK)) > 0) {
+		sha256_update(&ctx, buf, r);
+		n = (r + bs - 1) / bs * bs;
+		memset(buf + r, 0, n - r);
+		if (DO_IO(write, fd, buf, n) != n) {
+			perror(path);
+			ret = -1;
+			break;
+		}
+		*len += r;
+	}
+	if (r < 0) {
+		perror("read image");
+		ret = -1;
+	}
+	sha256_final(&ctx, digest);
+
+	if (!ret && fsync(fd)) {
+		perror("fsync");
+		ret = -1;
+	}
+
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+/* Makes @part the boot partition, leaving BOOT_ACK and access alone */
+static int enable_boot_part(const char *device, int part)
+{
+	__u8 ext_csd[512], value;
+	int fd, ret;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+	if (read_extcsd(fd, ext_csd)) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+
+	value = ext_csd[EXT_CSD_PART_CONFIG] & ~(7 << 3);
+	value |= (part == 0 ? EXT_CSD_PART_CONFIG_ACC_BOOT0 :
+			      EXT_CSD_PART_CONFIG_ACC_BOOT1) << 3;
+	ret = write_extcsd_value(fd, EXT_CSD_PART_CONFIG, value, 0);
+	if (ret)
+		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
+			value, EXT_CSD_PART_CONFIG, device);
+	close(fd);
+
+	return ret;
+}
+
+int do_boot_image_write(int nargs, char **argv)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE], check[SHA256_DIGEST_SIZE];
+	char path[PATH_MAX];
+	struct stat st;
+	__u64 part_size, len, start;
+	int c, part, image_fd, old_ro, ret, enable = 0;
+	char *image, *device;
+
+	while ((c = getopt(nargs, argv, "e")) != -1) {
+		switch (c) {
+		case 'e':
+			enable = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: mmc boot image write [-e] <image> </path/to/mmcblkX> <0|1>\n");
+			exit(1);
+		}
+	}
+	if (nargs != optind + 3) {
+		fprintf(stderr, "Usage: mmc boot image write [-e] <image> </path/to/mmcblkX> <0|1>\n");
+		exit(1);
+	}
+	image = argv[optind];
+	device = argv[optind + 1];
+	part = parse_boot_part(argv[optind + 2]);
+	get_boot_part_path(device, part, path, sizeof(path));
+
+	image_fd = open(image, O_RDONLY);
+	if (image_fd < 0 || fstat(image_fd, &st)) {
+		perror(image);
+		exit(1);
+	}
+	part_size = get_boot_part_size(device);
+	if ((__u64)st.st_size > part_size) {
+		fprintf(stderr, "%s is %lld bytes, the boot partition only %llu\n",
+			image, (long long)st.st_size,
+			(unsigned long long)part_size);
+		exit(1);
+	}
+
+	old_ro = set_boot_force_ro(path, 0);
+	if (old_ro < 0)
+		exit(1);
+
+	start = get_time_us();
+	ret = write_boot_part(image_fd, path, &len, digest);
+	if (old_ro)
+		set_boot_force_ro(path, old_ro);
+	close(image_fd);
+	if (ret)
+		exit(1);
+	printf("Wrote %llu bytes to %s in %.2f s\n", (unsigned long long)len,
+	       path, (get_time_us() - start) / 1e6);
+	print_sha256("Image", digest);
+
+	/* Read back through O_DIRECT, so the check can't hit the page cache */
+	if (hash_boot_part(path, len, -1, check))
+		exit(1);
+	print_sha256("Partition", check);
+	if (memcmp(digest, check, sizeof(digest))) {
+		fprintf(stderr, "Verification of %s FAILED\n", path);
+		exit(1);
+	}
+	printf("Verified\n");
+
+	if (enable) {
+		if (enable_boot_part(device, part))
+			exit(1);
+		printf("Boot partition %d enabled\n", part);
+	}
+
+	return 0;
+}
+
+int do_boot_image_read(int nargs, char **argv)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	char path[PATH_MAX];
+	__u64 len = 0;
+	int c, part, image_fd;
+	char *image, *device;
+
+	while ((c = getopt(nargs, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			len = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: mmc boot image read [-n bytes] <image> </path/to/mmcblkX> <0|1>\n");
+			exit(1);
+		}
+	}
+	if (nargs != optind + 3) {
+		fprintf(stderr, "Usage: mmc boot image read [-n bytes] <image> </path/to/mmcblkX> <0|1>\n");
+		exit(1);
+	}
+	image = argv[optind];
+	device = argv[optind + 1];
+	part = parse_boot_part(argv[optind + 2]);
+	get_boot_part_path(device, part, path, sizeof(path));
+
+	if (!len || len > get_boot_part_size(device))
+		len = get_boot_part_size(device);
+
+	image_fd = open(image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (image_fd < 0) {
+		perror(image);
+		exit(1);
+	}
+	if (hash_boot_part(path, len, image_fd, digest) || fsync(image_fd))
+		exit(1);
+	close(image_fd);
+
+	printf("Read %llu bytes from %s\n", (unsigned long long)len, path);
+	print_sha256("Image", digest);
+
+	return 0;
+}
+
+int do_boot_image_verify(int nargs, char **argv)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE], check[SHA256_DIGEST_SIZE];
+	char path[PATH_MAX];
+	sha256_ctx ctx;
+	__u64 len = 0;
+	__u8 *buf;
+	ssize_t r;
+	int part, image_fd;
+
+	if (nargs != 4) {
+		fprintf(stderr, "Usage: mmc boot image verify <image> </path/to/mmcblkX> <0|1>\n");
+		exit(1);
+	}
+	part = parse_boot_part(argv[3]);
+	get_boot_part_path(argv[2], part, path, sizeof(path));
+
+	image_fd = open(argv[1], O_RDONLY);
+	if (image_fd < 0) {
+		perror(argv[1]);
+		exit(1);
+	}
+
+	buf = alloc_boot_chunk();
+	sha256_init(&ctx);
+	while ((r = DO_IO(read, image_fd, buf, BOOT_IMAGE_CHUNK)) > 0) {
+		sha256_update(&ctx, buf, r);
+		len += r;
+	}
+	if (r < 0) {
+		perror(argv[1]);
+		exit(1);
+	}
+	sha256_final(&ctx, digest);
+	free(buf);
+	close(image_fd);
+
+	if (len > get_boot_part_size(argv[2])) {
+		fprintf(stderr, "%s is larger than the boot partition\n",
+			argv[1]);
+		exit(1);
+	}
+	if (hash_boot_part(path, len, -1, check))
+		exit(1);
+
+	print_sha256("Image", digest);
+	print_sha256("Partition", check);
+	if (memcmp(digest, check, sizeof(digest))) {
+		printf("%s does NOT match the first %llu bytes of %s\n",
+		       argv[1], (unsigned long long)len, path);
+		return 1;
+	}
+	printf("%s matches the first %llu bytes of %s\n", argv[1],
+	       (unsigned long long)len, path);
+
+	return 0;
+}
+
+/* Used when EXT_CSD doesn't let us compute the erase timeout */
+#define MMC_ERASE_MAX_TIMEOUT_MS	(300 * 255 * 255)
+
+struct erase_type {
+	const char *name;
+	const char *desc;
+	__u32 arg;
+	__u8 sec_feature;	/* required SEC_FEATURE_SUPPORT bits */
+	bool group_granular;	/* acts on whole erase groups */
+};
+
+static const struct erase_type erase_types[] = {
+	{ "legacy", "Legacy Erase", MMC_ERASE_ARG, 0, true },
+	{ "discard", "Discard", MMC_DISCARD_ARG, 0, false },
+	{ "secure-erase", "Secure Erase", MMC_SECURE_ERASE_ARG,
+	  EXT_CSD_SEC_ER_EN, true },
+	{ "secure-trim1", "Secure Trim Step 1", MMC_SECURE_TRIM1_ARG,
+	  EXT_CSD_SEC_ER_EN | EXT_CSD_SEC_GB_CL_EN, false },
+	{ "secure-trim2", "Secure Trim Step 2", MMC_SECURE_TRIM2_ARG,
+	  EXT_CSD_SEC_ER_EN | EXT_CSD_SEC_GB_CL_EN, false },
+	{ "trim", "Trim", MMC_TRIM_ARG, EXT_CSD_SEC_GB_CL_EN, false },
+};
+
+static const struct erase_type *find_erase_type(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(erase_types); i++)
+		if (!strcmp(erase_types[i].name, name))
+			return &erase_types[i];
+
+	return NULL;
+}
+
+static const char *erase_type_unsupported(__u8 *ext_csd,
+					  const struct erase_type *type)
+{
+	if ((ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT] & type->sec_feature) !=
+	    type->sec_feature)
+		return "not supported";
+	if (type->arg == MMC_DISCARD_ARG &&
+	    ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V4_5)
+		return "needs eMMC4.5";
+
+	return NULL;
+}
+
+/* Erase group size, in units of the CMD35/CMD36 address */
+static __u32 get_erase_grp_size(__u8 *ext_csd)
+{
+	/* HC_ERASE_GRP_SIZE is in units of 512KiB */
+	__u32 size = get_hc_erase_grp_size(ext_csd) * 1024;
+
+	if (!size)
+		size = 1;
+	if (!is_blockaddresed(ext_csd))
+		size *= 512;
+
+	return size;
+}
+
+static __u32 get_erase_grp_count(__u8 *ext_csd, __u32 start, __u32 end)
+{
+	__u32 grp = get_erase_grp_size(ext_csd);
+
+	return end / grp - start / grp + 1;
+}
+
+/*
+ * Worst case duration of a single CMD38 over [start, end], computed the same
+ * way as the kernel does it. Returns 0 if EXT_CSD doesn't define it.
+ */
+static __u64 get_erase_timeout_ms(__u8 *ext_csd, __u32 arg, __u32 start,
+				  __u32 end)
+{
+	__u64 timeout;
+	unsigned int mult;
+
+	/* trim, discard and both secure trim steps are timed as trims */
+	if (arg & MMC_TRIM_ARGS)
+		timeout = 300 * ext_csd[EXT_CSD_TRIM_MULT];
+	else if (ext_csd[EXT_CSD_ERASE_GROUP_DEF] & 0x01)
+		timeout = 300 * ext_csd[EXT_CSD_ERASE_TIMEOUT_MULT];
+	else
+		return 0;
+
+	if (arg & MMC_SECURE_ARGS) {
+		if (arg == MMC_SECURE_ERASE_ARG)
+			mult = ext_csd[EXT_CSD_SEC_ERASE_MULT];
+		else
+			mult = ext_csd[EXT_CSD_SEC_TRIM_MULT];
+		timeout *= mult;
+	}
+
+	return timeout * get_erase_grp_count(ext_csd, start, end);
+}
+
+/*
+ * Erases [@start, @end] with an R1B CMD38, so the host waits out the erase.
+ * With @interruptible, and HPI usable, CMD38 is R1 instead and polled for, so
+ * Ctrl-C or exceeding the EXT_CSD timeout interrupts it with HPI.
+ */
+static int erase_range(int dev_fd, __u8 *ext_csd, __u32 argin, __u32 start,
+		       __u32 end, bool interruptible)
+{
+	int ret = 0;
+	struct mmc_ioc_multi_cmd *multi_cmd;
+	__u64 timeout_ms;
+
+	timeout_ms = get_erase_timeout_ms(ext_csd, argin, start, end);
+	if (!timeout_ms)
+		timeout_ms = MMC_ERASE_MAX_TIMEOUT_MS;
+	if (timeout_ms > UINT_MAX)
+		timeout_ms = UINT_MAX;
+
+	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+			   3 * sizeof(struct mmc_ioc_cmd));
+	if (!multi_cmd) {
+		perror("Failed to allocate memory");
+		return -ENOMEM;
+	}
+
+	multi_cmd->num_of_cmds = 3;
+	/* Set erase start address */
+	multi_cmd->cmds[0].opcode = MMC_ERASE_GROUP_START;
+	multi_cmd->cmds[0].arg = start;
+	multi_cmd->cmds[0].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+	multi_cmd->cmds[0].write_flag = 1;
+
+	/* Set erase end address */
+	multi_cmd->cmds[1].opcode = MMC_ERASE_GROUP_END;
+	multi_cmd->cmds[1].arg = end;
+	multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+	multi_cmd->cmds[1].write_flag = 1;
+
+	/* Send Erase Command */
+	multi_cmd->cmds[2].opcode = MMC_ERASE;
+	multi_cmd->cmds[2].arg = argin;
+	multi_cmd->cmds[2].cmd_timeout_ms = timeout_ms;
+	multi_cmd->cmds[2].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	multi_cmd->cmds[2].write_flag = 1;
+
+	if (interruptible && !hpi_prepare(dev_fd, ext_csd)) {
+		fprintf(stderr, "HPI is not supported, the erase can't be interrupted\n");
+		interruptible = false;
+	}
+	/* poll for completion ourselves, so it can be interrupted with HPI */
+	if (interruptible)
+		multi_cmd->cmds[2].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 |
+					   MMC_CMD_AC;
+
+	/* send erase cmd with multi-cmd */
+	ret = mmc_ioctl(dev_fd, MMC_IOC_MULTI_CMD, multi_cmd);
+	if (ret)
+		perror("Erase multi-cmd ioctl");
+	else if (interruptible)
+		ret = wait_busy_or_hpi(dev_fd, ext_csd, 1000, timeout_ms);
+
+	/* Does not work for SPI cards */
+	if (multi_cmd->cmds[1].response[0] & R1_ERASE_PARAM) {
+		fprintf(stderr, "Erase start response: 0x%08x\n",
+				multi_cmd->cmds[0].response[0]);
+		ret = -EIO;
+	}
+	if (multi_cmd->cmds[2].response[0] & R1_ERASE_SEQ_ERROR) {
+		fprintf(stderr, "Erase response: 0x%08x\n",
+				multi_cmd->cmds[2].response[0]);
+		ret = -EIO;
+	}
+
+	free(multi_cmd);
+	return ret;
+}
+
+static int erase(int dev_fd, __u32 argin, __u32 start, __u32 end,
+		 bool interruptible)
+{
+	__u8 ext_csd[512];
+	int ret;
+
+	ret = read_extcsd(dev_fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD\n");
+		exit(1);
+	}
+	if (ext_csd[EXT_CSD_ERASE_GROUP_DEF] & 0x01) {
+	  fprintf(stderr, "High Capacity Erase Unit Size=%d bytes\n" \
+                          "High Capacity Erase Timeout=%d ms\n" \
+                          "High Capacity Write Protect Group Size=%d bytes\n",
+			   ext_csd[224]*0x80000,
+			   ext_csd[223]*300,
+                           ext_csd[221]*ext_csd[224]*0x80000);
+	}
+
+	return erase_range(dev_fd, ext_csd, argin, start, end, interruptible);
+}
+
+/* [start, end] in 512 byte sectors */
+struct sector_range {
+	__u64 start;
+	__u64 end;
+};
+
+struct range_list {
+	struct sector_range *r;
+	size_t n;
+	size_t cap;
+};
+
+static void range_list_add(struct range_list *l, __u64 start, __u64 count)
+{
+	struct sector_range *tmp;
+
+	if (!count)
+		return;
+	if (l->n == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 1024;
+		tmp = realloc(l->r, l->cap * sizeof(*tmp));
+		if (!tmp) {
+			perror("realloc");
+			exit(1);
+		}
+		l->r = tmp;
+	}
+	l->r[l->n].start = start;
+	l->r[l->n].end = start + count - 1;
+	l->n++;
+}
+
+static int cmp_sector_range(const void *a, const void *b)
+{
+	const struct sector_range *x = a, *y = b;
+
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sorts and merges overlapping or adjacent ranges, clips them to the
+ * @size sectors of the device and shrinks each one to whole units of
+ * @align sectors, dropping those left empty.
+ */
+static void range_list_coalesce(struct range_list *l, __u64 size,
+				__u32 align)
+{
+	size_t i, n = 0;
+	__u64 start, end;
+
+	qsort(l->r, l->n, sizeof(*l->r), cmp_sector_range);
+	for (i = 0; i < l->n; i++) {
+		if (n && l->r[i].start <= l->r[n - 1].end + 1) {
+			if (l->r[i].end > l->r[n - 1].end)
+				l->r[n - 1].end = l->r[i].end;
+			continue;
+		}
+		l->r[n++] = l->r[i];
+	}
+	l->n = n;
+
+	for (i = 0, n = 0; i < l->n; i++) {
+		start = (l->r[i].start + align - 1) / align * align;
+		end = l->r[i].end < size ? l->r[i].end + 1 : size;
+		end = end / align * align;
+		if (end <= start)
+			continue;
+		l->r[n].start = start;
+		l->r[n].end = end - 1;
+		n++;
+	}
+	l->n = n;
+}
+
+/* Read size of the erase verify pass, and the unit it samples */
+#define ERASE_VERIFY_CHUNK	(1024 * 1024)
+#define ERASE_VERIFY_MAX_JOBS	64
+
+struct erase_verify_job {
+	int fd;
+	__u64 end;		/* bytes */
+	__u64 *chunks;		/* offsets of the chunks to read, sorted */
+	size_t nr_chunks;
+	size_t next;
+	__u8 expect;
+};
+
+struct erase_verify_worker {
+	pthread_t thread;
+	struct erase_verify_job *job;
+	void *buf;
+	struct range_list bad;	/* sectors not reading back as expected */
+	__u64 bytes;
+	int err;
+};
+
+static void *erase_verify_worker_fn(void *arg)
+{
+	struct erase_verify_worker *w = arg;
+	struct erase_verify_job *job = w->job;
+	__u8 *p, *buf = w->buf;
+	size_t i, len, s;
+	ssize_t ret;
+	__u64 off;
+
+	while (!mmc_interrupted) {
+		i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->nr_chunks)
+			break;
+		off = job->chunks[i];
+		len = job->end - off < ERASE_VERIFY_CHUNK ?
+		      job->end - off : ERASE_VERIFY_CHUNK;
+
+		ret = pread(job->fd, buf, len, off);
+		if (ret != len) {
+			w->err = ret < 0 ? errno : EIO;
+			break;
+		}
+		w->bytes += len;
+
+		for (s = 0; s < len; s += 512) {
+			p = buf + s;
+			/* p[0] matches and p[1..511] equal p[0..510] */
+			if (p[0] == job->expect && !memcmp(p, p + 1, 511))
+				continue;
+			if (w->bad.n &&
+			    w->bad.r[w->bad.n - 1].end + 1 == (off + s) / 512)
+				w->bad.r[w->bad.n - 1].end++;
+			else
+				range_list_add(&w->bad, (off + s) / 512, 1);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Reads back [@start, @end) bytes of @path with @jobs O_DIRECT threads, all
+ * of it or a random @pct percent of its chunks, and collects the sectors that
+ * aren't all @expect into @bad.
+ */
+static int erase_verify_read(const char *path, __u64 start, __u64 end,
+			     unsigned int pct, unsigned int jobs, __u8 expect,
+			     struct range_list *bad, __u64 *bytes)
+{
+	struct erase_verify_job job = {};
+	struct erase_verify_worker *w;
+	size_t i, j, n;
+	__u64 tmp;
+	int err = 0;
+
+	*bytes = 0;
+	job.fd = open(path, O_RDONLY | O_DIRECT);
+	if (job.fd < 0) {
+		perror(path);
+		return -errno;
+	}
+	job.end = end;
+	job.expect = expect;
+
+	n = (end - start + ERASE_VERIFY_CHUNK - 1) / ERASE_VERIFY_CHUNK;
+	job.chunks = calloc(n ? n : 1, sizeof(*job.chunks));
+	w = calloc(jobs, sizeof(*w));
+	if (!job.chunks || !w) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		job.chunks[i] = start + (__u64)i * ERASE_VERIFY_CHUNK;
+
+	/* partial Fisher-Yates shuffle picks the sample */
+	job.nr_chunks = pct >= 100 ? n : (n * pct + 99) / 100;
+	if (job.nr_chunks < n) {
+		srandom(time(NULL) ^ getpid());
+		for (i = 0; i < job.nr_chunks; i++) {
+			j = i + ((__u64)random() << 31 ^ random()) % (n - i);
+			tmp = job.chunks[i];
+			job.chunks[i] = job.chunks[j];
+			job.chunks[j] = tmp;
+		}
+		qsort(job.chunks, job.nr_chunks, sizeof(*job.chunks), cmp_u64);
+	}
+
+	for (i = 0; i < jobs; i++) {
+		w[i].job = &job;
+		if (posix_memalign(&w[i].buf, 4096, ERASE_VERIFY_CHUNK)) {
+			err = -ENOMEM;
+			break;
+		}
+		if (pthread_create(&w[i].thread, NULL, erase_verify_worker_fn,
+				   &w[i])) {
+			free(w[i].buf);
+			w[i].buf = NULL;
+			err = -EAGAIN;
+			break;
+		}
+	}
+	if (err)
+		job.next = job.nr_chunks;
+
+	for (i = 0; i < jobs && w[i].buf; i++) {
+		pthread_join(w[i].thread, NULL);
+		if (w[i].err && !err)
+			err = -w[i].err;
+		*bytes += w[i].bytes;
+		for (j = 0; j < w[i].bad.n; j++)
+			range_list_add(bad, w[i].bad.r[j].start,
+				       w[i].bad.r[j].end - w[i].bad.r[j].start + 1);
+		free(w[i].bad.r);
+		free(w[i].buf);
+	}
+	range_list_coalesce(bad, ~0ull, 1);
+
+	free(w);
+	free(job.chunks);
+	close(job.fd);
+	return err;
+}
+
+/*
+ * Checks that CMD35/CMD36 addresses [@start, @end] of @device read back as
+ * ERASED_MEM_CONT after @type. Discard and secure trim step 1 leave the
+ * content indeterminate, so their result is only reported.
+ *
+ * Return: 0 if the range reads back erased or is indeterminate, 1 if not.
+ */
+static int erase_verify(const char *device, __u8 *ext_csd,
+			const struct erase_type *type, __u32 start, __u32 end,
+			unsigned int pct, unsigned int jobs)
+{
+	struct range_list bad = {};
+	__u8 expect = ext_csd[EXT_CSD_ERASED_MEM_CONT] ? 0xff : 0x00;
+	bool indeterminate = type->arg == MMC_DISCARD_ARG ||
+			     type->arg == MMC_SECURE_TRIM1_ARG;
+	/* O_DIRECT reads must be whole logical blocks */
+	__u64 bs = ext_csd[EXT_CSD_DATA_SECTOR_SIZE] ? 4096 : 512;
+	__u64 from, to, bytes, nbad = 0, t;
+	size_t i;
+	int ret;
+
+	if (is_blockaddresed(ext_csd)) {
+		from = (__u64)start * 512;
+		to = ((__u64)end + 1) * 512;
+	} else {
+		from = start;
+		to = (__u64)end + 1;
+	}
+	from = (from + bs - 1) / bs * bs;
+	to = to / bs * bs;
+	if (to <= from) {
+		printf("No whole %llu byte block to verify in the range\n",
+		       (unsigned long long)bs);
+		return 0;
+	}
+
+	printf("Verifying %s, %llu MiB, %u%% sampled with %u thread(s), "
+	       "erased is 0x%02x%s\n", device,
+	       (unsigned long long)(to - from) >> 20, pct, jobs, expect,
+	       indeterminate ? ", content is indeterminate" : "");
+
+	catch_interrupts();
+	t = get_time_us();
+	ret = erase_verify_read(device, from, to, pct, jobs, expect, &bad,
+				&bytes);
+	t = get_time_us() - t;
+	printf("Read %llu MiB in %.3f s, %.1f MiB/s\n",
+	       (unsigned long long)bytes >> 20, t / 1000000.0,
+	       t ? bytes / (double)t : 0.0);
+	if (ret) {
+		fprintf(stderr, "Verify read of %s failed: %s\n", device,
+			strerror(-ret));
+		goto out;
+	}
+	if (mmc_interrupted) {
+		fprintf(stderr, "Verify interrupted\n");
+		ret = -EINTR;
+		goto out;
+	}
+
+	for (i = 0; i < bad.n; i++)
+		nbad += bad.r[i].end - bad.r[i].start + 1;
+	if (indeterminate) {
+		printf("%llu of %llu read sectors don't read back as 0x%02x\n",
+		       (unsigned long long)nbad,
+		       (unsigned long long)bytes / 512, expect);
+		goto out;
+	}
+	for (i = 0; i < bad.n; i++)
+		printf("Not erased: sectors %llu - %llu\n",
+		       (unsigned long long)bad.r[i].start,
+		       (unsigned long long)bad.r[i].end);
+	if (nbad) {
+		printf("%llu of %llu read sectors NOT erased\n",
+		       (unsigned long long)nbad,
+		       (unsigned long long)bytes / 512);
+		ret = 1;
+	} else {
+		printf("All %llu read sectors erased\n",
+		       (unsigned long long)bytes / 512);
+	}
+out:
+	free(bad.r);
+	return ret;
+}
+
+static int parse_erase_verify_opt(int c, unsigned int *pct, unsigned int *jobs)
+{
+	switch (c) {
+	case 'V':
+		*pct = strtoul(optarg, NULL, 10);
+		if (!*pct || *pct > 100) {
+			fprintf(stderr, "Verify percentage must be 1 to 100\n");
+			exit(1);
+		}
+		return 0;
+	case 'j':
+		*jobs = strtoul(optarg, NULL, 10);
+		if (!*jobs || *jobs > ERASE_VERIFY_MAX_JOBS) {
+			fprintf(stderr, "Threads must be 1 to %d\n",
+				ERASE_VERIFY_MAX_JOBS);
+			exit(1);
+		}
+		return 0;
+	}
+	return -1;
+}
+
+static __u32 parse_erase_addr(const char *str)
+{
+	if (strstr(str, "0x") || strstr(str, "0X"))
+		return strtol(str, NULL, 16);
+	else
+		return strtol(str, NULL, 10);
+}
+
+int do_erase(int nargs, char **argv)
+{
+	int dev_fd, ret, c;
+	const struct erase_type *type;
+	unsigned int pct = 0, jobs = 4;
+	bool interruptible = false;
+	__u8 ext_csd[512];
+	__u32 start, end;
+
+	while ((c = getopt(nargs, argv, "iV:j:")) != -1)
+		if (c == 'i')
+			interruptible = true;
+		else if (parse_erase_verify_opt(c, &pct, &jobs))
+			exit(1);
+	/* the positional arguments follow */
+	argv += optind - 1;
+	nargs -= optind - 1;
+
+	if (nargs != 5) {
+		fprintf(stderr, "Usage: erase [-i] [-V percent] [-j threads] <type> <start addr> <end addr> </path/to/mmcblkX>\n");
+		exit(1);
+	}
+
+	start = parse_erase_addr(argv[2]);
+	end = parse_erase_addr(argv[3]);
+
+	if (end < start) {
+		fprintf(stderr, "erase start [0x%08x] > erase end [0x%08x]\n",
+			start, end);
+		exit(1);
+	}
+
+	type = find_erase_type(argv[1]);
+	if (!type) {
+		fprintf(stderr, "Unknown erase type: %s\n", argv[1]);
+		exit(1);
+	}
+
+	dev_fd = open(argv[4], O_RDWR);
+	if (dev_fd < 0) {
+		perror(argv[4]);
+		exit(1);
+	}
+
+	if (type->sec_feature) {
+		ret = read_extcsd(dev_fd, ext_csd);
+		if (ret) {
+			fprintf(stderr, "Could not read EXT_CSD from %s\n",
+				argv[4]);
+			goto out;
+		}
+		if ((type->sec_feature & ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT]) !=
+							type->sec_feature) {
+			fprintf(stderr, "%s is not supported in %s\n",
+				type->desc, argv[4]);
+			ret = -ENOTSUP;
+			goto out;
+		}
+
+	}
+	printf("Executing %s from 0x%08x to 0x%08x\n", type->desc, start, end);
+
+	ret = erase(dev_fd, type->arg, start, end, interruptible);
+out:
+	printf(" %s %s!\n\n", type->desc, ret ? "Failed" : "Succeed");
+	if (!ret && pct) {
+		ret = read_extcsd(dev_fd, ext_csd);
+		if (ret)
+			fprintf(stderr, "Could not read EXT_CSD from %s\n",
+				argv[4]);
+		else
+			ret = erase_verify(argv[4], ext_csd, type, start, end,
+					   pct, jobs);
+	}
+	close(dev_fd);
+	return ret;
+}
+
+int do_erase_verify(int nargs, char **argv)
+{
+	const struct erase_type *type;
+	unsigned int pct = 100, jobs = 4;
+	__u8 ext_csd[512];
+	__u32 start, end;
+	int fd, ret, c;
+	char *device;
+
+	while ((c = getopt(nargs, argv, "V:j:")) != -1)
+		if (parse_erase_verify_opt(c, &pct, &jobs))
+			goto usage;
+	if (nargs - optind != 4)
+		goto usage;
+
+	type = find_erase_type(argv[optind]);
+	if (!type) {
+		fprintf(stderr, "Unknown erase type: %s\n", argv[optind]);
+		exit(1);
+	}
+	start = parse_erase_addr(argv[optind + 1]);
+	end = parse_erase_addr(argv[optind + 2]);
+	device = argv[optind + 3];
+	if (end < start) {
+		fprintf(stderr, "erase start [0x%08x] > erase end [0x%08x]\n",
+			start, end);
+		exit(1);
+	}
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	close(fd);
+
+	return erase_verify(device, ext_csd, type, start, end, pct, jobs);
+
+usage:
+	fprintf(stderr, "Usage: mmc erase verify [-V percent] [-j threads] <type> <start addr> <end addr> </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+/* CMD35/CMD36/CMD38 triplets per MULTI_CMD ioctl in discard-ranges */
+#define DISCARD_BATCH_RANGES	(MMC_IOC_MAX_CMDS / 3)
+
+/* "<start> <count>" lines in sectors, blank lines and '#' comments skipped */
+static void read_range_list(const char *path, struct range_list *l)
+{
+	unsigned long long start, count;
+	char line[256], *p;
+	unsigned int lineno = 0;
+	FILE *f;
+
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || !*p)
+			continue;
+		if (sscanf(p, "%lli %lli", &start, &count) != 2) {
+			fprintf(stderr, "%s:%u: expected <start> <count>\n",
+				path, lineno);
+			exit(1);
+		}
+		range_list_add(l, start, count);
+	}
+	if (f != stdin)
+		fclose(f);
+}
+
+/*
+ * A bitmap with one bit per @sectors_per_bit sectors, least significant bit
+ * first, like a filesystem block bitmap: set bits are in use, the runs of
+ * clear bits are free and get discarded.
+ */
+static void read_range_bitmap(const char *path, unsigned int sectors_per_bit,
+			      struct range_list *l)
+{
+	__u64 bit = 0, run = 0, run_start = 0;
+	__u8 buf[4096];
+	size_t len, i;
+	int b;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+		for (i = 0; i < len; i++) {
+			if (buf[i] == 0xff && !run) {
+				bit += 8;
+				continue;
+			}
+			for (b = 0; b < 8; b++, bit++) {
+				if (!(buf[i] & (1 << b))) {
+					if (!run++)
+						run_start = bit;
+					continue;
+				}
+				range_list_add(l, run_start * sectors_per_bit,
+					       run * sectors_per_bit);
+				run = 0;
+			}
+		}
+	}
+	range_list_add(l, run_start * sectors_per_bit, run * sectors_per_bit);
+	fclose(f);
+}
+
+/*
+ * Issues up to DISCARD_BATCH_RANGES ranges in one MULTI_CMD ioctl. CMD38
+ * is sent as R1B, so the host waits for each erase to finish before the
+ * next CMD35 goes out.
+ */
+static int discard_batch(int fd, __u8 *ext_csd, const struct erase_type *type,
+			 const struct sector_range *r, unsigned int n)
+{
+	struct mmc_ioc_multi_cmd *multi_cmd;
+	struct mmc_ioc_cmd *cmd;
+	__u32 mult = is_blockaddresed(ext_csd) ? 1 : 512;
+	__u32 start, end;
+	__u64 timeout_ms;
+	unsigned int i;
+	int ret;
+
+	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+			   3 * n * sizeof(struct mmc_ioc_cmd));
+	if (!multi_cmd) {
+		perror("Failed to allocate memory");
+		return -ENOMEM;
+	}
+	multi_cmd->num_of_cmds = 3 * n;
+
+	for (i = 0; i < n; i++) {
+		start = r[i].start * mult;
+		end = r[i].end * mult;
+		timeout_ms = get_erase_timeout_ms(ext_csd, type->arg, start,
+						  end);
+		if (!timeout_ms || timeout_ms > UINT_MAX)
+			timeout_ms = MMC_ERASE_MAX_TIMEOUT_MS;
+
+		cmd = &multi_cmd->cmds[3 * i];
+		cmd[0].opcode = MMC_ERASE_GROUP_START;
+		cmd[0].arg = start;
+		cmd[0].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+		cmd[0].write_flag = 1;
+
+		cmd[1].opcode = MMC_ERASE_GROUP_END;
+		cmd[1].arg = end;
+		cmd[1].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+		cmd[1].write_flag = 1;
+
+		cmd[2].opcode = MMC_ERASE;
+		cmd[2].arg = type->arg;
+		cmd[2].cmd_timeout_ms = timeout_ms;
+		cmd[2].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+		cmd[2].write_flag = 1;
+	}
+
+	ret = mmc_ioctl(fd, MMC_IOC_MULTI_CMD, multi_cmd);
+	if (ret) {
+		perror("Erase multi-cmd ioctl");
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		cmd = &multi_cmd->cmds[3 * i];
+		if (cmd[1].response[0] & R1_ERASE_PARAM ||
+		    cmd[2].response[0] & R1_ERASE_SEQ_ERROR) {
+			fprintf(stderr, "\n%s of sectors %llu - %llu failed, "
+				"response 0x%08x/0x%08x\n", type->desc,
+				(unsigned long long)r[i].start,
+				(unsigned long long)r[i].end,
+				cmd[1].response[0], cmd[2].response[0]);
+			ret = -EIO;
+		}
+	}
+out:
+	free(multi_cmd);
+	return ret;
+}
+
+int do_discard_ranges(int nargs, char **argv)
+{
+	const struct erase_type *type = find_erase_type("discard");
+	struct range_list ranges = {};
+	const char *list = NULL, *bitmap = NULL, *why;
+	unsigned int sectors_per_bit = 8, n;
+	__u64 size, total = 0, done = 0, t;
+	int fd, ret = 0, c, dry_run = 0;
+	__u8 ext_csd[512];
+	__u32 align;
+	size_t i, j, in;
+	char *device;
+
+	while ((c = getopt(nargs, argv, "t:f:b:u:n")) != -1) {
+		switch (c) {
+		case 't':
+			if (strcmp(optarg, "discard") && strcmp(optarg, "trim") &&
+			    strcmp(optarg, "legacy")) {
+				fprintf(stderr, "Type must be discard, trim or legacy\n");
+				exit(1);
+			}
+			type = find_erase_type(optarg);
+			break;
+		case 'f':
+			list = optarg;
+			break;
+		case 'b':
+			bitmap = optarg;
+			break;
+		case 'u':
+			sectors_per_bit = strtoul(optarg, NULL, 0);
+			if (!sectors_per_bit) {
+				fprintf(stderr, "Invalid sectors per bit: %s\n",
+					optarg);
+				exit(1);
+			}
+			break;
+		case 'n':
+			dry_run = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind != 1 || (list && bitmap))
+		goto usage;
+	device = argv[optind];
+
+	if (bitmap)
+		read_range_bitmap(bitmap, sectors_per_bit, &ranges);
+	else
+		read_range_list(list ? list : "-", &ranges);
+	in = ranges.n;
+
+	fd = open(device, dry_run ? O_RDONLY : O_RDWR);
+	if (fd < 0) {
+		perror(device);
+		exit(1);
+	}
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	why = erase_type_unsupported(ext_csd, type);
+	if (why) {
+		fprintf(stderr, "%s is %s on %s\n", type->desc, why, device);
+		exit(1);
+	}
+
+	/*
+	 * Legacy erase acts on whole erase groups, trim and discard on write
+	 * blocks, which are 4KiB once 512B emulation is disabled.
+	 */
+	if (type->group_granular)
+		align = get_hc_erase_grp_size(ext_csd) * 1024;
+	else
+		align = ext_csd[EXT_CSD_DATA_SECTOR_SIZE] ? 8 : 1;
+	if (!align)
+		align = 1;
+	size = get_size_in_blks(fd);
+	range_list_coalesce(&ranges, size, align);
+
+	for (i = 0; i < ranges.n; i++)
+		total += ranges.r[i].end - ranges.r[i].start + 1;
+	printf("%zu range(s) in, %zu after coalescing and aligning to %u "
+	       "sector(s): %llu sectors (%llu MiB) to %s\n", in, ranges.n,
+	       align, (unsigned long long)total,
+	       (unsigned long long)total / 2048, type->desc);
+
+	if (dry_run) {
+		for (i = 0; i < ranges.n; i++)
+			printf("%llu %llu\n",
+			       (unsigned long long)ranges.r[i].start,
+			       (unsigned long long)(ranges.r[i].end -
+						    ranges.r[i].start + 1));
+		goto out;
+	}
+
+	catch_interrupts();
+	t = get_time_us();
+	for (i = 0; i < ranges.n && !mmc_interrupted; i += n) {
+		n = ranges.n - i;
+		if (n > DISCARD_BATCH_RANGES)
+			n = DISCARD_BATCH_RANGES;
+		ret = discard_batch(fd, ext_csd, type, &ranges.r[i], n);
+		if (ret)
+			break;
+		for (j = i; j < i + n; j++)
+			done += ranges.r[j].end - ranges.r[j].start + 1;
+		printf("\r%s: %zu/%zu ranges, %llu/%llu MiB", type->desc,
+		       i + n, ranges.n, (unsigned long long)done / 2048,
+		       (unsigned long long)total / 2048);
+		fflush(stdout);
+	}
+	t = get_time_us() - t;
+	printf("\n%s %s after %.3f s, %.1f MiB/s\n", type->desc,
+	       ret ? "failed" : mmc_interrupted ? "interrupted" : "done",
+	       t / 1000000.0, t ? done * 512.0 / t : 0.0);
+	if (!ret && mmc_interrupted)
+		ret = -EINTR;
+
+out:
+	free(ranges.r);
+	close(fd);
+	return ret;
+
+usage:
+	fprintf(stderr, "Usage: mmc discard-ranges [-t discard|trim|legacy] [-f list|-b bitmap [-u sectors]] [-n] </path/to/mmcblkX>\n");
+	exit(1);
+}
+
+/*
+ * What each "erase plan" policy may use, in addition to the stronger
+ * policies below it: "discard" only needs the data gone from the host's
+ * view, "erase" needs it to read back as erased and "secure" needs it
+ * purged from the flash.
+ */
+static const struct erase_policy {
+	const char *name;
+	const char *types[3];
+} erase_policies[] = {
+	{ "discard", { "discard", "trim", "legacy" } },
+	{ "erase", { "trim", "legacy" } },
+	{ "secure", { "secure-trim", "secure-erase" } },
+};
+
+struct erase_plan_step {
+	const char *name;
+	const struct erase_type *type[2];	/* secure trim takes two */
+	__u64 timeout_ms;
+	const char *illegal;
+};
+
+static void erase_plan_step_init(struct erase_plan_step *step, __u8 *ext_csd,
+				 const char *name, __u32 start, __u32 end)
+{
+	__u32 grp = get_erase_grp_size(ext_csd);
+	unsigned int i;
+	__u64 timeout;
+
+	memset(step, 0, sizeof(*step));
+	step->name = name;
+	if (!strcmp(name, "secure-trim")) {
+		step->type[0] = find_erase_type("secure-trim1");
+		step->type[1] = find_erase_type("secure-trim2");
+	} else {
+		step->type[0] = find_erase_type(name);
+	}
+
+	for (i = 0; i < 2 && step->type[i]; i++) {
+		step->illegal = erase_type_unsupported(ext_csd, step->type[i]);
+		if (step->illegal)
+			return;
+		if (step->type[i]->group_granular &&
+		    (start % grp || (end + 1) % grp)) {
+			step->illegal = "range not erase group aligned";
+			return;
+		}
+
+		timeout = get_erase_timeout_ms(ext_csd, step->type[i]->arg,
+					       start, end);
+		if (!timeout) {
+			step->illegal = "no timeout in EXT_CSD";
+			return;
+		}
+		step->timeout_ms += timeout;
+	}
+}
+
+int do_erase_plan(int nargs, char **argv)
+{
+	const struct erase_policy *policy = NULL;
+	const char *names[ARRAY_SIZE(erase_policies) * 3];
+	struct erase_plan_step steps[ARRAY_SIZE(names)];
+	struct erase_plan_step *best = NULL;
+	unsigned int nsteps = 0, i, j, k;
+	int dev_fd, ret = 0, dry_run;
+	__u8 ext_csd[512];
+	__u32 start, end;
+	__u64 t;
+	char *device;
+
+	if (nargs != 6) {
+		fprintf(stderr, "Usage: mmc erase plan <-y|-n> <discard|erase|secure> <start addr> <end addr> </path/to/mmcblkX>\n");
+		exit(1);
+	}
+
+	if (!strcmp(argv[1], "-y"))
+		dry_run = 0;
+	else if (!strcmp(argv[1], "-n"))
+		dry_run = 1;
+	else {
+		fprintf(stderr, "Must pass -y or -n\n");
+		exit(1);
+	}
+
+	start = parse_erase_addr(argv[3]);
+	end = parse_erase_addr(argv[4]);
+	device = argv[5];
+
+	if (end < start) {
+		fprintf(stderr, "erase start [0x%08x] > erase end [0x%08x]\n",
+			start, end);
+		exit(1);
 	}
 
-	device = argv[1];
+	/* a policy may use everything a stronger policy may */
+	for (i = 0; i < ARRAY_SIZE(erase_policies); i++) {
+		if (!strcmp(erase_policies[i].name, argv[2]))
+			policy = &erase_policies[i];
+		if (!policy)
+			continue;
+		for (j = 0; j < ARRAY_SIZE(policy->types); j++) {
+			const char *name = erase_policies[i].types[j];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
+			for (k = 0; name && k < nsteps; k++)
+				if (!strcmp(names[k], name))
+					name = NULL;
+			if (name)
+				names[nsteps++] = name;
+		}
+	}
+	if (!policy) {
+		fprintf(stderr, "Unknown erase policy: %s\n", argv[2]);
 		exit(1);
 	}
 
-	ret = read_extcsd(fd, ext_csd);
+	dev_fd = open(device, dry_run ? O_RDONLY : O_RDWR);
+	if (dev_fd < 0) {
+		perror(device);
+		exit(1);
+	}
+
+	ret = read_extcsd(dev_fd, ext_csd);
 	if (ret) {
 		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
 	}
 
-	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V4_5) {
-		fprintf(stderr,
-			"The CACHE option is only availabe on devices >= "
-			"MMC 4.5 %s\n", device);
-		exit(1);
+	printf("Range 0x%08x - 0x%08x: %u erase group(s) of %u KiB\n",
+	       start, end, get_erase_grp_count(ext_csd, start, end),
+	       get_hc_erase_grp_size(ext_csd) * 512);
+	printf("TRIM_MULT %u, ERASE_TIMEOUT_MULT %u, SEC_TRIM_MULT %u, "
+	       "SEC_ERASE_MULT %u\n\n", ext_csd[EXT_CSD_TRIM_MULT],
+	       ext_csd[EXT_CSD_ERASE_TIMEOUT_MULT],
+	       ext_csd[EXT_CSD_SEC_TRIM_MULT], ext_csd[EXT_CSD_SEC_ERASE_MULT]);
+	printf("%-14s %14s\n", "type", "worst case");
+
+	for (i = 0; i < nsteps; i++) {
+		erase_plan_step_init(&steps[i], ext_csd, names[i], start, end);
+		if (steps[i].illegal) {
+			printf("%-14s %13s  (%s)\n", steps[i].name, "-",
+			       steps[i].illegal);
+			continue;
+		}
+		printf("%-14s %11.3f s\n", steps[i].name,
+		       steps[i].timeout_ms / 1000.0);
+		if (!best || steps[i].timeout_ms < best->timeout_ms)
+			best = &steps[i];
 	}
 
-	/* If the cache size is zero, this device does not have a cache */
-	if (!(ext_csd[EXT_CSD_CACHE_SIZE_3] ||
-			ext_csd[EXT_CSD_CACHE_SIZE_2] ||
-			ext_csd[EXT_CSD_CACHE_SIZE_1] ||
-			ext_csd[EXT_CSD_CACHE_SIZE_0])) {
-		fprintf(stderr,
-			"The CACHE option is not available on %s\n",
-			device);
-		exit(1);
+	if (!best) {
+		fprintf(stderr, "\nNo erase type satisfies policy '%s' on %s\n",
+			policy->name, device);
+		ret = -ENOTSUP;
+		goto out;
 	}
-	ret = write_extcsd_value(fd, EXT_CSD_CACHE_CTRL, value, 0);
-	if (ret) {
-		fprintf(stderr,
-			"Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-			value, EXT_CSD_CACHE_CTRL, device);
-		exit(1);
+
+	printf("\nSelected %s, worst case %.3f s\n", best->name,
+	       best->timeout_ms / 1000.0);
+
+	if (dry_run) {
+		fprintf(stderr, "Dry run only, pass -y to erase\n");
+		goto out;
 	}
 
-	close(fd);
+	for (i = 0; i < 2 && best->type[i]; i++) {
+		printf("Executing %s from 0x%08x to 0x%08x\n",
+		       best->type[i]->desc, start, end);
+		t = get_time_us();
+		ret = erase(dev_fd, best->type[i]->arg, start, end, false);
+		if (ret)
+			break;
+		printf(" %s took %.3f s\n", best->type[i]->desc,
+		       (get_time_us() - t) / 1000000.0);
+	}
+	printf(" Erase %s!\n", ret ? "Failed" : "Succeed");
+
+out:
+	close(dev_fd);
 	return ret;
 }
 
-int do_cache_en(int nargs, char **argv)
-{
-	return do_cache_ctrl(1, nargs, argv);
-}
+/* Erase groups per CMD38 in the sanitize pre-pass, bounds each command */
+#define SANITIZE_SLICE_GRPS	64
 
-int do_cache_dis(int nargs, char **argv)
-{
-	return do_cache_ctrl(0, nargs, argv);
-}
+struct sanitize_ctx {
+	__u64 deadline;		/* in get_time_us() time, 0 for none */
+	__u64 start;
+	__u64 last_report;
+};
 
-static int erase(int dev_fd, __u32 argin, __u32 start, __u32 end)
+static bool sanitize_should_stop(void *priv)
 {
-	int ret = 0;
-	struct mmc_ioc_multi_cmd *multi_cmd;
-	__u8 ext_csd[512];
+	struct sanitize_ctx *ctx = priv;
+	__u64 now = get_time_us();
 
-
-	ret = read_extcsd(dev_fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD\n");
-		exit(1);
-	}
-	if (ext_csd[EXT_CSD_ERASE_GROUP_DEF] & 0x01) {
-	  fprintf(stderr, "High Capacity Erase Unit Size=%d bytes\n" \
-                          "High Capacity Erase Timeout=%d ms\n" \
-                          "High Capacity Write Protect Group Size=%d bytes\n",
-			   ext_csd[224]*0x80000,
-			   ext_csd[223]*300,
-                           ext_csd[221]*ext_csd[224]*0x80000);
+	if (now - ctx->last_report >= 1000000) {
+		printf("\rSanitize in progress: %llu s", (now - ctx->start) / 1000000);
+		fflush(stdout);
+		ctx->last_report = now;
 	}
 
-	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
-			   3 * sizeof(struct mmc_ioc_cmd));
-	if (!multi_cmd) {
-		perror("Failed to allocate memory");
-		return -ENOMEM;
-	}
+	return mmc_interrupted || (ctx->deadline && now >= ctx->deadline);
+}
 
-	multi_cmd->num_of_cmds = 3;
-	/* Set erase start address */
-	multi_cmd->cmds[0].opcode = MMC_ERASE_GROUP_START;
-	multi_cmd->cmds[0].arg = start;
-	multi_cmd->cmds[0].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
-	multi_cmd->cmds[0].write_flag = 1;
+/* Last CMD35/CMD36 address of the user area */
+static __u32 get_user_last_addr(__u8 *ext_csd)
+{
+	if (!is_blockaddresed(ext_csd))
+		return get_sector_count(ext_csd) * 512 - 1;
 
-	/* Set erase end address */
-	multi_cmd->cmds[1].opcode = MMC_ERASE_GROUP_END;
-	multi_cmd->cmds[1].arg = end;
-	multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
-	multi_cmd->cmds[1].write_flag = 1;
+	return get_sector_count(ext_csd) - 1;
+}
 
-	/* Send Erase Command */
-	multi_cmd->cmds[2].opcode = MMC_ERASE;
-	multi_cmd->cmds[2].arg = argin;
-	multi_cmd->cmds[2].cmd_timeout_ms = 300*255*255;
-	multi_cmd->cmds[2].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-	multi_cmd->cmds[2].write_flag = 1;
+/* Trims or discards the whole user area, in erase group aligned slices */
+static int sanitize_prepass(int fd, __u8 *ext_csd,
+			    const struct erase_type *type)
+{
+	__u32 grp = get_erase_grp_size(ext_csd);
+	__u32 slice = grp * SANITIZE_SLICE_GRPS;
+	__u32 last = get_user_last_addr(ext_csd);
+	__u32 addr, end;
+	__u64 t = get_time_us();
+	int ret;
 
-	/* send erase cmd with multi-cmd */
-	ret = ioctl(dev_fd, MMC_IOC_MULTI_CMD, multi_cmd);
-	if (ret)
-		perror("Erase multi-cmd ioctl");
+	for (addr = 0; addr <= last && !mmc_interrupted; addr = end + 1) {
+		end = addr + slice - 1;
+		if (end > last || end < addr)
+			end = last;
 
-	/* Does not work for SPI cards */
-	if (multi_cmd->cmds[1].response[0] & R1_ERASE_PARAM) {
-		fprintf(stderr, "Erase start response: 0x%08x\n",
-				multi_cmd->cmds[0].response[0]);
-		ret = -EIO;
-	}
-	if (multi_cmd->cmds[2].response[0] & R1_ERASE_SEQ_ERROR) {
-		fprintf(stderr, "Erase response: 0x%08x\n",
-				multi_cmd->cmds[2].response[0]);
-		ret = -EIO;
+		ret = erase_range(fd, ext_csd, type->arg, addr, end, false);
+		if (ret) {
+			fprintf(stderr, "\n%s of 0x%08x - 0x%08x failed\n",
+				type->desc, addr, end);
+			return ret;
+		}
+		printf("\r%s: %3llu%%", type->desc,
+		       (unsigned long long)end * 100 / last);
+		fflush(stdout);
+		if (end == last)
+			break;
 	}
+	printf("\n%s %s after %.3f s\n", type->desc,
+	       mmc_interrupted ? "interrupted" : "done",
+	       (get_time_us() - t) / 1000000.0);
 
-	free(multi_cmd);
-	return ret;
+	return mmc_interrupted ? -EINTR : 0;
 }
 
-int do_erase(int nargs, char **argv)
+int do_sanitize_run(int nargs, char **argv)
 {
-	int dev_fd, ret;
-	char *print_str;
-	__u8 ext_csd[512], checkup_mask = 0;
-	__u32 arg, start, end;
+	const struct erase_type *prepass = NULL;
+	struct sanitize_ctx ctx = {};
+	struct mmc_ioc_cmd idata = {};
+	unsigned int deadline_s = 0;
+	__u8 ext_csd[512];
+	__u64 bound_ms, elapsed;
+	int fd, ret, c;
+	char *device;
 
-	if (nargs != 5) {
-		fprintf(stderr, "Usage: erase <type> <start addr> <end addr> </path/to/mmcblkX>\n");
-		exit(1);
+	while ((c = getopt(nargs, argv, "p:d:")) != -1) {
+		switch (c) {
+		case 'p':
+			if (strcmp(optarg, "discard") && strcmp(optarg, "trim")) {
+				fprintf(stderr, "Pre-pass must be discard or trim\n");
+				exit(1);
+			}
+			prepass = find_erase_type(optarg);
+			break;
+		case 'd':
+			deadline_s = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			exit(1);
+		}
 	}
 
-	if (strstr(argv[2], "0x") || strstr(argv[2], "0X"))
-		start = strtol(argv[2], NULL, 16);
-	else
-		start = strtol(argv[2], NULL, 10);
-
-	if (strstr(argv[3], "0x") || strstr(argv[3], "0X"))
-		end = strtol(argv[3], NULL, 16);
-	else
-		end = strtol(argv[3], NULL, 10);
+	if (optind != nargs - 1) {
+		fprintf(stderr, "Usage: mmc sanitize run [-p discard|trim] [-d deadline_s] </path/to/mmcblkX>\n");
+		exit(1);
+	}
+	device = argv[optind];
 
-	if (end < start) {
-		fprintf(stderr, "erase start [0x%08x] > erase end [0x%08x]\n",
-			start, end);
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
 		exit(1);
 	}
 
-	if (strcmp(argv[1], "legacy") == 0) {
-		arg = 0x00000000;
-		print_str = "Legacy Erase";
-	} else if (strcmp(argv[1], "discard") == 0) {
-		arg = 0x00000003;
-		print_str = "Discard";
-	} else if (strcmp(argv[1], "secure-erase") == 0) {
-		print_str = "Secure Erase";
-		checkup_mask = EXT_CSD_SEC_ER_EN;
-		arg = 0x80000000;
-	} else if (strcmp(argv[1], "secure-trim1") == 0) {
-		print_str = "Secure Trim Step 1";
-		checkup_mask = EXT_CSD_SEC_ER_EN | EXT_CSD_SEC_GB_CL_EN;
-		arg = 0x80000001;
-	} else if (strcmp(argv[1], "secure-trim2") == 0) {
-		print_str = "Secure Trim Step 2";
-		checkup_mask = EXT_CSD_SEC_ER_EN | EXT_CSD_SEC_GB_CL_EN;
-		arg = 0x80008000;
-	} else if (strcmp(argv[1], "trim") == 0) {
-		print_str = "Trim";
-		checkup_mask = EXT_CSD_SEC_GB_CL_EN;
-		arg = 0x00000001;
-	} else {
-		fprintf(stderr, "Unknown erase type: %s\n", argv[1]);
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
 		exit(1);
 	}
 
-	dev_fd = open(argv[4], O_RDWR);
-	if (dev_fd < 0) {
-		perror(argv[4]);
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V4_5 ||
+	    !(ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT] & EXT_CSD_SEC_SANITIZE)) {
+		fprintf(stderr, "%s does not support sanitize\n", device);
 		exit(1);
 	}
+	if (prepass && erase_type_unsupported(ext_csd, prepass)) {
+		fprintf(stderr, "%s is not supported in %s\n", prepass->desc,
+			device);
+		exit(1);
+	}
+	if (!hpi_prepare(fd, ext_csd) && deadline_s)
+		fprintf(stderr, "%s does not support HPI, the deadline cannot be enforced\n",
+			device);
 
-	if (checkup_mask) {
-		ret = read_extcsd(dev_fd, ext_csd);
-		if (ret) {
-			fprintf(stderr, "Could not read EXT_CSD from %s\n",
-				argv[4]);
-			goto out;
-		}
-		if ((checkup_mask & ext_csd[EXT_CSD_SEC_FEATURE_SUPPORT]) !=
-								checkup_mask) {
-			fprintf(stderr, "%s is not supported in %s\n",
-				print_str, argv[4]);
-			ret = -ENOTSUP;
+	catch_interrupts();
+
+	if (prepass) {
+		ret = sanitize_prepass(fd, ext_csd, prepass);
+		if (ret)
 			goto out;
-		}
+	}
 
+	/*
+	 * The spec gives no sanitize timeout, bound it by what erasing the
+	 * whole device may take.
+	 */
+	bound_ms = get_erase_timeout_ms(ext_csd, MMC_ERASE_ARG, 0,
+					get_user_last_addr(ext_csd));
+	if (!bound_ms || bound_ms > UINT_MAX)
+		bound_ms = UINT_MAX;
+	printf("Sanitize worst case from EXT_CSD: %.3f s\n", bound_ms / 1000.0);
+
+	ctx.start = ctx.last_report = get_time_us();
+	if (deadline_s)
+		ctx.deadline = ctx.start + deadline_s * 1000000ull;
+
+	/*
+	 * Don't make the host wait for busy, completion is polled with CMD13
+	 * below so it can be reported and cut short with HPI. Newer kernels
+	 * wait in the ioctl regardless, and HPI the device themselves once
+	 * cmd_timeout_ms passes.
+	 */
+	fill_switch_cmd(&idata, EXT_CSD_SANITIZE_START, 1);
+	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_AC;
+	idata.cmd_timeout_ms = deadline_s ? deadline_s * 1000 : bound_ms;
+
+	ret = mmc_ioctl(fd, MMC_IOC_CMD, &idata);
+	if (ret) {
+		perror("SANITIZE_START ioctl");
+		goto out;
+	}
+
+	ret = wait_while_prg(fd, 10000, sanitize_should_stop, &ctx, NULL);
+	elapsed = get_time_us() - ctx.start;
+	if (ret == 1) {
+		printf("\n%s, sending HPI\n",
+		       mmc_interrupted ? "Interrupted" : "Deadline passed");
+		hpi_interrupt(fd, ext_csd);
+		printf("Sanitize aborted after %.3f s\n",
+		       (get_time_us() - ctx.start) / 1000000.0);
+		ret = 1;
+	} else if (ret == 0) {
+		printf("\nSanitize completed in %.3f s\n", elapsed / 1000000.0);
+	} else {
+		fprintf(stderr, "\nCould not poll the status of %s\n", device);
 	}
-	printf("Executing %s from 0x%08x to 0x%08x\n", print_str, start, end);
 
-	ret = erase(dev_fd, arg, start, end);
 out:
-	printf(" %s %s!\n\n", print_str, ret ? "Failed" : "Succeed");
-	close(dev_fd);
-	return ret;
+	close(fd);
+	return ret ? 1 : 0;
 }
 
 static void set_ffu_download_cmd(struct mmc_ioc_multi_cmd *multi_cmd,
@@ -3105,7 +10333,7 @@ static int enter_ffu_mode(int dev_fd)
 	memset(&cmd, 0, sizeof(cmd));
 
 	fill_switch_cmd(&cmd, EXT_CSD_MODE_CONFIG, EXT_CSD_FFU_MODE);
-	ret = ioctl(dev_fd, MMC_IOC_CMD, &cmd);
+	ret = mmc_ioctl(dev_fd, MMC_IOC_CMD, &cmd);
 	if (ret)
 		perror("enter FFU mode failed!");
 
@@ -3120,7 +10348,7 @@ static int exit_ffu_mode(int dev_fd)
 	memset(&cmd, 0, sizeof(cmd));
 
 	fill_switch_cmd(&cmd, EXT_CSD_MODE_CONFIG, EXT_CSD_NORMAL_MODE);
-	ret = ioctl(dev_fd, MMC_IOC_CMD, &cmd);
+	ret = mmc_ioctl(dev_fd, MMC_IOC_CMD, &cmd);
 	if (ret)
 		perror("exit FFU mode failed!");
 
@@ -3197,9 +10425,9 @@ do_retry:
 
 		if (num_of_cmds > 1)
 			/* send ioctl with multi-cmd, download firmware bundle */
-			ret = ioctl(dev_fd, MMC_IOC_MULTI_CMD, multi_cmd);
+			ret = mmc_ioctl(dev_fd, MMC_IOC_MULTI_CMD, multi_cmd);
 		else
-			ret = ioctl(dev_fd, MMC_IOC_CMD, &multi_cmd->cmds[0]);
+			ret = mmc_ioctl(dev_fd, MMC_IOC_CMD, &multi_cmd->cmds[0]);
 
 		if (ret) {
 			perror("ioctl failed");
@@ -3213,7 +10441,7 @@ do_retry:
 
 		ret = get_ffu_sectors_programmed(dev_fd, ext_csd);
 		if (ret <= 0) {
-			ioctl(dev_fd, MMC_IOC_CMD, &multi_cmd->cmds[3]);
+			mmc_ioctl(dev_fd, MMC_IOC_CMD, &multi_cmd->cmds[3]);
 			/*
 			 * By spec, host should re-start download from the first sector if
 			 * programmed count is 0
@@ -3268,12 +10496,12 @@ static int do_ffu_install(int dev_fd, const char *device)
 	fill_switch_cmd(&multi_cmd->cmds[1], EXT_CSD_MODE_OPERATION_CODES, EXT_CSD_FFU_INSTALL);
 
 	/* send ioctl with multi-cmd */
-	ret = ioctl(dev_fd, MMC_IOC_MULTI_CMD, multi_cmd);
+	ret = mmc_ioctl(dev_fd, MMC_IOC_MULTI_CMD, multi_cmd);
 	if (ret) {
 		perror("Multi-cmd ioctl failed setting install mode");
 		fill_switch_cmd(&multi_cmd->cmds[1], EXT_CSD_MODE_CONFIG, EXT_CSD_NORMAL_MODE);
 		/* In case multi-cmd ioctl failed before exiting from ffu mode */
-		ioctl(dev_fd, MMC_IOC_CMD, &multi_cmd->cmds[1]);
+		mmc_ioctl(dev_fd, MMC_IOC_CMD, &multi_cmd->cmds[1]);
 		goto out;
 	}
 
@@ -3432,61 +10660,371 @@ int do_opt_ffu4(int nargs, char **argv)
 	return __do_ffu(nargs, argv, FFU_OPT_MODE4);
 }
 
+/*
+ * CMD56 page layouts are vendor specific, and mostly only available under
+ * NDA, so rather than being compiled in they are read from a table of
+ * "<mid> <arg> <field> <offset> <size> [le|be|str]" lines. Only the lines
+ * for the MID in the CID of the device are used.
+ */
+#ifndef MMC_GEN_CMD_LAYOUTS
+#define MMC_GEN_CMD_LAYOUTS	"/etc/mmc-utils/gen_cmd.layouts"
+#endif
+
+#define GEN_CMD_RECORD_MAGIC	"MMCGEN56"
+
+enum gen_cmd_type {
+	GEN_CMD_LE,
+	GEN_CMD_BE,
+	GEN_CMD_STR,
+};
+
+struct gen_cmd_field {
+	__u32 arg;
+	char name[48];
+	unsigned int offset;
+	unsigned int size;
+	enum gen_cmd_type type;
+};
+
+enum gen_cmd_format {
+	GEN_CMD_TEXT,
+	GEN_CMD_JSON,
+	GEN_CMD_RAW,
+};
+
+/* --format raw writes one of these per page */
+struct gen_cmd_record {
+	char magic[8];
+	__le32 arg;
+	__u8 mid;
+	__u8 reserved[3];
+	__le64 time;
+	__u8 data[512];
+} __attribute__((packed));
+
+/*
+ * Return: the number of fields for @mid loaded from @path into *fields,
+ * which the caller frees, or -1 if @path can't be read.
+ */
+static int load_gen_cmd_layouts(const char *path, int mid,
+				struct gen_cmd_field **fields)
+{
+	struct gen_cmd_field f, *tmp;
+	char line[256], type[8], *end;
+	unsigned long lmid, larg;
+	unsigned int lineno = 0;
+	int n = 0, len;
+	FILE *in;
+
+	*fields = NULL;
+	in = fopen(path, "r");
+	if (!in)
+		return -1;
+
+	while (fgets(line, sizeof(line), in)) {
+		lineno++;
+		line[strcspn(line, "#\n")] = '\0';
+		if (!line[strspn(line, " \t")])
+			continue;
+
+		strcpy(type, "le");
+		errno = 0;
+		lmid = strtoul(line, &end, 0);
+		larg = strtoul(end, &end, 0);
+		memset(&f, 0, sizeof(f));
+		if (errno || lmid > 0xff || larg > 0xffffffffUL ||
+		    sscanf(end, " %47[A-Za-z0-9_] %u %u %n", f.name, &f.offset,
+			   &f.size, &len) != 3 ||
+		    (end[len] && sscanf(end + len, "%7s", type) != 1) ||
+		    !f.size || f.offset + f.size > 512) {
+			fprintf(stderr, "%s:%u: expected <mid> <arg> <field> <offset> <size> [le|be|str]\n",
+				path, lineno);
+			continue;
+		}
+		if (!strcmp(type, "le") || !strcmp(type, "be")) {
+			f.type = type[0] == 'l' ? GEN_CMD_LE : GEN_CMD_BE;
+			if (f.size > 8) {
+				fprintf(stderr, "%s:%u: integers are at most 8 bytes\n",
+					path, lineno);
+				continue;
+			}
+		} else if (!strcmp(type, "str")) {
+			f.type = GEN_CMD_STR;
+		} else {
+			fprintf(stderr, "%s:%u: unknown type %s\n", path,
+				lineno, type);
+			continue;
+		}
+		if ((int)lmid != mid)
+			continue;
+		f.arg = larg;
+
+		tmp = realloc(*fields, (n + 1) * sizeof(**fields));
+		if (!tmp) {
+			perror("realloc");
+			exit(1);
+		}
+		*fields = tmp;
+		(*fields)[n++] = f;
+	}
+	fclose(in);
+
+	return n;
+}
+
+static unsigned long long gen_cmd_field_value(const struct gen_cmd_field *f,
+					      const __u8 *buf)
+{
+	unsigned long long v = 0;
+	unsigned int i;
+
+	for (i = 0; i < f->size; i++) {
+		if (f->type == GEN_CMD_BE)
+			v = v << 8 | buf[f->offset + i];
+		else
+			v |= (unsigned long long)buf[f->offset + i] << (8 * i);
+	}
+
+	return v;
+}
+
+static void print_gen_cmd_text(__u32 arg, const __u8 *buf,
+			       const struct gen_cmd_field *fields, int nfields,
+			       bool header)
+{
+	bool decoded = false;
+	unsigned int j;
+	int i;
+
+	if (header)
+		printf("CMD56 arg 0x%08x:\n", arg);
+	for (i = 0; i < nfields; i++) {
+		if (fields[i].arg != arg)
+			continue;
+		decoded = true;
+		printf("  %-32s ", fields[i].name);
+		if (fields[i].type != GEN_CMD_STR) {
+			printf("%llu\n", gen_cmd_field_value(&fields[i], buf));
+			continue;
+		}
+		for (j = 0; j < fields[i].size && buf[fields[i].offset + j]; j++)
+			putchar(isprint(buf[fields[i].offset + j]) ?
+				buf[fields[i].offset + j] : '.');
+		putchar('\n');
+	}
+	if (decoded)
+		return;
+
+	printf("Data:\n");
+	for (j = 0; j < 512; j++) {
+		printf("%2x ", buf[j]);
+		if ((j + 1) % 16 == 0)
+			printf("\n");
+	}
+}
+
+static void print_gen_cmd_json(__u32 arg, const __u8 *buf,
+			       const struct gen_cmd_field *fields, int nfields,
+			       bool first)
+{
+	const char *sep = "";
+	unsigned int j;
+	__u8 c;
+	int i;
+
+	printf("%s\n    { \"arg\": \"0x%08x\", \"fields\": {", first ? "" : ",",
+	       arg);
+	for (i = 0; i < nfields; i++) {
+		if (fields[i].arg != arg)
+			continue;
+		printf("%s\n        \"%s\": ", sep, fields[i].name);
+		sep = ",";
+		if (fields[i].type != GEN_CMD_STR) {
+			printf("%llu", gen_cmd_field_value(&fields[i], buf));
+			continue;
+		}
+		putchar('"');
+		for (j = 0; j < fields[i].size; j++) {
+			c = buf[fields[i].offset + j];
+			if (!c)
+				break;
+			if (c == '"' || c == '\\')
+				printf("\\%c", c);
+			else if (isprint(c))
+				putchar(c);
+			else
+				printf("\\u%04x", c);
+		}
+		putchar('"');
+	}
+	printf("%s},\n      \"data\": \"", *sep ? "\n      " : " ");
+	for (j = 0; j < 512; j++)
+		printf("%02x", buf[j]);
+	printf("\" }");
+}
+
+/* Issues CMD56 with every arg in @args, as few MULTI_CMD ioctls as allowed */
+static int read_gen_cmd_pages(int fd, const __u32 *args, unsigned int n,
+			      __u8 *bufs)
+{
+	struct mmc_ioc_multi_cmd *multi_cmd;
+	unsigned int i, chunk;
+	int ret = 0;
+
+	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+			   MMC_IOC_MAX_CMDS * sizeof(struct mmc_ioc_cmd));
+	if (!multi_cmd) {
+		perror("Failed to allocate memory");
+		return -ENOMEM;
+	}
+
+	while (n && !ret) {
+		chunk = n < MMC_IOC_MAX_CMDS ? n : MMC_IOC_MAX_CMDS;
+		memset(multi_cmd->cmds, 0, chunk * sizeof(struct mmc_ioc_cmd));
+		multi_cmd->num_of_cmds = chunk;
+		for (i = 0; i < chunk; i++) {
+			multi_cmd->cmds[i].opcode = MMC_GEN_CMD;
+			multi_cmd->cmds[i].arg = args[i];
+			multi_cmd->cmds[i].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 |
+						   MMC_CMD_ADTC;
+			multi_cmd->cmds[i].blksz = 512;
+			multi_cmd->cmds[i].blocks = 1;
+			mmc_ioc_cmd_set_data(multi_cmd->cmds[i], bufs + i * 512);
+		}
+
+		ret = mmc_ioctl(fd, MMC_IOC_MULTI_CMD, multi_cmd);
+		if (ret)
+			perror("ioctl");
+		args += chunk;
+		bufs += chunk * 512;
+		n -= chunk;
+	}
+
+	free(multi_cmd);
+	return ret;
+}
+
 int do_general_cmd_read(int nargs, char **argv)
 {
-	int dev_fd;
-	char *device;
-	char *endptr;
-	__u8 buf[512];
-	__u32 arg = 0x01;
-	int ret = -EINVAL, i;
-	struct mmc_ioc_cmd idata;
+	enum gen_cmd_format format = GEN_CMD_TEXT;
+	struct gen_cmd_field *fields = NULL;
+	struct gen_cmd_record rec;
+	const char *layouts = NULL;
+	char cid[64], *device, *endptr;
+	__u32 *args, def_arg = 0x01;
+	__u8 *bufs;
+	unsigned int i, n;
+	int c, dev_fd, nfields, mid = -1;
+	int ret = -EINVAL;
+
+	while ((c = getopt(nargs, argv, "o:l:")) != -1) {
+		switch (c) {
+		case 'o':
+			if (!strcmp(optarg, "text"))
+				format = GEN_CMD_TEXT;
+			else if (!strcmp(optarg, "json"))
+				format = GEN_CMD_JSON;
+			else if (!strcmp(optarg, "raw"))
+				format = GEN_CMD_RAW;
+			else
+				goto usage;
+			break;
+		case 'l':
+			layouts = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind < 1)
+		goto usage;
 
-	if (nargs != 2 && nargs != 3) {
-		fprintf(stderr, "Usage: gen_cmd read </path/to/mmcblkX> [arg]\n");
+	device = argv[optind++];
+	n = nargs - optind;
+	args = n ? calloc(n, sizeof(*args)) : &def_arg;
+	bufs = calloc(n ? n : 1, 512);
+	if (!args || !bufs) {
+		perror("calloc");
 		exit(1);
 	}
+	for (i = 0; i < n; i++) {
+		errno = 0;
+		args[i] = strtoul(argv[optind + i], &endptr, 16);
+		if (errno != 0 || *endptr != '\0' || !(args[i] & 0x1)) {
+			fprintf(stderr, "Wrong ARG, it should be Hex number and bit0 must be 1\n");
+			exit(1);
+		}
+	}
+	if (!n)
+		n = 1;
+
+	get_cid_string(device, cid, sizeof(cid));
+	if (sscanf(cid, "%2x", &i) == 1)
+		mid = i;
+	nfields = load_gen_cmd_layouts(layouts ? layouts : MMC_GEN_CMD_LAYOUTS,
+				       mid, &fields);
+	if (nfields < 0) {
+		if (layouts) {
+			perror(layouts);
+			exit(1);
+		}
+		nfields = 0;
+	}
 
-	device = argv[1];
 	dev_fd = open(device, O_RDWR);
 	if (dev_fd < 0) {
 		perror("device open failed");
 		exit(1);
 	}
 
-	/* arg is specified */
-	if (nargs == 3) {
-		arg = strtol(argv[2], &endptr, 16);
-		if (errno != 0 || *endptr != '\0' || !(arg & 0x1)) {
-			fprintf(stderr, "Wrong ARG, it should be Hex number and bit0 must be 1\n");
-			goto out;
-		}
-	}
-
-	memset(&idata, 0, sizeof(idata));
-	idata.write_flag = 0;
-	idata.opcode = MMC_GEN_CMD;
-	idata.arg = arg;
-	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-	idata.blksz = 512;
-	idata.blocks = 1;
-	mmc_ioc_cmd_set_data(idata, buf);
-
-	ret = ioctl(dev_fd, MMC_IOC_CMD, &idata);
-	if (ret) {
-		perror("ioctl");
+	ret = read_gen_cmd_pages(dev_fd, args, n, bufs);
+	if (ret)
 		goto out;
-	}
 
-	printf("Data:\n");
-	for (i = 0; i < 512; i++) {
-		printf("%2x ", buf[i]);
-		if ((i + 1) % 16 == 0)
-			printf("\n");
+	if (format == GEN_CMD_JSON) {
+		printf("{ \"device\": \"%s\", \"mid\": ", device);
+		printf(mid < 0 ? "null" : "\"0x%02x\"", mid);
+		printf(", \"pages\": [");
+	}
+	for (i = 0; i < n; i++) {
+		switch (format) {
+		case GEN_CMD_TEXT:
+			print_gen_cmd_text(args[i], bufs + i * 512, fields,
+					   nfields, n > 1 || nfields);
+			break;
+		case GEN_CMD_JSON:
+			print_gen_cmd_json(args[i], bufs + i * 512, fields,
+					   nfields, !i);
+			break;
+		case GEN_CMD_RAW:
+			memset(&rec, 0, sizeof(rec));
+			memcpy(rec.magic, GEN_CMD_RECORD_MAGIC, sizeof(rec.magic));
+			rec.arg = htole32(args[i]);
+			rec.mid = mid < 0 ? 0 : mid;
+			rec.time = htole64(time(NULL));
+			memcpy(rec.data, bufs + i * 512, sizeof(rec.data));
+			if (fwrite(&rec, sizeof(rec), 1, stdout) != 1) {
+				perror("stdout");
+				ret = -EIO;
+				goto out;
+			}
+			break;
+		}
 	}
+	if (format == GEN_CMD_JSON)
+		printf("\n  ] }\n");
+
 out:
 	close(dev_fd);
+	free(fields);
+	if (args != &def_arg)
+		free(args);
+	free(bufs);
 	return ret;
+
+usage:
+	fprintf(stderr, "Usage: gen_cmd read [-o text|json|raw] [-l layouts] </path/to/mmcblkX> [arg...]\n");
+	exit(1);
 }
 
 static void issue_cmd0(char *device, __u32 arg)
@@ -3506,7 +11044,7 @@ static void issue_cmd0(char *device, __u32 arg)
 	idata.flags = MMC_RSP_NONE | MMC_CMD_BC;
 
 	/* No need to check for error, it is expected */
-	ioctl(fd, MMC_IOC_CMD, &idata);
+	mmc_ioctl(fd, MMC_IOC_CMD, &idata);
 	close(fd);
 }
 
@@ -3540,11 +11078,47 @@ int do_preidle(int nargs, char **argv)
 	return 0;
 }
 
+/*
+ * Reads @blocks of the enabled boot partition through the alternative boot
+ * operation: CMD0 to pre-idle, then CMD0 with the boot initiation argument.
+ * The device is left in idle state, outside of what the kernel knows.
+ */
+static int alt_boot_read(int fd, __u8 *buf, unsigned int blocks)
+{
+	struct mmc_ioc_multi_cmd *mioc;
+	int ret;
+
+	mioc = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+			   2 * sizeof(struct mmc_ioc_cmd));
+	if (!mioc)
+		return -ENOMEM;
+
+	mioc->num_of_cmds = 2;
+	mioc->cmds[0].opcode = MMC_GO_IDLE_STATE;
+	mioc->cmds[0].arg = MMC_GO_PRE_IDLE_STATE_ARG;
+	mioc->cmds[0].flags = MMC_RSP_NONE | MMC_CMD_AC;
+	mioc->cmds[0].write_flag = 0;
+
+	mioc->cmds[1].opcode = MMC_GO_IDLE_STATE;
+	mioc->cmds[1].arg = MMC_BOOT_INITIATION_ARG;
+	mioc->cmds[1].flags = MMC_RSP_NONE | MMC_CMD_ADTC;
+	mioc->cmds[1].write_flag = 0;
+	mioc->cmds[1].blksz = 512;
+	mioc->cmds[1].blocks = blocks;
+	/* Access time of boot part differs wildly, spec mandates 1s */
+	mioc->cmds[1].data_timeout_ns = 2 * 1000 * 1000 * 1000;
+	mmc_ioc_cmd_set_data(mioc->cmds[1], buf);
+
+	ret = mmc_ioctl(fd, MMC_IOC_MULTI_CMD, mioc);
+	free(mioc);
+
+	return ret;
+}
+
 int do_alt_boot_op(int nargs, char **argv)
 {
 	int fd, ret, boot_data_fd;
 	char *device, *boot_data_file;
-	struct mmc_ioc_multi_cmd *mioc;
 	__u8 ext_csd[512];
 	__u8 *boot_buf;
 	unsigned int boot_blocks, ext_csd_boot_size;
@@ -3592,31 +11166,13 @@ int do_alt_boot_op(int nargs, char **argv)
 	}
 
 	boot_buf = calloc(1, sizeof(__u8) * boot_blocks * 512);
-	mioc = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
-			   2 * sizeof(struct mmc_ioc_cmd));
-	if (!mioc || !boot_buf) {
+	if (!boot_buf) {
 		perror("Failed to allocate memory");
 		ret = -ENOMEM;
 		goto alloced_error;
 	}
 
-	mioc->num_of_cmds = 2;
-	mioc->cmds[0].opcode = MMC_GO_IDLE_STATE;
-	mioc->cmds[0].arg = MMC_GO_PRE_IDLE_STATE_ARG;
-	mioc->cmds[0].flags = MMC_RSP_NONE | MMC_CMD_AC;
-	mioc->cmds[0].write_flag = 0;
-
-	mioc->cmds[1].opcode = MMC_GO_IDLE_STATE;
-	mioc->cmds[1].arg = MMC_BOOT_INITIATION_ARG;
-	mioc->cmds[1].flags = MMC_RSP_NONE | MMC_CMD_ADTC;
-	mioc->cmds[1].write_flag = 0;
-	mioc->cmds[1].blksz = 512;
-	mioc->cmds[1].blocks = boot_blocks;
-	/* Access time of boot part differs wildly, spec mandates 1s */
-	mioc->cmds[1].data_timeout_ns = 2 * 1000 * 1000 * 1000;
-	mmc_ioc_cmd_set_data(mioc->cmds[1], boot_buf);
-
-	ret = ioctl(fd, MMC_IOC_MULTI_CMD, mioc);
+	ret = alt_boot_read(fd, boot_buf, boot_blocks);
 	if (ret) {
 		perror("multi-cmd ioctl error\n");
 		goto alloced_error;
@@ -3630,8 +11186,6 @@ int do_alt_boot_op(int nargs, char **argv)
 	ret = 0;
 
 alloced_error:
-	if (mioc)
-		free(mioc);
 	if (boot_buf)
 		free(boot_buf);
 boot_data_close:
@@ -3642,3 +11196,596 @@ dev_fd_close:
 		exit(1);
 	return 0;
 }
+
+static const struct boot_bus_mode {
+	const char *name;
+	__u8 value;		/* BOOT_BUS_CONDITIONS boot mode bits */
+	__u8 boot_info;		/* BOOT_INFO bit the mode depends on */
+} boot_bus_modes[] = {
+	{ "single_backward", 0x00, 0 },
+	{ "single_hs", 0x08, EXT_CSD_BOOT_INFO_HS_MODE },
+	{ "dual", 0x10, EXT_CSD_BOOT_INFO_DDR_DDR },
+};
+
+static const struct boot_bus_width {
+	const char *name;
+	__u8 value;
+} boot_bus_widths[] = {
+	{ "x1", 0x0 },
+	{ "x4", 0x1 },
+	{ "x8", 0x2 },
+};
+
+#define BOOT_BENCH_RECOVER_TRIES	5
+
+/* Turns "x1,x8" into a mask of boot_bus_widths[] indexes, 0 if invalid */
+static unsigned int parse_boot_widths(char *str)
+{
+	unsigned int mask = 0, j;
+	char *tok;
+
+	for (tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+		for (j = 0; j < ARRAY_SIZE(boot_bus_widths); j++)
+			if (!strcmp(tok, boot_bus_widths[j].name))
+				break;
+		if (j == ARRAY_SIZE(boot_bus_widths))
+			return 0;
+		mask |= 1 << j;
+	}
+
+	return mask;
+}
+
+/*
+ * After an alternative boot operation the device sits in idle state. A
+ * regular read then fails, which makes the kernel reset and reinitialize
+ * the device, after which EXT_CSD can be read and written again.
+ */
+static int boot_bench_recover(const char *device, int fd, __u8 *ext_csd)
+{
+	void *buf;
+	int i, dfd;
+
+	if (posix_memalign(&buf, 4096, 4096))
+		return -ENOMEM;
+
+	for (i = 0; i < BOOT_BENCH_RECOVER_TRIES; i++) {
+		dfd = open(device, O_RDONLY | O_DIRECT);
+		if (dfd >= 0) {
+			if (pread(dfd, buf, 4096, 0) < 0)
+				usleep(100 * 1000);
+			close(dfd);
+		}
+		if (!read_extcsd(fd, ext_csd))
+			break;
+	}
+	free(buf);
+
+	return i < BOOT_BENCH_RECOVER_TRIES ? 0 : -EIO;
+}
+
+int do_boot_bench(int nargs, char **argv)
+{
+	const struct boot_bus_mode *m;
+	const struct boot_bus_width *w;
+	__u8 ext_csd[512], orig, value;
+	__u64 *ttfb, *xfer, start;
+	unsigned int iterations = 10, blocks = 0, i, j, k, n, errors;
+	unsigned int widths = (1 << ARRAY_SIZE(boot_bus_widths)) - 1;
+	char *device, label[32];
+	__u8 *buf;
+	int c, fd, ret = 0;
+
+	while ((c = getopt(nargs, argv, "n:s:w:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			blocks = strtoul(optarg, NULL, 0) / 512;
+			break;
+		case 'w':
+			widths = parse_boot_widths(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: mmc boot bench [-n iterations] [-s bytes] [-w x1,x4,x8] </path/to/mmcblkX>\n");
+			exit(1);
+		}
+	}
+	if (nargs != optind + 1 || !iterations || !widths) {
+		fprintf(stderr, "Usage: mmc boot bench [-n iterations] [-s bytes] [-w x1,x4,x8] </path/to/mmcblkX>\n");
+		exit(1);
+	}
+	device = argv[optind];
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	ret = read_extcsd(fd, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
+		exit(1);
+	}
+	if (!(ext_csd[EXT_CSD_BOOT_INFO] & EXT_CSD_BOOT_INFO_ALT)) {
+		fprintf(stderr, "%s does not support alternative boot mode\n",
+			device);
+		exit(1);
+	}
+	if (ext_csd[EXT_CSD_PART_CONFIG] & EXT_CSD_PART_CONFIG_ACC_ACK) {
+		fprintf(stderr, "Boot Ack must not be enabled\n");
+		exit(1);
+	}
+	if (!(ext_csd[EXT_CSD_PART_CONFIG] & (7 << 3))) {
+		fprintf(stderr, "No boot partition is enabled, see 'bootpart enable'\n");
+		exit(1);
+	}
+
+	if (!blocks || blocks > MMC_IOC_MAX_BYTES / 512)
+		blocks = MMC_IOC_MAX_BYTES / 512;
+	if (blocks > ext_csd[EXT_CSD_BOOT_MULT] * 128 * 2)
+		blocks = ext_csd[EXT_CSD_BOOT_MULT] * 128 * 2;
+
+	buf = calloc(blocks, 512);
+	ttfb = calloc(iterations, sizeof(*ttfb));
+	xfer = calloc(iterations, sizeof(*xfer));
+	if (!buf || !ttfb || !xfer) {
+		perror("calloc");
+		exit(1);
+	}
+
+	orig = ext_csd[EXT_CSD_BOOT_BUS_CONDITIONS];
+	catch_interrupts();
+
+	printf("%u x %u KiB alternative boot reads per mode\n", iterations,
+	       blocks / 2);
+	printf("%-22s %6s %10s %10s %10s %10s\n", "mode", "errors",
+	       "ttfb ms", "ttfb p90", "MB/s", "p10 MB/s");
+
+	for (i = 0; i < ARRAY_SIZE(boot_bus_modes) && !mmc_interrupted; i++) {
+		m = &boot_bus_modes[i];
+		if (m->boot_info && !(ext_csd[EXT_CSD_BOOT_INFO] & m->boot_info))
+			continue;
+
+		for (j = 0; j < ARRAY_SIZE(boot_bus_widths); j++) {
+			w = &boot_bus_widths[j];
+			if (!(widths & (1 << j)) || mmc_interrupted)
+				continue;
+
+			/* Keep RESET_BOOT_BUS_CONDITIONS as configured */
+			value = (orig & 0x4) | m->value | w->value;
+			ret = write_extcsd_value(fd, EXT_CSD_BOOT_BUS_CONDITIONS,
+						 value, 0);
+			if (ret) {
+				fprintf(stderr, "Could not set BOOT_BUS_CONDITIONS to 0x%02x\n",
+					value);
+				goto restore;
+			}
+
+			/* A one block read is the time to first byte */
+			for (k = 0, n = 0, errors = 0; k < iterations; k++) {
+				start = get_time_us();
+				if (alt_boot_read(fd, buf, 1)) {
+					errors++;
+					continue;
+				}
+				ttfb[n] = get_time_us() - start;
+
+				start = get_time_us();
+				if (alt_boot_read(fd, buf, blocks)) {
+					errors++;
+					continue;
+				}
+				xfer[n++] = get_time_us() - start;
+			}
+
+			snprintf(label, sizeof(label), "%s %s", m->name,
+				 w->name);
+			qsort(ttfb, n, sizeof(*ttfb), cmp_u64);
+			qsort(xfer, n, sizeof(*xfer), cmp_u64);
+			if (n)
+				printf("%-22s %6u %10.3f %10.3f %10.2f %10.2f\n",
+				       label, errors,
+				       percentile(ttfb, n, 50) / 1000.0,
+				       percentile(ttfb, n, 90) / 1000.0,
+				       blocks * 512.0 / percentile(xfer, n, 50),
+				       blocks * 512.0 / percentile(xfer, n, 90));
+			else
+				printf("%-22s %6u %10s %10s %10s %10s\n",
+				       label, errors, "-", "-", "-", "-");
+
+			ret = boot_bench_recover(device, fd, ext_csd);
+			if (ret) {
+				fprintf(stderr, "%s did not come back after the boot reads\n",
+					device);
+				goto out;
+			}
+		}
+	}
+
+restore:
+	if (write_extcsd_value(fd, EXT_CSD_BOOT_BUS_CONDITIONS, orig, 0)) {
+		fprintf(stderr, "Could not restore BOOT_BUS_CONDITIONS to 0x%02x\n",
+			orig);
+		ret = -EIO;
+	}
+out:
+	free(buf);
+	free(ttfb);
+	free(xfer);
+	close(fd);
+	return ret ? 1 : 0;
+}
+
+/* Records of a trace that share their command sequence */
+struct replay_group {
+	char sig[48];
+	unsigned int count;
+	__u64 rec_us;
+	__u64 rep_us;
+	__u64 rec_max_us;
+	__u64 rep_max_us;
+};
+
+static struct replay_group *replay_group(struct replay_group **groups,
+					 unsigned int *n, const char *sig)
+{
+	struct replay_group *g;
+	unsigned int i;
+
+	for (i = 0; i < *n; i++)
+		if (!strcmp((*groups)[i].sig, sig))
+			return &(*groups)[i];
+
+	g = realloc(*groups, (*n + 1) * sizeof(**groups));
+	if (!g) {
+		perror("realloc");
+		exit(1);
+	}
+	*groups = g;
+	g = &g[(*n)++];
+	memset(g, 0, sizeof(*g));
+	snprintf(g->sig, sizeof(g->sig), "%s", sig);
+
+	return g;
+}
+
+/*
+ * Reads the next record of a trace into *buf (grown as needed).
+ * Return: 1 for a record, 0 at the end of the trace, or -1 on error.
+ */
+static int read_trace_record(FILE *in, __u8 **buf, size_t *cap)
+{
+	const struct mmc_trace_cmd *tc;
+	struct mmc_trace_hdr hdr;
+	size_t len, off;
+	unsigned int i;
+	__u64 data;
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1)
+		return ferror(in) || !feof(in) ? -1 : 0;
+	len = le32toh(hdr.len);
+	if (len < sizeof(hdr) +
+		  le16toh(hdr.ncmds) * sizeof(struct mmc_trace_cmd)) {
+		fprintf(stderr, "Corrupt trace record\n");
+		return -1;
+	}
+	if (len > *cap) {
+		free(*buf);
+		*buf = malloc(len);
+		if (!*buf) {
+			perror("malloc");
+			exit(1);
+		}
+		*cap = len;
+	}
+	memcpy(*buf, &hdr, sizeof(hdr));
+	if (fread(*buf + sizeof(hdr), len - sizeof(hdr), 1, in) != 1) {
+		fprintf(stderr, "Truncated trace record\n");
+		return -1;
+	}
+
+	/* the entries and the data of writes must add up to the record */
+	off = sizeof(hdr);
+	for (i = 0; i < le16toh(hdr.ncmds); i++) {
+		if (len - off < sizeof(*tc))
+			break;
+		tc = (const void *)(*buf + off);
+		off += sizeof(*tc);
+		if (!tc->write_flag)
+			continue;
+		data = (__u64)le32toh(tc->blksz) * le32toh(tc->blocks);
+		if (data > len - off)
+			break;
+		off += data;
+	}
+	if (i < le16toh(hdr.ncmds) || off != len) {
+		fprintf(stderr, "Corrupt trace record\n");
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Turns a trace record back into ioctl commands, pointing the data of
+ * writes at the trace and that of reads at @data. @cmds and @data are
+ * sized for the record by the caller.
+ */
+static void trace_to_cmds(const __u8 *rec, struct mmc_ioc_cmd *cmds,
+			  __u8 **data, size_t *data_cap, char *sig,
+			  size_t sig_len)
+{
+	const struct mmc_trace_hdr *hdr = (const void *)rec;
+	const struct mmc_trace_cmd *tc;
+	unsigned int i, n = le16toh(hdr->ncmds);
+	const __u8 *p = rec + sizeof(*hdr);
+	size_t len, reads = 0, off = 0;
+	int l = 0;
+
+	for (i = 0, tc = (const void *)p; i < n; i++) {
+		len = (size_t)le32toh(tc->blksz) * le32toh(tc->blocks);
+		if (!tc->write_flag)
+			reads += len;
+		tc = (const void *)((const __u8 *)(tc + 1) +
+				    (tc->write_flag ? len : 0));
+	}
+	if (reads > *data_cap) {
+		free(*data);
+		*data = malloc(reads);
+		if (!*data) {
+			perror("malloc");
+			exit(1);
+		}
+		*data_cap = reads;
+	}
+
+	sig[0] = '\0';
+	for (i = 0; i < n; i++) {
+		tc = (const void *)p;
+		memset(&cmds[i], 0, sizeof(cmds[i]));
+		cmds[i].opcode = le32toh(tc->opcode);
+		cmds[i].arg = le32toh(tc->arg);
+		cmds[i].flags = le32toh(tc->flags);
+		cmds[i].blksz = le32toh(tc->blksz);
+		cmds[i].blocks = le32toh(tc->blocks);
+		cmds[i].cmd_timeout_ms = le32toh(tc->cmd_timeout_ms);
+		cmds[i].postsleep_min_us = le32toh(tc->postsleep_min_us);
+		cmds[i].postsleep_max_us = le32toh(tc->postsleep_max_us);
+		cmds[i].data_timeout_ns = le32toh(tc->data_timeout_ns);
+		cmds[i].write_flag = le32toh(tc->write_flag);
+		cmds[i].is_acmd = tc->is_acmd;
+		len = (size_t)cmds[i].blksz * cmds[i].blocks;
+		p += sizeof(*tc);
+		if (cmds[i].write_flag) {
+			mmc_ioc_cmd_set_data(cmds[i], p);
+			p += len;
+		} else {
+			mmc_ioc_cmd_set_data(cmds[i], *data + off);
+			off += len;
+		}
+
+		if (l < (int)sig_len)
+			l += snprintf(sig + l, sig_len - l, "%s%sCMD%u",
+				      i ? "+" : "", cmds[i].is_acmd ? "A" : "",
+				      cmds[i].opcode);
+	}
+}
+
+static void print_trace_record(unsigned int idx, const __u8 *rec,
+			       __u64 first_us)
+{
+	const struct mmc_trace_hdr *hdr = (const void *)rec;
+	const struct mmc_trace_cmd *tc;
+	const __u8 *p = rec + sizeof(*hdr);
+	unsigned int i, j, n = le16toh(hdr->ncmds);
+
+	printf("#%-6u +%-12.3f %8llu us%s", idx,
+	       (le64toh(hdr->start_us) - first_us) / 1000.0,
+	       (unsigned long long)le64toh(hdr->time_us),
+	       hdr->multi ? " multi" : "");
+	if (hdr->err)
+		printf(" %s", strerror(le32toh(hdr->err)));
+	printf("\n");
+
+	for (i = 0; i < n; i++) {
+		tc = (const void *)p;
+		printf("        %sCMD%-2u arg 0x%08x resp 0x%08x",
+		       tc->is_acmd ? "A" : "", le32toh(tc->opcode),
+		       le32toh(tc->arg), le32toh(tc->response[0]));
+		if (tc->blocks) {
+			printf(" %s %ux%u ", !tc->write_flag ? "R" :
+			       le32toh(tc->write_flag) & (1U << 31) ? "W rel" :
+			       "W",
+			       le32toh(tc->blocks), le32toh(tc->blksz));
+			for (j = 0; j < sizeof(tc->digest); j++)
+				printf("%02x", tc->digest[j]);
+		}
+		if (tc->trace_flags & MMC_TRACE_SCRUBBED)
+			printf(" (RPMB key not recorded)");
+		printf("\n");
+		p += sizeof(*tc);
+		if (tc->write_flag)
+			p += (size_t)le32toh(tc->blksz) * le32toh(tc->blocks);
+	}
+}
+
+int do_replay(int nargs, char **argv)
+{
+	struct replay_group *groups = NULL, *g;
+	struct mmc_ioc_multi_cmd *multi_cmd = NULL;
+	const struct mmc_trace_hdr *hdr;
+	const struct mmc_trace_cmd *tc;
+	struct mmc_ioc_cmd *cmds;
+	__u8 *rec = NULL, *data = NULL, digest[8];
+	size_t rec_cap = 0, data_cap = 0;
+	unsigned int i, n, idx = 0, ngroups = 0;
+	unsigned int err_diff = 0, resp_diff = 0, data_diff = 0;
+	__u64 first_us = 0, last_end_us = 0, start, t, gap;
+	bool issue = false, gaps = false;
+	char magic[8], sig[48];
+	const char *p;
+	int c, fd = -1, ret = 0, err;
+	FILE *in;
+
+	while ((c = getopt(nargs, argv, "yg")) != -1) {
+		switch (c) {
+		case 'y':
+			issue = true;
+			break;
+		case 'g':
+			gaps = true;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (nargs - optind != (issue ? 2 : 1))
+		goto usage;
+
+	in = fopen(argv[optind], "r");
+	if (!in) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	if (fread(magic, sizeof(magic), 1, in) != 1 ||
+	    memcmp(magic, MMC_TRACE_MAGIC, sizeof(magic))) {
+		fprintf(stderr, "%s is not an mmc ioctl trace\n", argv[optind]);
+		exit(1);
+	}
+
+	if (issue) {
+		fd = open(argv[optind + 1], O_RDWR);
+		if (fd < 0) {
+			perror("open");
+			exit(1);
+		}
+		multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+				   MMC_IOC_MAX_CMDS * sizeof(struct mmc_ioc_cmd));
+		if (!multi_cmd) {
+			perror("Failed to allocate memory");
+			exit(1);
+		}
+		catch_interrupts();
+	}
+
+	while (!mmc_interrupted &&
+	       (ret = read_trace_record(in, &rec, &rec_cap)) > 0) {
+		hdr = (const void *)rec;
+		n = le16toh(hdr->ncmds);
+		if (!idx)
+			first_us = le64toh(hdr->start_us);
+		if (!issue) {
+			print_trace_record(idx++, rec, first_us);
+			continue;
+		}
+		if (!n || n > MMC_IOC_MAX_CMDS) {
+			fprintf(stderr, "#%u: %u commands can't be issued\n",
+				idx, n);
+			ret = -1;
+			break;
+		}
+
+		p = (const char *)(rec + sizeof(*hdr));
+		for (i = 0; i < n; i++) {
+			tc = (const void *)p;
+			if (tc->trace_flags & MMC_TRACE_SCRUBBED)
+				break;
+			p += sizeof(*tc);
+			if (tc->write_flag)
+				p += (size_t)le32toh(tc->blksz) *
+				     le32toh(tc->blocks);
+		}
+		if (i < n) {
+			fprintf(stderr, "#%u: RPMB key programming not recorded, skipped\n",
+				idx++);
+			continue;
+		}
+
+		/* -g keeps the idle time the trace had between ioctls */
+		if (gaps && idx) {
+			gap = le64toh(hdr->start_us) - last_end_us;
+			if (gap < 10000000)
+				usleep(gap);
+		}
+		last_end_us = le64toh(hdr->start_us) + le64toh(hdr->time_us);
+
+		cmds = multi_cmd->cmds;
+		trace_to_cmds(rec, cmds, &data, &data_cap, sig, sizeof(sig));
+		multi_cmd->num_of_cmds = n;
+
+		start = get_time_us();
+		if (hdr->multi)
+			err = mmc_ioctl(fd, MMC_IOC_MULTI_CMD, multi_cmd);
+		else
+			err = mmc_ioctl(fd, MMC_IOC_CMD, cmds);
+		err = err ? errno : 0;
+		t = get_time_us() - start;
+
+		if (err != (int)le32toh(hdr->err)) {
+			err_diff++;
+			fprintf(stderr, "#%u %s: %s, recorded %s\n", idx, sig,
+				err ? strerror(err) : "success",
+				hdr->err ? strerror(le32toh(hdr->err)) :
+					   "success");
+		}
+
+		p = (const char *)(rec + sizeof(*hdr));
+		for (i = 0; i < n && !err; i++) {
+			tc = (const void *)p;
+			if (cmds[i].response[0] != le32toh(tc->response[0]))
+				resp_diff++;
+			if (!cmds[i].write_flag && cmds[i].blocks) {
+				mmc_trace_digest(&cmds[i], digest);
+				if (memcmp(digest, tc->digest, sizeof(digest)))
+					data_diff++;
+			}
+			p += sizeof(*tc);
+			if (tc->write_flag)
+				p += (size_t)cmds[i].blksz * cmds[i].blocks;
+		}
+
+		g = replay_group(&groups, &ngroups, sig);
+		g->count++;
+		g->rec_us += le64toh(hdr->time_us);
+		g->rep_us += t;
+		if (le64toh(hdr->time_us) > g->rec_max_us)
+			g->rec_max_us = le64toh(hdr->time_us);
+		if (t > g->rep_max_us)
+			g->rep_max_us = t;
+		idx++;
+	}
+	fclose(in);
+
+	if (issue) {
+		printf("%-32s %6s %12s %12s %12s %12s %8s\n", "commands",
+		       "count", "recorded us", "replayed us", "rec max us",
+		       "rep max us", "change");
+		for (i = 0; i < ngroups; i++) {
+			g = &groups[i];
+			printf("%-32s %6u %12.1f %12.1f %12llu %12llu %+7.1f%%\n",
+			       g->sig, g->count, (double)g->rec_us / g->count,
+			       (double)g->rep_us / g->count,
+			       (unsigned long long)g->rec_max_us,
+			       (unsigned long long)g->rep_max_us,
+			       g->rec_us ? 100.0 * g->rep_us / g->rec_us - 100 :
+					   0.0);
+		}
+		printf("%u ioctls replayed%s: %u with a different outcome, %u responses and %u read data differ\n",
+		       idx, mmc_interrupted ? " (interrupted)" : "", err_diff,
+		       resp_diff, data_diff);
+		close(fd);
+	}
+
+	free(groups);
+	free(multi_cmd);
+	free(rec);
+	free(data);
+	return ret < 0 || err_diff ? 1 : 0;
+
+usage:
+	fprintf(stderr, "Usage: mmc replay [-y] [-g] <trace> [device]\n");
+	exit(1);
+}
@@ -20,6 +20,9 @@
 /* mmc_cmds.c */
 int do_read_extcsd(int nargs, char **argv);
 int do_write_extcsd(int nargs, char **argv);
+int do_dump_extcsd(int nargs, char **argv);
+int do_decode_extcsd(int nargs, char **argv);
+int do_diff_extcsd(int nargs, char **argv);
 int do_writeprotect_boot_get(int nargs, char **argv);
 int do_writeprotect_boot_set(int nargs, char **argv);
 int do_writeprotect_user_get(int nargs, char **argv);
@@ -28,17 +31,29 @@ int do_disable_512B_emulation(int nargs, char **argv);
 int do_write_boot_en(int nargs, char **argv);
 int do_boot_bus_conditions_set(int nargs, char **argv);
 int do_write_bkops_en(int nargs, char **argv);
+int do_bkops_run(int nargs, char **argv);
 int do_hwreset_en(int nargs, char **argv);
 int do_hwreset_dis(int nargs, char **argv);
 int do_sanitize(int nargs, char **argv);
+int do_sanitize_run(int nargs, char **argv);
 int do_status_get(int nargs, char **argv);
 int do_create_gp_partition(int nargs, char **argv);
 int do_enh_area_set(int nargs, char **argv);
 int do_write_reliability_set(int nargs, char **argv);
+int do_layout_plan(int nargs, char **argv);
 int do_rpmb_write_key(int nargs, char **argv);
 int do_rpmb_read_counter(int nargs, char **argv);
 int do_rpmb_read_block(int nargs, char **argv);
 int do_rpmb_write_block(int nargs, char **argv);
+int do_rpmb_kv_format(int nargs, char **argv);
+int do_rpmb_kv_put(int nargs, char **argv);
+int do_rpmb_kv_get(int nargs, char **argv);
+int do_rpmb_kv_del(int nargs, char **argv);
+int do_rpmb_kv_list(int nargs, char **argv);
+int do_rpmb_kv_compact(int nargs, char **argv);
+int do_rpmb_counter(int nargs, char **argv);
+int do_rpmb_write_batch(int nargs, char **argv);
+int do_rpmb_provision(int nargs, char **argv);
 int do_rpmb_sec_wp_enable(int nargs, char **argv);
 int do_rpmb_sec_wp_disable(int nargs, char **argv);
 int do_rpmb_sec_wp_mode_set(int nargs, char **argv);
@@ -46,6 +61,9 @@ int do_rpmb_sec_wp_mode_clear(int nargs, char **argv);
 int do_rpmb_sec_wp_en_read(int nargs, char **argv);
 int do_cache_en(int nargs, char **argv);
 int do_cache_dis(int nargs, char **argv);
+int do_cache_flush(int nargs, char **argv);
+int do_cache_barrier(int nargs, char **argv);
+int do_cache_bench(int nargs, char **argv);
 int do_ffu(int nargs, char **argv);
 int do_opt_ffu1(int nargs, char **argv);
 int do_opt_ffu2(int nargs, char **argv);
@@ -55,7 +73,23 @@ int do_read_scr(int argc, char **argv);
 int do_read_cid(int argc, char **argv);
 int do_read_csd(int argc, char **argv);
 int do_erase(int nargs, char **argv);
+int do_erase_plan(int nargs, char **argv);
+int do_erase_verify(int nargs, char **argv);
+int do_discard_ranges(int nargs, char **argv);
 int do_general_cmd_read(int nargs, char **argv);
 int do_softreset(int nargs, char **argv);
 int do_preidle(int nargs, char **argv);
 int do_alt_boot_op(int nargs, char **argv);
+int do_align_check(int nargs, char **argv);
+int do_bench(int nargs, char **argv);
+int do_cmdq_bench(int nargs, char **argv);
+int do_wear(int nargs, char **argv);
+int do_exporter(int nargs, char **argv);
+int do_power_notify(int nargs, char **argv);
+int do_power_awake(int nargs, char **argv);
+int do_boot_image_write(int nargs, char **argv);
+int do_boot_image_read(int nargs, char **argv);
+int do_boot_image_verify(int nargs, char **argv);
+int do_boot_bench(int nargs, char **argv);
+int do_replay(int nargs, char **argv);
+int mmc_trace_open(const char *path);